@@ -6,124 +6,4582 @@
  */
 
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <setjmp.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
 
+extern char **environ;
+
+// Commands we've already found on PATH, so running one again doesn't have to
+// search every directory.  Open addressing on a power of two table, grown
+// when it's half full.  path_seen is the PATH the table was filled from, and
+// the whole table is dropped once PATH is different
+struct hash_entry
+{
+  char *name;
+  char *path;
+  unsigned int hits;
+};
+
+struct hash_entry *path_hash = NULL;
+unsigned int path_hash_size = 0;
+unsigned int path_hash_used = 0;
+char *path_seen = NULL;
+
+// Set to 0 with "splice off" to run cat and tee in pipelines as the real
+// programs instead of in the shell
+int splice_builtins = 1;
+
+// One command in a pipeline.  Stages the shell runs itself have no pid and
+// a thread instead
+#define STAGE_RUNNING 0
+#define STAGE_STOPPED 1
+#define STAGE_DONE 2
+
+struct stage
+{
+  char **argv;
+  char *in_file;
+  char *out_file;
+  int append;
+  int in;
+  int out;
+  pid_t pid;
+  int state;
+  int status;
+  struct timespec start;   // When it was launched
+  struct rusage usage;     // What wait4 said it used, once it's done
+  int threaded;
+  pthread_t thread;
+};
+
+// Every pipeline the shell has started and not yet reported, in order of
+// job number.  SIGCHLD stays blocked in the shell and arrives on
+// child_events instead, so children are reaped whenever the shell is
+// waiting for something, whether that's the user or a foreground job
+struct job
+{
+  int id;
+  char *command;
+  char **words;   // The job's own copy of its line, which the stages point into
+  struct stage *stages;
+  int num_stages;
+  int running;    // Stages with a process still running
+  int stopped;    // Stages with a process stopped by a signal
+  pid_t group;    // Process group of a background job, 0 if it shares ours
+  int background;
+};
+
+struct job **jobs = NULL;
+int num_jobs = 0;
+int max_jobs = 0;
+int current_job = 0;
+int child_events = -1;
+
+// Exit status of the last command, and set by exit to leave the main loop
+int last_status = 0;
+int shell_quit = 0;
+
+// Set to 0 with "builtins off" to run echo, test and the rest as programs
+int program_builtins = 1;
+
+// What the children of the foreground command used, added up as they're
+// reaped, for time
+struct rusage foreground_usage;
+int foreground_children = 0;
+
+// Latency of every command run this session, by name, for stats.  Each
+// histogram bucket is a power of two microseconds, and the table is open
+// addressing by name like the path table
+#define STATS_BUCKETS 40
+
+struct command_stats
+{
+  char *name;
+  unsigned long count;
+  double total;
+  double max;
+  unsigned long buckets[STATS_BUCKETS];
+};
+
+struct command_stats *stats_table = NULL;
+unsigned int stats_size = 0;
+unsigned int stats_used = 0;
+
+// Buffered input for commands, from the terminal, a script or -c
+#define READ_SIZE ( 1 << 20 )
+
+struct reader
+{
+  int fd;
+  char *buffer;
+  size_t size;
+  size_t start;   // Start of the bytes not handed out yet
+  size_t end;     // End of the bytes read in
+  int eof;
+};
+
+struct reader stdin_reader = { 0, NULL, 0, 0, 0, 0 };
+
+// Memory for the line being run, all freed when it's done
+struct arena_block
+{
+  struct arena_block *next;
+  size_t size;
+  char data[];
+};
+
+struct arena
+{
+  struct arena_block *block;
+  size_t used;
+};
+
+struct arena line_arena = { NULL, 0 };
+
+// Command history, in a file every msh shares.  The file is a header and a
+// ring of records mapped into each shell.  Positions count every byte ever
+// written, so a record's place in the ring is its position mod the size,
+// and a record never wraps; the end of a lap it doesn't fit in is left
+// unused.  Shells flock the file, exclusive to append and shared to read
+#define HISTORY_MAGIC "MSHHIST1"
+#define HISTORY_SIZE ( 16 << 20 )
+#define HISTORY_ALIGN( n ) ( ( ( n ) + 7 ) & ~( uint64_t )7 )
+
+struct history_header
+{
+  char magic[8];
+  uint64_t size;     // Bytes in the ring, which starts right after this
+  uint64_t head;     // Where the next record goes
+  uint64_t tail;     // Where the oldest record still there starts
+  uint64_t first;    // The oldest record's number
+  uint64_t number;   // The next record's number
+};
+
+struct history_record
+{
+  uint32_t length;   // Of the text, or 0 for the unused end of a lap
+  uint32_t time;
+  uint64_t number;
+  char text[];
+};
+
+// Each shell's index of the file, built when it's opened and brought up to
+// date with what other shells added whenever the lock is taken.  Every
+// distinct command is copied out of the ring into texts once, and is found
+// through a hash by text, or a sorted array for prefixes.  Searches go
+// through texts in a row, skipping the ones whose bigrams rule them out
+struct history_text
+{
+  char *text;
+  uint64_t number;   // When it was last run
+  uint64_t grams;    // A bit for every pair of letters in it
+};
+
+struct history
+{
+  int fd;
+  struct history_header *header;
+  char *ring;
+  uint64_t seen;            // How far into the ring the index goes
+  uint64_t first;           // The number of the record where[0] is for
+  uint64_t *where;          // Every record's position, by number
+  size_t count;
+  size_t max;
+  struct history_text *texts;
+  unsigned int num_texts;
+  unsigned int max_texts;
+  unsigned int *slots;      // Hash of texts, index + 1, 0 for empty
+  unsigned int num_slots;
+  unsigned int *sorted;     // Texts in order; the ones from num_sorted on aren't in yet
+  unsigned int num_sorted;
+  struct arena strings;
+};
+
+struct history shell_history = { .fd = -1 };
+
+
+/*
+ * Function: readline
+ * Parameter: in - Where the commands come from
+ * Returns: The next line, or NULL at the end of the input.
+ * Description: Hands out lines straight from the input
+ * buffer, with the newline overwritten to end the string,
+ * so reading a line copies and allocates nothing.  The
+ * line stays good until the next call.  The buffer only
+ * grows for a line longer than it is.
+ */
+
+char *readline( struct reader *in )
+{
+  char *newline, *line, *grown;
+  ssize_t n;
+
+  if ( in->buffer == NULL )
+  {
+    in->buffer = malloc( READ_SIZE );
+    if ( in->buffer == NULL )
+      return NULL;
+    in->size = READ_SIZE;
+  }
+
+  while ( 1 )
+  {
+    line = in->buffer + in->start;
+    newline = memchr( line, '\n', in->end - in->start );
+    if ( newline != NULL )
+    {
+      *newline = '\0';
+      in->start = newline - in->buffer + 1;
+      return line;
+    }
+    if ( in->eof )
+    {
+      if ( in->start == in->end )
+        return NULL;
+      in->buffer[in->end] = '\0'; // A last line with no newline
+      in->start = in->end;
+      return line;
+    }
+
+    // Move the partial line to the front and fill up behind it, always
+    // keeping a byte spare for the terminator
+    memmove( in->buffer, line, in->end - in->start );
+    in->end -= in->start;
+    in->start = 0;
+    if ( in->end + 1 >= in->size )
+    {
+      grown = realloc( in->buffer, in->size * 2 );
+      if ( grown == NULL )
+        return NULL;
+      in->buffer = grown;
+      in->size *= 2;
+    }
+    n = read( in->fd, in->buffer + in->end, in->size - in->end - 1 );
+    if ( n > 0 )
+      in->end += n;
+    else if ( n == 0 || errno != EINTR )
+      in->eof = 1;
+  }
+}
+
+/*
+ * Function: arena_alloc / arena_reset
+ * Parameters: arena - The arena
+ * size - Bytes wanted
+ * Returns: arena_alloc returns the memory, or NULL
+ * Description: Memory for one command line, handed out by
+ * bumping a pointer and all given back at once by
+ * arena_reset when the line is done.  A full block is
+ * kept until the reset and replaced with one twice the
+ * size, so after the first few lines nothing is ever
+ * allocated.
+ */
+
+void *arena_alloc( struct arena *arena, size_t size )
+{
+  struct arena_block *block;
+  size_t block_size;
+
+  size = ( size + 15 ) & ~( size_t )15;
+  if ( arena->block == NULL || arena->used + size > arena->block->size )
+  {
+    block_size = arena->block ? arena->block->size * 2 : 4096;
+    while ( block_size < size )
+      block_size *= 2;
+    block = malloc( sizeof( struct arena_block ) + block_size );
+    if ( block == NULL )
+      return NULL;
+    block->size = block_size;
+    block->next = arena->block;
+    arena->block = block;
+    arena->used = 0;
+  }
+  arena->used += size;
+  return arena->block->data + arena->used - size;
+}
+
+void arena_reset( struct arena *arena )
+{
+  struct arena_block *old;
+
+  // Only the newest block, which is the biggest, is kept
+  while ( arena->block != NULL && arena->block->next != NULL )
+  {
+    old = arena->block->next;
+    arena->block->next = old->next;
+    free( old );
+  }
+  arena->used = 0;
+}
+
+/*
+ * Function: parse_command
+ * Parameters: input - A pointer to a char string
+ * that is the unprocessed user input string.
+ * arena - Where the array of words goes
+ * Returns: A parsed array of char strings, or NULL
+ * Description: Tokenizes the user input and splits
+ * it so that execvp can recognize distinct flags.
+ * Words are left where they are in the input and ended
+ * in place.  |, <, >, >> and & are tokens of their own
+ * even with no spaces around them; they come back as
+ * constant strings since the byte they were in may be
+ * needed to end the word before them.  # starts a
+ * comment, which is what lets scripts have a #! line.
+ */
+
+char **parse_command( char *input, struct arena *arena )
+{
+  int i = 0;
+  char **args = arena_alloc( arena, ( strlen( input ) + 2 ) * sizeof( char * ) );
+  char *p = input;
+  char *end;
+
+  if ( args == NULL )
+    return NULL;
+
+  while ( *p != '\0' ) // Tokenize the arguments one by one
+  {
+    if ( strchr( " \r\t\n", *p ) != NULL )
+    {
+      p++;
+      continue;
+    }
+    if ( *p == '#' )
+      break;
+
+    if ( strchr( "|<>&", *p ) == NULL )
+    {
+      args[i++] = p;
+      while ( *p != '\0' && strchr( " \r\t\n|<>&", *p ) == NULL )
+        p++;
+      if ( *p == '\0' )
+        break;
+    }
+
+    // p is at whatever ended the word, or at an operator
+    end = p;
+    if ( *p == '|' )
+      args[i++] = "|";
+    else if ( *p == '<' )
+      args[i++] = "<";
+    else if ( *p == '&' )
+      args[i++] = "&";
+    else if ( *p == '>' && p[1] == '>' ) // >> appends
+    {
+      args[i++] = ">>";
+      p++;
+    }
+    else if ( *p == '>' )
+      args[i++] = ">";
+    p++;
+    *end = '\0';
+  }
+  args[i] = NULL; // Terminate our array in NULL so execvp knows when to stop
+  return args;
+}
+
+/*
+ * Function: hash_name
+ * Parameter: name - A command name
+ * Returns: Its hash, FNV-1a
+ * Description: Spreads command names over the path table
+ */
+
+unsigned int hash_name( const char *name )
+{
+  unsigned int hash = 2166136261u;
+
+  while ( *name != '\0' )
+  {
+    hash ^= (unsigned char)*name++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/*
+ * Function: hash_reset
+ * Parameter: none
+ * Returns: none
+ * Description: Forgets every command we've looked up
+ */
+
+void hash_reset( void )
+{
+  unsigned int i;
+
+  for ( i = 0; i < path_hash_size; i++ )
+  {
+    free( path_hash[i].name );
+    free( path_hash[i].path );
+  }
+  free( path_hash );
+  free( path_seen );
+  path_hash = NULL;
+  path_hash_size = 0;
+  path_hash_used = 0;
+  path_seen = NULL;
+}
+
+/*
+ * Function: hash_find
+ * Parameter: name - A command name
+ * Returns: Its slot in the path table, which is empty if it isn't there
+ * Description: Linear probe for a command, the table always has free slots
+ */
+
+struct hash_entry *hash_find( const char *name )
+{
+  unsigned int i = hash_name( name ) & ( path_hash_size - 1 );
+
+  while ( path_hash[i].name != NULL && strcmp( path_hash[i].name, name ) != 0 )
+    i = ( i + 1 ) & ( path_hash_size - 1 );
+  return &path_hash[i];
+}
+
+/*
+ * Function: search_path
+ * Parameter: name - A command name with no slash in it
+ * Returns: The full path of the command, malloced, or NULL if it's not on PATH
+ * Description: Looks in each PATH directory in turn for an
+ * executable regular file, the same search execvp does.  An
+ * empty PATH entry means the current directory.
+ */
+
+char *search_path( const char *name )
+{
+  const char *path = getenv( "PATH" );
+  const char *dir, *end;
+  struct stat info;
+  char *full;
+  size_t length;
+
+  if ( path == NULL )
+    path = "/bin:/usr/bin";
+
+  for ( dir = path; ; dir = end + 1 )
+  {
+    end = strchr( dir, ':' );
+    if ( end == NULL )
+      end = dir + strlen( dir );
+    length = end - dir;
+
+    full = malloc( length + strlen( name ) + 2 );
+    if ( full == NULL )
+      return NULL;
+    if ( length == 0 )
+      strcpy( full, name );
+    else
+    {
+      memcpy( full, dir, length );
+      full[length] = '/';
+      strcpy( full + length + 1, name );
+    }
+    if ( stat( full, &info ) == 0 && S_ISREG( info.st_mode ) && access( full, X_OK ) == 0 )
+      return full;
+    free( full );
+
+    if ( *end == '\0' )
+      return NULL;
+  }
+}
+
+/*
+ * Function: hash_lookup
+ * Parameter: name - A command name
+ * Returns: The path to run it from, or NULL if there's no such command
+ * Description: Names with a slash are used as they are.  Others
+ * come from the path table, and are searched for and added the
+ * first time they're run.  The table starts over if PATH has
+ * changed since it was filled.
+ */
+
+const char *hash_lookup( const char *name )
+{
+  struct hash_entry *entry, *old;
+  const char *path = getenv( "PATH" );
+  unsigned int old_size, i;
+  char *found;
+
+  if ( strchr( name, '/' ) != NULL )
+    return name;
+
+  if ( path_seen != NULL && strcmp( path_seen, path != NULL ? path : "" ) != 0 )
+    hash_reset();
+  if ( path_hash == NULL )
+  {
+    path_hash = calloc( 64, sizeof( struct hash_entry ) );
+    path_seen = strdup( path != NULL ? path : "" );
+    if ( path_hash == NULL || path_seen == NULL )
+    {
+      hash_reset();
+      return NULL;
+    }
+    path_hash_size = 64;
+  }
+
+  entry = hash_find( name );
+  if ( entry->name != NULL )
+  {
+    entry->hits++;
+    return entry->path;
+  }
+
+  found = search_path( name );
+  if ( found == NULL )
+    return NULL;
+
+  // Keep the table no more than half full
+  if ( 2 * ( path_hash_used + 1 ) > path_hash_size )
+  {
+    old = path_hash;
+    old_size = path_hash_size;
+    path_hash = calloc( 2 * old_size, sizeof( struct hash_entry ) );
+    if ( path_hash == NULL )
+    {
+      path_hash = old;
+      free( found );
+      return NULL;
+    }
+    path_hash_size = 2 * old_size;
+    for ( i = 0; i < old_size; i++ )
+    {
+      if ( old[i].name != NULL )
+        *hash_find( old[i].name ) = old[i];
+    }
+    free( old );
+    entry = hash_find( name );
+  }
+
+  entry->name = strdup( name );
+  entry->path = found;
+  entry->hits = 1;
+  path_hash_used++;
+  return found;
+}
+
+/*
+ * Function: hash_forget
+ * Parameter: name - A command name
+ * Returns: none
+ * Description: Drops one command from the path table, used when
+ * the file it pointed at has gone.  The entries after it are
+ * moved back so probing still finds them.
+ */
+
+void hash_forget( const char *name )
+{
+  struct hash_entry *entry, moved;
+  unsigned int i;
+
+  if ( path_hash == NULL || hash_find( name )->name == NULL )
+    return;
+
+  entry = hash_find( name );
+  free( entry->name );
+  free( entry->path );
+  entry->name = NULL;
+  entry->path = NULL;
+  path_hash_used--;
+
+  // Put back everything in the rest of the probe run
+  i = ( entry - path_hash + 1 ) & ( path_hash_size - 1 );
+  while ( path_hash[i].name != NULL )
+  {
+    moved = path_hash[i];
+    path_hash[i].name = NULL;
+    *hash_find( moved.name ) = moved;
+    i = ( i + 1 ) & ( path_hash_size - 1 );
+  }
+}
+
+/*
+ * Function: hash_builtin
+ * Parameter: args - hash, hash -r, or hash name ...
+ * Returns: The exit status
+ * Description: With no arguments lists the commands we've
+ * remembered and how often each has been run, like bash.
+ * -r forgets them all, and names are looked up again now.
+ */
+
+int hash_builtin( char **args )
+{
+  unsigned int i;
+  int listed = 0;
+  int status = 0;
+
+  if ( args[1] != NULL && strcmp( args[1], "-r" ) == 0 )
+  {
+    hash_reset();
+    return 0;
+  }
+
+  if ( args[1] != NULL )
+  {
+    for ( i = 1; args[i] != NULL; i++ )
+    {
+      hash_forget( args[i] );
+      if ( hash_lookup( args[i] ) == NULL )
+      {
+        printf( "hash: %s: not found\n", args[i] );
+        status = 1;
+      }
+      else if ( strchr( args[i], '/' ) == NULL )
+        hash_find( args[i] )->hits = 0;
+    }
+    return status;
+  }
+
+  for ( i = 0; i < path_hash_size; i++ )
+  {
+    if ( path_hash[i].name == NULL )
+      continue;
+    if ( listed++ == 0 )
+      printf( "hits\tcommand\n" );
+    printf( "%4u\t%s\n", path_hash[i].hits, path_hash[i].path );
+  }
+  if ( listed == 0 )
+    printf( "hash: hash table empty\n" );
+  return 0;
+}
+
+/*
+ * Function: launch
+ * Parameters: args - The command and its arguments
+ * force_fork - 1 to skip posix_spawn and fork instead
+ * in, out - Descriptors to become the command's stdin
+ * and stdout, normally 0 and 1
+ * group - Process group to put the child in: -1 for the
+ * shell's own, 0 for a new one led by the child
+ * Returns: The pid of the child, or -1 if it couldn't be started
+ * Description: Starts a command without waiting for it.
+ * posix_spawn is used where it works, which glibc does
+ * with clone(CLONE_VM|CLONE_VFORK), so the shell's page
+ * tables are never copied however big the shell gets.
+ * The command is found through the path table, so PATH is
+ * only searched the first time a command is run.  If
+ * spawning fails for any reason other than the command
+ * itself, we fall back to fork and execv.  Either way the
+ * child gets SIGINT, SIGTSTP and SIGPIPE back at their
+ * defaults and an empty signal mask, so ctrl+c and ctrl+z
+ * reach it even though the shell ignores them.  The shell
+ * opens its pipes and files close-on-exec, so the child only
+ * keeps the ones moved onto its stdin and stdout.
+ * Background jobs get a process group of their own so
+ * that ctrl+c at the prompt doesn't reach them.
+ */
+
+pid_t launch( char **args, int force_fork, int in, int out, pid_t group )
+{
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t defaults, empty;
+  const char *path;
+  pid_t pid;
+  int error = ENOSYS;
+
+  // A remembered command that has since gone gets one more search
+  path = hash_lookup( args[0] );
+  if ( path != NULL && path != args[0] && access( path, X_OK ) != 0 )
+  {
+    hash_forget( args[0] );
+    path = hash_lookup( args[0] );
+  }
+  if ( path == NULL )
+  {
+    printf( "%s: command not found\n", args[0] );
+    return -1;
+  }
+
+  fflush( stdout ); // Anything we printed comes before the child's output
+
+  if ( !force_fork && posix_spawnattr_init( &attr ) == 0 )
+  {
+    sigemptyset( &empty );
+    sigemptyset( &defaults );
+    sigaddset( &defaults, SIGINT );
+    sigaddset( &defaults, SIGTSTP );
+    sigaddset( &defaults, SIGPIPE );
+    sigaddset( &defaults, SIGTTOU );
+    posix_spawnattr_setsigdefault( &attr, &defaults );
+    posix_spawnattr_setsigmask( &attr, &empty );
+    if ( group >= 0 )
+      posix_spawnattr_setpgroup( &attr, group );
+    posix_spawnattr_setflags( &attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK |
+                              ( group >= 0 ? POSIX_SPAWN_SETPGROUP : 0 ) );
+    posix_spawn_file_actions_init( &actions );
+    if ( in != 0 )
+      posix_spawn_file_actions_adddup2( &actions, in, 0 );
+    if ( out != 1 )
+      posix_spawn_file_actions_adddup2( &actions, out, 1 );
+    error = posix_spawn( &pid, path, &actions, &attr, args, environ );
+    posix_spawn_file_actions_destroy( &actions );
+    posix_spawnattr_destroy( &attr );
+
+    if ( error == 0 )
+      return pid;
+  }
+
+  // The command itself is the problem, forking won't help
+  if ( error == ENOENT || error == EACCES || error == ENOEXEC || error == ENOTDIR )
+  {
+    printf( "%s: command not found\n", args[0] );
+    return -1;
+  }
+
+  // fork a child process to execute commands while the shell is still running
+  pid = fork();
+  if ( pid == 0 )
+  {
+    signal( SIGINT, SIG_DFL );
+    signal( SIGTSTP, SIG_DFL );
+    signal( SIGPIPE, SIG_DFL );
+    signal( SIGTTOU, SIG_DFL );
+    sigemptyset( &empty );
+    sigprocmask( SIG_SETMASK, &empty, NULL );
+    if ( group >= 0 )
+      setpgid( 0, group );
+    if ( in != 0 )
+      dup2( in, 0 );
+    if ( out != 1 )
+      dup2( out, 1 );
+
+    // While in the child process, execute the parsed command
+    if ( execv( path, args ) == -1 )
+    {
+      // Catch command not found errors and print to screen
+      printf( "%s: command not found\n", args[0]);
+    }
+    // If we're still here after execution, exit the child process
+    exit( EXIT_FAILURE );
+  }
+  else if ( pid == -1 )
+    perror( "fork" );
+  else if ( group >= 0 )
+    setpgid( pid, group ? group : pid ); // Either of us may get there first
+  return pid;
+}
+
+/*
+ * Function: spawn_bench
+ * Parameter: args - spawnbench [count] [MB ...]
+ * Returns: The exit status
+ * Description: Launches /bin/true count times (default 1000)
+ * with posix_spawn and then with fork, waiting for each,
+ * and reports commands per second.  This is repeated with
+ * the shell holding each of the given amounts of touched
+ * memory (default 0, 256 and 1024 MB), since the cost
+ * of fork grows with the size of the parent.
+ */
+
+int spawn_bench( char **args )
+{
+  char *command[] = { "/bin/true", NULL };
+  int default_sizes[] = { 0, 256, 1024 };
+  struct timespec start, end;
+  char *ballast;
+  double seconds;
+  long size;
+  int count = 1000;
+  int num_sizes = 3;
+  int s, i, method, status;
+  pid_t pid;
+
+  if ( args[1] != NULL )
+    count = atoi( args[1] );
+  if ( args[1] != NULL && args[2] != NULL )
+  {
+    for ( num_sizes = 0; args[2 + num_sizes] != NULL; num_sizes++ )
+      ;
+  }
+  if ( count < 1 )
+  {
+    printf( "spawnbench: usage: spawnbench [count] [MB ...]\n" );
+    return 2;
+  }
+
+  for ( s = 0; s < num_sizes; s++ )
+  {
+    size = ( args[1] != NULL && args[2] != NULL ) ? atol( args[2 + s] ) : default_sizes[s];
+
+    // Touch every page so it really is part of the resident set
+    ballast = size > 0 ? malloc( size << 20 ) : NULL;
+    if ( size > 0 && ballast == NULL )
+    {
+      printf( "spawnbench: can't allocate %ld MB\n", size );
+      continue;
+    }
+    if ( ballast != NULL )
+      memset( ballast, 1, size << 20 );
+
+    for ( method = 0; method < 2; method++ )
+    {
+      clock_gettime( CLOCK_MONOTONIC, &start );
+      for ( i = 0; i < count; i++ )
+      {
+        pid = launch( command, method, 0, 1, -1 );
+        if ( pid > 0 )
+          waitpid( pid, &status, 0 );
+      }
+      clock_gettime( CLOCK_MONOTONIC, &end );
+      seconds = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1e9;
+      printf( "rss %5ld MB  %-5s  %6d commands in %.3f s, %8.0f commands/s\n",
+              size, method ? "fork" : "spawn", count, seconds, count / seconds );
+    }
+    free( ballast );
+  }
+  return 0;
+}
+
+/*
+ * Function: splice_copy
+ * Parameters: in, out - Where to copy from and to
+ * Returns: 0 at the end of the input, -1 on an error
+ * Description: Moves everything from in to out.  If either
+ * end is a pipe the kernel moves the pages with splice and
+ * the data never comes up into the shell, otherwise we
+ * fall back to read and write.
+ */
+
+int splice_copy( int in, int out )
+{
+  char buffer[65536];
+  ssize_t n, written, w;
+
+  while ( ( n = splice( in, NULL, out, NULL, 1 << 20, SPLICE_F_MOVE | SPLICE_F_MORE ) ) > 0 )
+    ;
+  if ( n == 0 )
+    return 0;
+  if ( errno != EINVAL )
+    return -1;
+
+  while ( ( n = read( in, buffer, sizeof( buffer ) ) ) > 0 )
+  {
+    for ( written = 0; written < n; written += w )
+    {
+      w = write( out, buffer + written, n - written );
+      if ( w <= 0 )
+        return -1;
+    }
+  }
+  return n == 0 ? 0 : -1;
+}
+
+/*
+ * Function: splice_plain
+ * Parameter: args - A cat or tee stage
+ * Returns: 1 if the shell's own cat or tee can run it
+ * Description: The stand-ins only know file names, with -
+ * for stdin in cat and -a in tee, so any other option, and
+ * tee with more files than it keeps, goes to the real
+ * program instead.
+ */
+
+int splice_plain( char **args )
+{
+  int cat = strcmp( args[0], "cat" ) == 0;
+  int i;
+
+  for ( i = 1; args[i] != NULL; i++ )
+  {
+    if ( args[i][0] == '-' && strcmp( args[i], cat ? "-" : "-a" ) != 0 )
+      return 0;
+  }
+  return cat || i <= 65;
+}
+
+/*
+ * Function: builtin_cat / builtin_tee
+ * Parameters: args - The command and its arguments
+ * in, out - The stage's stdin and stdout
+ * Returns: 0 on success, 1 if anything failed, like coreutils
+ * Description: cat and tee for pipelines, run on a thread in
+ * the shell.  cat splices each file (or stdin) to stdout.  tee
+ * with one file between two pipes duplicates the pipe pages
+ * onto stdout with tee() and then splices them into the file,
+ * so nothing is copied; anything else goes through a buffer.
+ * Only arguments splice_plain allows get this far.
+ */
+
+int builtin_cat( char **args, int in, int out )
+{
+  int i, fd;
+  int status = 0;
+
+  if ( args[1] == NULL )
+    return splice_copy( in, out ) == 0 ? 0 : 1;
+
+  for ( i = 1; args[i] != NULL; i++ )
+  {
+    fd = strcmp( args[i], "-" ) == 0 ? in : open( args[i], O_RDONLY | O_CLOEXEC );
+    if ( fd == -1 )
+    {
+      fprintf( stderr, "cat: %s: %s\n", args[i], strerror( errno ) );
+      status = 1;
+      continue;
+    }
+    if ( splice_copy( fd, out ) == -1 )
+      status = 1;
+    if ( fd != in )
+      close( fd );
+  }
+  return status;
+}
+
+int builtin_tee( char **args, int in, int out )
+{
+  char buffer[65536];
+  int files[64];
+  struct stat in_info, out_info;
+  int num_files = 0;
+  int append = 0;
+  int status = 0;
+  ssize_t n, moved, w, done;
+  int i, f;
+
+  // -a counts wherever it is, as it does with getopt
+  for ( i = 1; args[i] != NULL; i++ )
+    append |= strcmp( args[i], "-a" ) == 0;
+  for ( i = 1; args[i] != NULL && num_files < 64; i++ )
+  {
+    if ( strcmp( args[i], "-a" ) == 0 )
+      continue;
+    files[num_files] = open( args[i], O_WRONLY | O_CREAT | O_CLOEXEC | ( append ? O_APPEND : O_TRUNC ), 0666 );
+    if ( files[num_files] == -1 )
+    {
+      fprintf( stderr, "tee: %s: %s\n", args[i], strerror( errno ) );
+      status = 1;
+    }
+    else
+      num_files++;
+  }
+
+  n = -1;
+  if ( num_files == 1 && fstat( in, &in_info ) == 0 && fstat( out, &out_info ) == 0 &&
+       S_ISFIFO( in_info.st_mode ) && S_ISFIFO( out_info.st_mode ) )
+  {
+    while ( ( n = tee( in, out, 1 << 20, 0 ) ) > 0 )
+    {
+      for ( done = 0; done < n; done += moved )
+      {
+        moved = splice( in, NULL, files[0], NULL, n - done, SPLICE_F_MOVE );
+        if ( moved <= 0 )
+          break;
+      }
+      if ( done < n )
+        break;
+    }
+  }
+
+  // Anything tee() can't do goes through a buffer
+  if ( n == -1 && ( errno == EINVAL || num_files != 1 ) )
+  {
+    while ( ( n = read( in, buffer, sizeof( buffer ) ) ) > 0 )
+    {
+      for ( f = -1; f < num_files; f++ )
+      {
+        for ( done = 0; done < n; done += w )
+        {
+          w = write( f == -1 ? out : files[f], buffer + done, n - done );
+          if ( w <= 0 )
+            break;
+        }
+      }
+    }
+  }
+  if ( n == -1 )
+    status = 1;
+
+  for ( f = 0; f < num_files; f++ )
+    close( files[f] );
+  return status;
+}
+
+/*
+ * Function: builtin_stage
+ * Parameter: arg - The stage to run
+ * Returns: NULL
+ * Description: Thread body for a pipeline stage the shell runs
+ * itself.  The stage has its own copies of its descriptors and
+ * closes them when it's done, which is what lets the next
+ * stage see the end of its input.  Its exit status goes in
+ * the stage the way wait would have left a process's.
+ */
+
+void *builtin_stage( void *arg )
+{
+  struct stage *stage = arg;
+
+  if ( strcmp( stage->argv[0], "cat" ) == 0 )
+    stage->status = W_EXITCODE( builtin_cat( stage->argv, stage->in, stage->out ), 0 );
+  else
+    stage->status = W_EXITCODE( builtin_tee( stage->argv, stage->in, stage->out ), 0 );
+  close( stage->in );
+  close( stage->out );
+  return NULL;
+}
+
+/*
+ * Function: seconds_since
+ * Parameter: start - An earlier CLOCK_MONOTONIC time
+ * Returns: The seconds from then until now
+ */
+
+double seconds_since( const struct timespec *start )
+{
+  struct timespec now;
+
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  return ( now.tv_sec - start->tv_sec ) + ( now.tv_nsec - start->tv_nsec ) / 1e9;
+}
+
+/*
+ * Function: rusage_add
+ * Parameters: sum - A running total
+ * usage - One more child's usage
+ * Returns: none
+ * Description: Adds up times, faults and context switches,
+ * and keeps the biggest peak memory.
+ */
+
+void rusage_add( struct rusage *sum, const struct rusage *usage )
+{
+  timeradd( &sum->ru_utime, &usage->ru_utime, &sum->ru_utime );
+  timeradd( &sum->ru_stime, &usage->ru_stime, &sum->ru_stime );
+  if ( usage->ru_maxrss > sum->ru_maxrss )
+    sum->ru_maxrss = usage->ru_maxrss;
+  sum->ru_minflt += usage->ru_minflt;
+  sum->ru_majflt += usage->ru_majflt;
+  sum->ru_nvcsw += usage->ru_nvcsw;
+  sum->ru_nivcsw += usage->ru_nivcsw;
+}
+
+/*
+ * Function: stats_record
+ * Parameters: name - The command, with any directory left off
+ * seconds - How long it took
+ * Returns: none
+ * Description: Adds one run to the command's histogram,
+ * growing the table when it's half full.
+ */
+
+void stats_record( const char *name, double seconds )
+{
+  struct command_stats *old = stats_table;
+  unsigned int old_size = stats_size;
+  const char *slash = strrchr( name, '/' );
+  unsigned int i, slot;
+  double micros;
+  int bucket;
+
+  if ( slash != NULL && slash[1] != '\0' )
+    name = slash + 1;
+
+  if ( ( stats_used + 1 ) * 2 > stats_size )
+  {
+    stats_table = calloc( old_size ? old_size * 2 : 64, sizeof( struct command_stats ) );
+    if ( stats_table == NULL )
+    {
+      stats_table = old;
+      return;
+    }
+    stats_size = old_size ? old_size * 2 : 64;
+    for ( i = 0; i < old_size; i++ )
+    {
+      if ( old[i].name == NULL )
+        continue;
+      for ( slot = hash_name( old[i].name ) & ( stats_size - 1 ); stats_table[slot].name != NULL;
+            slot = ( slot + 1 ) & ( stats_size - 1 ) )
+        ;
+      stats_table[slot] = old[i];
+    }
+    free( old );
+  }
+
+  for ( slot = hash_name( name ) & ( stats_size - 1 ); stats_table[slot].name != NULL;
+        slot = ( slot + 1 ) & ( stats_size - 1 ) )
+  {
+    if ( strcmp( stats_table[slot].name, name ) == 0 )
+      break;
+  }
+  if ( stats_table[slot].name == NULL )
+  {
+    stats_table[slot].name = strdup( name );
+    if ( stats_table[slot].name == NULL )
+      return;
+    stats_used++;
+  }
+
+  micros = seconds * 1e6;
+  for ( bucket = 0; bucket < STATS_BUCKETS - 1 && micros >= 2; bucket++ )
+    micros /= 2;
+  stats_table[slot].buckets[bucket]++;
+  stats_table[slot].count++;
+  stats_table[slot].total += seconds;
+  if ( seconds > stats_table[slot].max )
+    stats_table[slot].max = seconds;
+}
+
+/*
+ * Function: job_update
+ * Parameters: pid - A child that changed state
+ * status - What wait4 said about it
+ * usage - What it used, if it has finished
+ * Returns: none
+ * Description: Records the change against the job the child
+ * belongs to, and a finished child's run time in the stats.
+ * Children that aren't in any job are ignored.
+ */
+
+void job_update( pid_t pid, int status, const struct rusage *usage )
+{
+  int j;
+  int s = 0;
+
+  for ( j = 0; j < num_jobs; j++ )
+  {
+    for ( s = 0; s < jobs[j]->num_stages && jobs[j]->stages[s].pid != pid; s++ )
+      ;
+    if ( s < jobs[j]->num_stages )
+      break;
+  }
+  if ( j == num_jobs )
+    return;
+
+  if ( jobs[j]->stages[s].state == STAGE_RUNNING )
+    jobs[j]->running--;
+  else if ( jobs[j]->stages[s].state == STAGE_STOPPED )
+    jobs[j]->stopped--;
+
+  if ( WIFSTOPPED( status ) )
+  {
+    jobs[j]->stages[s].state = STAGE_STOPPED;
+    jobs[j]->stopped++;
+  }
+  else if ( WIFCONTINUED( status ) )
+  {
+    jobs[j]->stages[s].state = STAGE_RUNNING;
+    jobs[j]->running++;
+  }
+  else
+  {
+    jobs[j]->stages[s].state = STAGE_DONE;
+    jobs[j]->stages[s].status = status;
+    jobs[j]->stages[s].usage = *usage;
+    stats_record( jobs[j]->stages[s].argv[0], seconds_since( &jobs[j]->stages[s].start ) );
+  }
+}
+
+/*
+ * Function: reap_children
+ * Parameter: none
+ * Returns: none
+ * Description: Collects every child that has exited, stopped
+ * or been continued since the last call and updates its job.
+ * wait4 rather than waitpid so we learn what each one used.
+ * Called whenever child_events says SIGCHLD arrived, which
+ * only tells us at least one child changed, so we keep
+ * asking until waitpid has nothing more.
+ */
+
+void reap_children( void )
+{
+  struct signalfd_siginfo info;
+  struct rusage usage;
+  pid_t pid;
+  int status;
+
+  while ( read( child_events, &info, sizeof( info ) ) == sizeof( info ) )
+    ;
+
+  while ( ( pid = wait4( -1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage ) ) > 0 )
+    job_update( pid, status, &usage );
+}
+
+/*
+ * Function: wait_for_children
+ * Parameter: none
+ * Returns: none
+ * Description: Sleeps until some child changes state and
+ * reaps it.
+ */
+
+void wait_for_children( void )
+{
+  struct pollfd event = { child_events, POLLIN, 0 };
+
+  if ( poll( &event, 1, -1 ) > 0 )
+    reap_children();
+}
+
+/*
+ * Function: wait_for_input
+ * Parameter: in - Where the commands come from
+ * Returns: none
+ * Description: The shell's event loop.  Waits until there's a
+ * line to read, reaping children in the meantime, so
+ * background jobs never sit around as zombies however many
+ * of them there are.  A line already in the buffer can be
+ * read straight away.
+ */
+
+void wait_for_input( struct reader *in )
+{
+  struct pollfd events[2] = { { in->fd, POLLIN, 0 }, { child_events, POLLIN, 0 } };
+
+  if ( in->fd == -1 || in->eof )
+    return;
+  while ( in->buffer == NULL || memchr( in->buffer + in->start, '\n', in->end - in->start ) == NULL )
+  {
+    if ( poll( events, 2, -1 ) == -1 && errno != EINTR )
+      return;
+    if ( events[1].revents & POLLIN )
+      reap_children();
+    if ( events[0].revents != 0 )
+      return;
+  }
+}
+
+/*
+ * Function: job_add / job_remove
+ * Parameter: job - The job
+ * Returns: job_add returns -1 if the table couldn't grow
+ * Description: Keeps the job table in job number order.  A
+ * new job gets one more than the highest number in use, like
+ * bash.  Removing a job waits for any stages the shell was
+ * running itself and frees it.
+ */
+
+int job_add( struct job *job )
+{
+  struct job **grown;
+
+  if ( num_jobs == max_jobs )
+  {
+    grown = realloc( jobs, ( max_jobs ? max_jobs * 2 : 16 ) * sizeof( struct job * ) );
+    if ( grown == NULL )
+      return -1;
+    jobs = grown;
+    max_jobs = max_jobs ? max_jobs * 2 : 16;
+  }
+  job->id = num_jobs ? jobs[num_jobs - 1]->id + 1 : 1;
+  jobs[num_jobs++] = job;
+  return 0;
+}
+
+void job_remove( struct job *job )
+{
+  int j, s;
+
+  for ( j = 0; j < num_jobs && jobs[j] != job; j++ )
+    ;
+  if ( j < num_jobs )
+  {
+    memmove( &jobs[j], &jobs[j + 1], ( num_jobs - j - 1 ) * sizeof( struct job * ) );
+    num_jobs--;
+  }
+  if ( current_job == job->id )
+    current_job = 0;
+
+  for ( s = 0; s < job->num_stages; s++ )
+  {
+    if ( job->stages[s].threaded )
+      pthread_join( job->stages[s].thread, NULL );
+  }
+  free( job->stages );
+  free( job->command );
+  free( job->words );
+  free( job );
+}
+
+/*
+ * Function: job_state
+ * Parameter: job - The job
+ * Returns: How the job would be listed: Running, Stopped,
+ * Done, Exit n or the signal that killed it, taken from the
+ * last stage like the shell's exit status
+ */
+
+const char *job_state( struct job *job )
+{
+  static char state[64];
+  int status = job->stages[job->num_stages - 1].status;
+
+  if ( job->running > 0 )
+    return "Running";
+  if ( job->stopped > 0 )
+    return "Stopped";
+  if ( WIFSIGNALED( status ) )
+    return strsignal( WTERMSIG( status ) );
+  if ( WIFEXITED( status ) && WEXITSTATUS( status ) != 0 )
+  {
+    snprintf( state, sizeof( state ), "Exit %d", WEXITSTATUS( status ) );
+    return state;
+  }
+  return "Done";
+}
+
+/*
+ * Function: job_status
+ * Parameter: job - A finished job
+ * Returns: The exit status of its last stage, or 128 plus
+ * the signal if one killed it
+ */
+
+int job_status( struct job *job )
+{
+  struct stage *last = &job->stages[job->num_stages - 1];
+
+  if ( WIFSIGNALED( last->status ) )
+    return 128 + WTERMSIG( last->status );
+  return WEXITSTATUS( last->status );
+}
+
+/*
+ * Function: job_notify
+ * Parameter: none
+ * Returns: none
+ * Description: Reports background jobs that have finished
+ * since the last prompt and drops them from the table.
+ */
+
+void job_notify( void )
+{
+  int j = 0;
+
+  if ( num_jobs == 0 )
+    return;
+  reap_children();
+  while ( j < num_jobs )
+  {
+    if ( jobs[j]->running == 0 && jobs[j]->stopped == 0 )
+    {
+      printf( "[%d]%c  %-24s%s\n", jobs[j]->id, jobs[j]->id == current_job ? '+' : ' ',
+              job_state( jobs[j] ), jobs[j]->command );
+      job_remove( jobs[j] );
+    }
+    else
+      j++;
+  }
+}
+
+/*
+ * Function: job_wait
+ * Parameter: job - The job to wait for
+ * Returns: none
+ * Description: Waits for a job in the foreground until every
+ * process in it has finished or stopped.  A finished job is
+ * dropped quietly; a stopped one stays in the table to be
+ * picked up with fg or bg.  If the job has its own process
+ * group the terminal is handed to it for the duration, so
+ * ctrl+c and ctrl+z go to the job and not to the shell.
+ */
+
+void job_wait( struct job *job )
+{
+  int terminal = job->group > 0 && isatty( 0 );
+  int s;
+
+  if ( terminal )
+    tcsetpgrp( 0, job->group );
+  job->background = 0;
+  while ( job->running > 0 )
+    wait_for_children();
+  if ( terminal )
+    tcsetpgrp( 0, getpgrp() );
+
+  if ( job->stopped > 0 )
+  {
+    current_job = job->id;
+    last_status = 128 + SIGTSTP;
+    printf( "\n[%d]+  %-24s%s\n", job->id, "Stopped", job->command );
+  }
+  else
+  {
+    // Stages run in the shell are only done once their threads are
+    for ( s = 0; s < job->num_stages; s++ )
+    {
+      if ( job->stages[s].threaded )
+        pthread_join( job->stages[s].thread, NULL );
+      job->stages[s].threaded = 0;
+    }
+    last_status = job_status( job );
+    for ( s = 0; s < job->num_stages; s++ )
+    {
+      if ( job->stages[s].pid > 0 )
+      {
+        rusage_add( &foreground_usage, &job->stages[s].usage );
+        foreground_children++;
+      }
+    }
+    job_remove( job );
+  }
+}
+
+/*
+ * Function: job_lookup
+ * Parameters: name - The builtin asking, for its error message
+ * arg - %n, n, or NULL for the current job
+ * Returns: The job, or NULL after printing why not
+ * Description: The current job is the last one stopped, or
+ * failing that the newest one.
+ */
+
+struct job *job_lookup( const char *name, const char *arg )
+{
+  int id, j;
+
+  if ( num_jobs == 0 )
+  {
+    printf( "%s: no current job\n", name );
+    return NULL;
+  }
+  if ( arg == NULL )
+    id = current_job ? current_job : jobs[num_jobs - 1]->id;
+  else
+    id = atoi( arg[0] == '%' ? arg + 1 : arg );
+
+  for ( j = 0; j < num_jobs; j++ )
+  {
+    if ( jobs[j]->id == id )
+      return jobs[j];
+  }
+  printf( "%s: %s: no such job\n", name, arg );
+  return NULL;
+}
+
+/*
+ * Function: job_continue
+ * Parameter: job - A job that may have stopped stages
+ * Returns: none
+ * Description: Sends SIGCONT to each stopped process and
+ * counts it as running again straight away, rather than
+ * waiting for the continued notification.
+ */
+
+void job_continue( struct job *job )
+{
+  int s;
+
+  for ( s = 0; s < job->num_stages; s++ )
+  {
+    if ( job->stages[s].state == STAGE_STOPPED && kill( job->stages[s].pid, SIGCONT ) == 0 )
+    {
+      job->stages[s].state = STAGE_RUNNING;
+      job->stopped--;
+      job->running++;
+    }
+  }
+}
+
+/*
+ * Function: jobs_builtin
+ * Parameter: args - jobs [-l], fg [job], bg [job] or wait [job]
+ * Returns: The exit status
+ * Description: The job control builtins.  jobs lists the table
+ * (with the process group under -l), fg brings a job to the
+ * foreground, bg lets a stopped job carry on in the
+ * background, and wait blocks until one job or every
+ * running job has finished.
+ */
+
+int jobs_builtin( char **args )
+{
+  struct job *job;
+  int j;
+
+  reap_children();
+  if ( strcmp( args[0], "jobs" ) == 0 )
+  {
+    for ( j = 0; j < num_jobs; j++ )
+    {
+      printf( "[%d]%c  ", jobs[j]->id, jobs[j]->id == current_job ? '+' : ' ' );
+      if ( args[1] != NULL && strcmp( args[1], "-l" ) == 0 )
+        printf( "%-7d ", jobs[j]->group ? jobs[j]->group : jobs[j]->stages[0].pid );
+      printf( "%-24s%s\n", job_state( jobs[j] ), jobs[j]->command );
+    }
+    job_notify();
+  }
+  else if ( strcmp( args[0], "wait" ) == 0 && args[1] == NULL )
+  {
+    for ( j = 0; j < num_jobs; j++ )
+    {
+      while ( jobs[j]->running > 0 )
+        wait_for_children();
+    }
+    j = 0;
+    while ( j < num_jobs )
+    {
+      if ( jobs[j]->running == 0 && jobs[j]->stopped == 0 )
+        job_remove( jobs[j] );
+      else
+        j++;
+    }
+  }
+  else if ( ( job = job_lookup( args[0], args[1] ) ) != NULL )
+  {
+    if ( strcmp( args[0], "wait" ) == 0 )
+    {
+      while ( job->running > 0 )
+        wait_for_children();
+      if ( job->stopped == 0 )
+        job_remove( job );
+    }
+    else if ( strcmp( args[0], "fg" ) == 0 )
+    {
+      printf( "%s\n", job->command );
+      job_continue( job );
+      job_wait( job );
+    }
+    else
+    {
+      job_continue( job );
+      job->background = 1;
+      current_job = job->id;
+      printf( "[%d]+ %s &\n", job->id, job->command );
+    }
+  }
+  else
+    return 1;
+  return 0;
+}
+
+/*
+ * Function: run_pipeline
+ * Parameters: args - A parsed command line, which may have
+ * stages separated by | and <, > or >> redirections
+ * background - 1 to start the job and return to the prompt
+ * builtin - The shell's own version of the command, if it has
+ * one, for a single command with redirections
+ * Returns: none
+ * Description: Splits the line into stages, opens the
+ * redirections and the pipes between the stages, then
+ * starts every stage before waiting for any of them, so
+ * they all run at once.  cat and tee stages run on threads
+ * in the shell unless splice is off or the job is in the
+ * background, since a thread can't be stopped or left in
+ * its own process group.  A builtin with redirections runs
+ * in the shell with stdout moved onto the file for the time
+ * it runs.
+ */
+
+void run_pipeline( char **args, int background, int (*builtin)( char ** ) )
+{
+  struct stage *stages;
+  struct job *job;
+  int (*pipes)[2];
+  int num_stages = 1;
+  int i, s, w, fd;
+  int failed = 0;
+  size_t length = 1;
+  char **word;
+  char *copy;
+
+  for ( i = 0; args[i] != NULL; i++ )
+  {
+    if ( strcmp( args[i], "|" ) == 0 )
+      num_stages++;
+    length += strlen( args[i] ) + 1;
+  }
+  stages = calloc( num_stages, sizeof( struct stage ) );
+  pipes = calloc( num_stages, sizeof( int[2] ) );
+  job = calloc( 1, sizeof( struct job ) );
+  if ( job != NULL )
+  {
+    job->command = calloc( length, 1 );
+    job->words = malloc( ( i + 1 ) * sizeof( char * ) + length );
+  }
+  if ( stages == NULL || pipes == NULL || job == NULL || job->command == NULL || job->words == NULL )
+  {
+    free( stages );
+    free( pipes );
+    if ( job != NULL )
+    {
+      free( job->command );
+      free( job->words );
+    }
+    free( job );
+    return;
+  }
+
+  // The line as jobs will show it, and a copy of the words that lasts as
+  // long as the job, since the line itself is gone once we're back at the
+  // prompt
+  copy = ( char * )( job->words + i + 1 );
+  for ( i = 0; args[i] != NULL; i++ )
+  {
+    if ( i > 0 )
+      strcat( job->command, " " );
+    strcat( job->command, args[i] );
+    job->words[i] = strcpy( copy, args[i] );
+    copy += strlen( copy ) + 1;
+  }
+  job->words[i] = NULL;
+  args = job->words;
+  for ( s = 0; s < num_stages; s++ )
+    pipes[s][0] = pipes[s][1] = -1;
+
+  // Cut the line into stages, taking the redirections out of each
+  // stage's arguments as we go
+  word = args;
+  for ( s = 0; s < num_stages && !failed; s++ )
+  {
+    stages[s].argv = word;
+    stages[s].in = -1;
+    stages[s].out = -1;
+    for ( i = 0, w = 0; word[i] != NULL && strcmp( word[i], "|" ) != 0; i++ )
+    {
+      if ( strcmp( word[i], "<" ) == 0 || strcmp( word[i], ">" ) == 0 || strcmp( word[i], ">>" ) == 0 )
+      {
+        if ( word[i + 1] == NULL || strchr( "|<>", word[i + 1][0] ) != NULL )
+        {
+          printf( "msh: syntax error near %s\n", word[i] );
+          failed = 1;
+          break;
+        }
+        if ( word[i][0] == '<' )
+          stages[s].in_file = word[i + 1];
+        else
+        {
+          stages[s].out_file = word[i + 1];
+          stages[s].append = word[i][1] == '>';
+        }
+        i++;
+      }
+      else
+        word[w++] = word[i];
+    }
+    if ( !failed && w == 0 )
+    {
+      printf( "msh: syntax error near |\n" );
+      failed = 1;
+    }
+    word = word + i + ( word[i] != NULL );
+    stages[s].argv[w] = NULL;
+  }
+
+  // Open the redirections and the pipes, all close-on-exec
+  for ( s = 0; s < num_stages && !failed; s++ )
+  {
+    if ( stages[s].in_file != NULL )
+    {
+      stages[s].in = open( stages[s].in_file, O_RDONLY | O_CLOEXEC );
+      if ( stages[s].in == -1 )
+        failed = printf( "msh: %s: %s\n", stages[s].in_file, strerror( errno ) );
+      if ( stages[s].in == -1 )
+        last_status = 1;
+    }
+    if ( stages[s].out_file != NULL )
+    {
+      stages[s].out = open( stages[s].out_file, O_WRONLY | O_CREAT | O_CLOEXEC |
+                            ( stages[s].append ? O_APPEND : O_TRUNC ), 0666 );
+      if ( stages[s].out == -1 )
+        failed = printf( "msh: %s: %s\n", stages[s].out_file, strerror( errno ) );
+      if ( stages[s].out == -1 )
+        last_status = 1;
+    }
+    if ( s + 1 < num_stages && pipe2( pipes[s], O_CLOEXEC ) == -1 )
+      failed = printf( "msh: pipe: %s\n", strerror( errno ) );
+  }
+
+  // A lone builtin, echo hi > file and the like
+  if ( builtin != NULL && num_stages == 1 && !background && !failed )
+  {
+    fflush( stdout );
+    fd = stages[0].out != -1 ? fcntl( 1, F_DUPFD_CLOEXEC, 10 ) : -1;
+    if ( fd != -1 )
+      dup2( stages[0].out, 1 );
+    clock_gettime( CLOCK_MONOTONIC, &stages[0].start );
+    last_status = builtin( stages[0].argv );
+    fflush( stdout );
+    if ( last_status != -1 )
+      stats_record( stages[0].argv[0], seconds_since( &stages[0].start ) );
+    if ( fd != -1 )
+    {
+      dup2( fd, 1 );
+      close( fd );
+    }
+    if ( last_status != -1 )
+      failed = 1; // Nothing left to start
+  }
+
+  // Start every stage, then close the shell's copies of the pipes
+  for ( s = 0; s < num_stages && !failed; s++ )
+  {
+    if ( stages[s].in == -1 )
+      stages[s].in = s > 0 ? pipes[s - 1][0] : 0;
+    if ( stages[s].out == -1 )
+      stages[s].out = s + 1 < num_stages ? pipes[s][1] : 1;
+
+    stages[s].pid = -1;
+    stages[s].state = STAGE_DONE;
+    stages[s].status = W_EXITCODE( 127, 0 ); // Until something runs it
+    if ( splice_builtins && !background &&
+         ( strcmp( stages[s].argv[0], "cat" ) == 0 || strcmp( stages[s].argv[0], "tee" ) == 0 ) &&
+         splice_plain( stages[s].argv ) )
+    {
+      // The thread gets copies, and a redirected file is ours to close now
+      fd = stages[s].in;
+      stages[s].in = fcntl( fd, F_DUPFD_CLOEXEC, 0 );
+      if ( stages[s].in_file != NULL )
+        close( fd );
+      fd = stages[s].out;
+      stages[s].out = fcntl( fd, F_DUPFD_CLOEXEC, 0 );
+      if ( stages[s].out_file != NULL )
+        close( fd );
+      stages[s].threaded = pthread_create( &stages[s].thread, NULL, builtin_stage, &stages[s] ) == 0;
+      if ( !stages[s].threaded )
+      {
+        close( stages[s].in );
+        close( stages[s].out );
+      }
+    }
+    else
+    {
+      clock_gettime( CLOCK_MONOTONIC, &stages[s].start );
+      stages[s].pid = launch( stages[s].argv, 0, stages[s].in, stages[s].out,
+                              background ? job->group : -1 );
+      if ( stages[s].pid > 0 )
+      {
+        stages[s].state = STAGE_RUNNING;
+        job->running++;
+        if ( background && job->group == 0 )
+          job->group = stages[s].pid;
+      }
+    }
+  }
+  for ( s = 0; s < num_stages; s++ )
+  {
+    if ( stages[s].in_file != NULL && stages[s].in != -1 && !stages[s].threaded )
+      close( stages[s].in );
+    if ( stages[s].out_file != NULL && stages[s].out != -1 && !stages[s].threaded )
+      close( stages[s].out );
+    if ( pipes[s][0] != -1 )
+      close( pipes[s][0] );
+    if ( pipes[s][1] != -1 )
+      close( pipes[s][1] );
+  }
+
+  free( pipes );
+
+  job->stages = stages;
+  job->num_stages = num_stages;
+  job->background = background;
+  if ( failed || job_add( job ) == -1 )
+  {
+    job_remove( job ); // Not in the table, this only waits and frees
+    return;
+  }
+  if ( background )
+    last_status = 0;
+
+  if ( !background )
+    job_wait( job );
+  else
+  {
+    current_job = job->id;
+    printf( "[%d] %d\n", job->id, stages[num_stages - 1].pid );
+  }
+}
+
+/*
+ * Function: pipe_bench
+ * Parameter: args - pipebench [MB]
+ * Returns: The exit status
+ * Description: Pushes a file of the given size (default 256 MB)
+ * through cat file | cat | tee copy | cat > /dev/null with the
+ * spliced builtins, with the real programs, and under bash,
+ * and reports MB/s for each.  Uses pipebench.tmp and
+ * pipebench.out in the current directory.
+ */
+
+int pipe_bench( char **args )
+{
+  char line[] = "cat pipebench.tmp | cat | tee pipebench.out | cat > /dev/null";
+  char *bash[] = { "bash", "-c", line, NULL };
+  char block[1 << 16];
+  struct timespec start, end;
+  char **parsed;
+  char *copy;
+  double seconds;
+  long size = 256;
+  long i;
+  int method, fd, status;
+  pid_t pid;
+
+  if ( args[1] != NULL )
+    size = atol( args[1] );
+  fd = open( "pipebench.tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+  if ( size < 1 || fd == -1 )
+  {
+    printf( "pipebench: usage: pipebench [MB]\n" );
+    if ( fd != -1 )
+      close( fd );
+    return 2;
+  }
+  memset( block, 'x', sizeof( block ) );
+  for ( i = 0; i < size * 16; i++ )
+  {
+    if ( write( fd, block, sizeof( block ) ) != sizeof( block ) )
+      break;
+  }
+  close( fd );
+
+  for ( method = 0; method < 3; method++ )
+  {
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    if ( method < 2 )
+    {
+      splice_builtins = method == 0;
+      copy = strdup( line );
+      parsed = parse_command( copy, &line_arena );
+      if ( parsed != NULL )
+        run_pipeline( parsed, 0, NULL );
+      free( copy );
+    }
+    else
+    {
+      pid = launch( bash, 0, 0, 1, -1 );
+      if ( pid <= 0 )
+        break;
+      waitpid( pid, &status, 0 );
+    }
+    clock_gettime( CLOCK_MONOTONIC, &end );
+    seconds = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1e9;
+    printf( "%-8s %ld MB in %.3f s, %8.1f MB/s\n", method == 0 ? "splice" : method == 1 ? "external" : "bash",
+            size, seconds, size / seconds );
+  }
+  splice_builtins = 1;
+  unlink( "pipebench.tmp" );
+  unlink( "pipebench.out" );
+  return 0;
+}
+
+/*
+ * Function: par_command
+ * Parameters: command - The command words, which may contain {}
+ * arg - The argument for this run
+ * Returns: A new argument list with every {} replaced by arg,
+ * or with arg on the end if there was no {} anywhere, or NULL
+ * if we ran out of memory.  Everything is in one allocation.
+ */
+
+char **par_command( char **command, const char *arg )
+{
+  size_t words, length, arg_length;
+  int substituted = 0;
+  char **argv;
+  char *out, *p, *q;
+  int i;
+
+  arg_length = strlen( arg );
+  length = 0;
+  for ( words = 0; command[words] != NULL; words++ )
+  {
+    length += strlen( command[words] ) + 1;
+    for ( p = strstr( command[words], "{}" ); p != NULL; p = strstr( p + 2, "{}" ) )
+    {
+      length += arg_length;
+      substituted = 1;
+    }
+  }
+  if ( !substituted )
+    length += arg_length + 1;
+
+  argv = malloc( ( words + 2 ) * sizeof( char * ) + length );
+  if ( argv == NULL )
+    return NULL;
+  out = ( char * )( argv + words + 2 );
+
+  for ( i = 0; command[i] != NULL; i++ )
+  {
+    argv[i] = out;
+    for ( p = command[i]; ( q = strstr( p, "{}" ) ) != NULL; p = q + 2 )
+    {
+      memcpy( out, p, q - p );
+      out += q - p;
+      memcpy( out, arg, arg_length );
+      out += arg_length;
+    }
+    strcpy( out, p );
+    out += strlen( p ) + 1;
+  }
+  if ( !substituted )
+  {
+    argv[i++] = out;
+    strcpy( out, arg );
+  }
+  argv[i] = NULL;
+  return argv;
+}
+
+/*
+ * Function: par
+ * Parameter: args - par [-j N] [-k] command [{}] ... [::: arg ...]
+ * Returns: The exit status
+ * Description: Runs the command once for each argument with
+ * up to N (default: one per CPU) running at a time.  The
+ * arguments come after ::: or, without it, one per line from
+ * stdin.  A new run starts as soon as any running one exits.
+ * Each run's stdout is collected through a pipe and printed
+ * in one piece when it finishes, or in argument order with
+ * -k, so runs never interleave.  Runs get /dev/null for
+ * stdin and share the shell's stderr.  A line per run goes
+ * to stderr with its exit status and wall time, and a
+ * summary with the makespan at the end.
+ */
+
+struct par_run
+{
+  const char *arg;
+  pid_t pid;
+  int fd;
+  int status;
+  int finished;
+  char *output;
+  size_t length;
+  size_t size;
+  struct timespec start;
+  double seconds;
+};
+
+int par( char **args )
+{
+  struct par_run *runs = NULL;
+  struct pollfd *events = NULL;
+  int *active = NULL;
+  char **lines = NULL;
+  char **command, **argv;
+  const char **arguments;
+  struct signalfd_siginfo info;
+  struct rusage usage;
+  struct timespec start, now;
+  char buffer[65536];
+  char *line, *grown;
+  ssize_t n;
+  long jobs_max = sysconf( _SC_NPROCESSORS_ONLN );
+  int keep_order = 0;
+  int num_args, num_lines = 0;
+  int next = 0, printed = 0, first = 0, num_active = 0;
+  int failed = 0;
+  int i, a, e, pipe_fds[2], null_fd, status;
+  pid_t pid;
+  double total = 0;
+
+  // Options, then the command up to :::
+  for ( i = 1; args[i] != NULL && args[i][0] == '-'; i++ )
+  {
+    if ( strcmp( args[i], "-k" ) == 0 )
+      keep_order = 1;
+    else if ( strncmp( args[i], "-j", 2 ) == 0 && ( args[i][2] != '\0' || args[i + 1] != NULL ) )
+      jobs_max = atol( args[i][2] != '\0' ? args[i] + 2 : args[++i] );
+    else
+      break;
+  }
+  command = args + i;
+  for ( ; args[i] != NULL && strcmp( args[i], ":::" ) != 0; i++ )
+    ;
+  if ( command[0] == NULL || command == args + i || jobs_max < 1 )
+  {
+    printf( "par: usage: par [-j N] [-k] command [{}] ... [::: arg ...]\n" );
+    return 2;
+  }
+
+  if ( args[i] != NULL )
+  {
+    args[i] = NULL; // Ends the command words
+    arguments = ( const char ** )args + i + 1;
+    for ( num_args = 0; arguments[num_args] != NULL; num_args++ )
+      ;
+  }
+  else
+  {
+    // No :::, so read the arguments from stdin, which may be where the
+    // commands are coming from too
+    while ( ( line = readline( &stdin_reader ) ) != NULL )
+    {
+      n = strlen( line );
+      if ( n > 0 && line[n - 1] == '\r' )
+        line[--n] = '\0';
+      if ( n == 0 )
+        continue;
+      if ( ( num_lines & ( num_lines - 1 ) ) == 0 )
+      {
+        argv = realloc( lines, ( num_lines ? num_lines * 2 : 1 ) * sizeof( char * ) );
+        if ( argv == NULL )
+          break;
+        lines = argv;
+      }
+      lines[num_lines] = strdup( line );
+      if ( lines[num_lines] != NULL )
+        num_lines++;
+    }
+    stdin_reader.eof = 0; // A terminal can carry on after ctrl+d
+    arguments = ( const char ** )lines;
+    num_args = num_lines;
+  }
+
+  runs = calloc( num_args + 1, sizeof( struct par_run ) );
+  events = calloc( jobs_max + 1, sizeof( struct pollfd ) );
+  active = calloc( jobs_max, sizeof( int ) );
+  null_fd = open( "/dev/null", O_RDONLY | O_CLOEXEC );
+  if ( runs == NULL || events == NULL || active == NULL || null_fd == -1 )
+  {
+    printf( "par: %s\n", strerror( errno ) );
+    num_args = 0;
+  }
+
+  clock_gettime( CLOCK_MONOTONIC, &start );
+  while ( printed < num_args )
+  {
+    // Fill the free slots.  A run holds its slot until it has exited and
+    // we've read all of its output
+    while ( next < num_args && num_active < jobs_max )
+    {
+      runs[next].arg = arguments[next];
+      runs[next].fd = -1;
+      clock_gettime( CLOCK_MONOTONIC, &runs[next].start );
+      argv = par_command( command, arguments[next] );
+      if ( argv != NULL && pipe2( pipe_fds, O_CLOEXEC ) == 0 )
+      {
+        runs[next].pid = launch( argv, 0, null_fd, pipe_fds[1], -1 );
+        close( pipe_fds[1] );
+        if ( runs[next].pid > 0 )
+        {
+          runs[next].fd = pipe_fds[0];
+          active[num_active++] = next;
+        }
+        else
+          close( pipe_fds[0] );
+      }
+      if ( runs[next].fd == -1 )
+      {
+        runs[next].status = 127 << 8;
+        runs[next].finished = 1;
+      }
+      free( argv );
+      next++;
+    }
+
+    // Print whatever is finished, in order under -k or as it comes otherwise
+    for ( a = first; a < next && printed < num_args; a++ )
+    {
+      if ( !runs[a].finished || runs[a].finished == 2 )
+      {
+        if ( keep_order )
+          break;
+        continue;
+      }
+      fwrite( runs[a].output, 1, runs[a].length, stdout );
+      fflush( stdout );
+      status = WIFSIGNALED( runs[a].status ) ? 128 + WTERMSIG( runs[a].status ) : WEXITSTATUS( runs[a].status );
+      fprintf( stderr, "par: [%d] exit %d in %.3f s: %s\n", a + 1, status, runs[a].seconds, runs[a].arg );
+      failed += status != 0;
+      total += runs[a].seconds;
+      free( runs[a].output );
+      runs[a].output = NULL;
+      runs[a].finished = 2;
+      printed++;
+    }
+    while ( first < next && runs[first].finished == 2 )
+      first++;
+    if ( num_active == 0 )
+      continue;
+
+    // Wait for output or a child to exit
+    for ( e = 0; e < num_active; e++ )
+    {
+      events[e].fd = runs[active[e]].fd;
+      events[e].events = POLLIN;
+    }
+    events[e].fd = child_events;
+    events[e].events = POLLIN;
+    if ( poll( events, num_active + 1, -1 ) == -1 )
+      continue;
+
+    for ( e = 0; e < num_active; e++ )
+    {
+      if ( events[e].revents == 0 || runs[active[e]].fd == -1 )
+        continue;
+      a = active[e];
+      n = read( runs[a].fd, buffer, sizeof( buffer ) );
+      if ( n > 0 )
+      {
+        if ( runs[a].length + n > runs[a].size )
+        {
+          grown = realloc( runs[a].output, ( runs[a].length + n ) * 2 );
+          if ( grown == NULL )
+            continue;
+          runs[a].output = grown;
+          runs[a].size = ( runs[a].length + n ) * 2;
+        }
+        memcpy( runs[a].output + runs[a].length, buffer, n );
+        runs[a].length += n;
+      }
+      else
+      {
+        close( runs[a].fd );
+        runs[a].fd = -1;
+      }
+    }
+
+    if ( events[num_active].revents & POLLIN )
+    {
+      while ( read( child_events, &info, sizeof( info ) ) == sizeof( info ) )
+        ;
+      while ( ( pid = wait4( -1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage ) ) > 0 )
+      {
+        for ( e = 0; e < num_active && runs[active[e]].pid != pid; e++ )
+          ;
+        if ( e == num_active )
+          job_update( pid, status, &usage ); // One of the background jobs
+        else if ( WIFEXITED( status ) || WIFSIGNALED( status ) )
+        {
+          a = active[e];
+          runs[a].seconds = seconds_since( &runs[a].start );
+          runs[a].status = status;
+          runs[a].pid = 0;
+          stats_record( command[0], runs[a].seconds );
+          rusage_add( &foreground_usage, &usage );
+          foreground_children++;
+        }
+      }
+    }
+
+    // Give back the slots of runs that have exited and closed their output
+    for ( e = 0; e < num_active; )
+    {
+      a = active[e];
+      if ( runs[a].pid == 0 && runs[a].fd == -1 )
+      {
+        runs[a].finished = 1;
+        active[e] = active[--num_active];
+      }
+      else
+        e++;
+    }
+  }
+  clock_gettime( CLOCK_MONOTONIC, &now );
+
+  if ( num_args > 0 )
+    fprintf( stderr, "par: %d runs, %d failed, %ld at a time, makespan %.3f s, %.3f s of run time\n",
+             num_args, failed, jobs_max,
+             ( now.tv_sec - start.tv_sec ) + ( now.tv_nsec - start.tv_nsec ) / 1e9, total );
+
+  if ( null_fd != -1 )
+    close( null_fd );
+  for ( i = 0; i < num_lines; i++ )
+    free( lines[i] );
+  free( lines );
+  free( runs );
+  free( events );
+  free( active );
+  return failed != 0;
+}
+
+/*
+ * Function: script_bench
+ * Parameter: args - scriptbench [lines]
+ * Returns: The exit status
+ * Description: Writes a script of the given number of lines
+ * (default a million) of builtins and comments, runs it with
+ * a second copy of the shell, and reports lines per second
+ * and the copy's peak memory.  A tenth of the script is run
+ * first so the two peaks can be compared; they should be
+ * the same however long the script.  Uses scriptbench.msh
+ * in the current directory.
+ */
+
+int script_bench( char **args )
+{
+  const char *lines[] = { "cd .\n", "jobs\n", "# comment\n", "wait\n", "hash -r\n" };
+  char *command[] = { "/proc/self/exe", "scriptbench.msh", NULL };
+  char block[1 << 16];
+  struct timespec start, end;
+  struct rusage usage;
+  long count = 1000000;
+  long i, run, length;
+  size_t used = 0;
+  double seconds;
+  int fd, status;
+  pid_t pid;
+
+  if ( args[1] != NULL )
+    count = atol( args[1] );
+  if ( count < 10 )
+  {
+    printf( "scriptbench: usage: scriptbench [lines]\n" );
+    return 2;
+  }
+
+  for ( run = count / 10; run <= count; run += count - count / 10 )
+  {
+    fd = open( "scriptbench.msh", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    if ( fd == -1 )
+    {
+      printf( "scriptbench: scriptbench.msh: %s\n", strerror( errno ) );
+      return 1;
+    }
+    for ( i = 0; i < run; i++ )
+    {
+      length = strlen( lines[i % 5] );
+      if ( used + length > sizeof( block ) )
+      {
+        write( fd, block, used );
+        used = 0;
+      }
+      memcpy( block + used, lines[i % 5], length );
+      used += length;
+    }
+    write( fd, block, used );
+    used = 0;
+    close( fd );
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    pid = launch( command, 0, 0, 1, -1 );
+    if ( pid <= 0 || wait4( pid, &status, 0, &usage ) != pid )
+      break;
+    clock_gettime( CLOCK_MONOTONIC, &end );
+    seconds = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1e9;
+    printf( "%8ld lines in %.3f s, %6.2f M lines/s, peak memory %ld KB\n",
+            run, seconds, run / seconds / 1e6, usage.ru_maxrss );
+  }
+  unlink( "scriptbench.msh" );
+  return 0;
+}
+
+/*
+ * Function: builtin_echo
+ * Parameter: args - echo [-neE] [string ...]
+ * Returns: 0, or -1 to run the real echo
+ * Description: echo as coreutils does it.  Options are only
+ * taken while every letter is one of n, e and E; -e turns on
+ * backslash escapes, where \c stops all further output.
+ * --help and --version on their own go to the real echo.
+ */
+
+int builtin_echo( char **args )
+{
+  int newline = 1;
+  int escapes = 0;
+  int i = 1;
+  int c, digits;
+  const char *p, *s;
+
+  if ( args[1] != NULL && args[2] == NULL &&
+       ( strcmp( args[1], "--help" ) == 0 || strcmp( args[1], "--version" ) == 0 ) )
+    return -1;
+
+  for ( ; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++ )
+  {
+    if ( strspn( args[i] + 1, "neE" ) != strlen( args[i] + 1 ) )
+      break;
+    for ( p = args[i] + 1; *p != '\0'; p++ )
+    {
+      if ( *p == 'n' )
+        newline = 0;
+      else
+        escapes = *p == 'e';
+    }
+  }
+
+  for ( ; args[i] != NULL; i++ )
+  {
+    if ( !escapes )
+      fputs( args[i], stdout );
+    else
+    {
+      for ( s = args[i]; *s != '\0'; s++ )
+      {
+        c = *s;
+        if ( c == '\\' && s[1] != '\0' )
+        {
+          c = *++s;
+          switch ( c )
+          {
+            case 'a': c = '\a'; break;
+            case 'b': c = '\b'; break;
+            case 'c': return 0;
+            case 'e': c = '\033'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case 'v': c = '\v'; break;
+            case '\\': break;
+            case 'x':
+              if ( !isxdigit( ( unsigned char )s[1] ) )
+              {
+                putchar( '\\' );
+                break;
+              }
+              c = 0;
+              for ( digits = 0; digits < 2 && isxdigit( ( unsigned char )s[1] ); digits++ )
+              {
+                s++;
+                c = c * 16 + ( isdigit( ( unsigned char )*s ) ? *s - '0' : tolower( ( unsigned char )*s ) - 'a' + 10 );
+              }
+              break;
+            case '0': case '1': case '2': case '3':
+            case '4': case '5': case '6': case '7':
+              // \0 takes up to three more digits, \1 to \7 up to two more
+              digits = c == '0' ? 3 : 2;
+              c = c - '0';
+              for ( ; digits > 0 && s[1] >= '0' && s[1] <= '7'; digits-- )
+                c = c * 8 + *++s - '0';
+              break;
+            default:
+              putchar( '\\' );
+              break;
+          }
+        }
+        putchar( c );
+      }
+    }
+    if ( args[i + 1] != NULL )
+      putchar( ' ' );
+  }
+  if ( newline )
+    putchar( '\n' );
+  return 0;
+}
+
+/*
+ * Function: builtin_true / builtin_false
+ * Parameter: args - true or false, arguments ignored
+ * Returns: 0 or 1, or -1 to run the real program for a lone
+ * --help or --version
+ */
+
+int builtin_true( char **args )
+{
+  if ( args[1] != NULL && args[2] == NULL &&
+       ( strcmp( args[1], "--help" ) == 0 || strcmp( args[1], "--version" ) == 0 ) )
+    return -1;
+  return strcmp( args[0], "false" ) == 0;
+}
+
+/*
+ * Function: builtin_pwd
+ * Parameter: args - pwd [-L|-P]
+ * Returns: 0 on success, 1 on an error, -1 for --help and
+ * --version
+ * Description: pwd as coreutils does it, -P unless -L is
+ * given.  -L prints $PWD if it's absolute, has no . or ..
+ * parts and is the same directory as ., and falls back to
+ * -P otherwise.
+ */
+
+int builtin_pwd( char **args )
+{
+  struct stat here, named;
+  const char *pwd = getenv( "PWD" );
+  const char *dot;
+  char *cwd;
+  int logical = 0;
+  int i;
+
+  for ( i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++ )
+  {
+    if ( strcmp( args[i], "--" ) == 0 )
+    {
+      i++;
+      break;
+    }
+    if ( strncmp( args[i], "--", 2 ) == 0 || strspn( args[i] + 1, "LP" ) != strlen( args[i] + 1 ) )
+      return -1; // Long options and errors, the real pwd words them
+    logical = args[i][strlen( args[i] ) - 1] == 'L';
+  }
+  if ( args[i] != NULL )
+    fprintf( stderr, "pwd: ignoring non-option arguments\n" );
+
+  // $PWD can't be used if it has a . or .. component anywhere
+  for ( dot = pwd; logical && dot != NULL && ( dot = strstr( dot, "/." ) ) != NULL; dot++ )
+  {
+    if ( dot[2] == '\0' || dot[2] == '/' || ( dot[2] == '.' && ( dot[3] == '\0' || dot[3] == '/' ) ) )
+      logical = 0;
+  }
+  if ( logical && pwd != NULL && pwd[0] == '/' && stat( pwd, &named ) == 0 && stat( ".", &here ) == 0 &&
+       named.st_dev == here.st_dev && named.st_ino == here.st_ino )
+  {
+    puts( pwd );
+    return 0;
+  }
+
+  cwd = getcwd( NULL, 0 );
+  if ( cwd == NULL )
+  {
+    fprintf( stderr, "pwd: couldn't find directory entry in '..' with matching i-node\n" );
+    return 1;
+  }
+  puts( cwd );
+  free( cwd );
+  return 0;
+}
+
+/*
+ * Function: quote_arg
+ * Parameter: s - An argument to put in an error message
+ * Returns: s in single quotes, with backslashes, quotes and
+ * unprintable characters escaped the way coreutils shows them
+ * in the C locale.  The memory is the line's, from line_arena.
+ */
+
+const char *quote_arg( const char *s )
+{
+  char *quoted = arena_alloc( &line_arena, 4 * strlen( s ) + 3 );
+  char *out = quoted;
+  const char *plain = "\a\b\f\n\r\t\v\\'";
+  const char *letters = "abfnrtv\\'";
+  const char *e;
+
+  if ( quoted == NULL )
+    return s;
+  *out++ = '\'';
+  for ( ; *s != '\0'; s++ )
+  {
+    e = strchr( plain, *s );
+    if ( e != NULL )
+    {
+      *out++ = '\\';
+      *out++ = letters[e - plain];
+    }
+    else if ( !isprint( ( unsigned char )*s ) )
+      out += sprintf( out, "\\%03o", ( unsigned char )*s );
+    else
+      *out++ = *s;
+  }
+  *out++ = '\'';
+  *out = '\0';
+  return quoted;
+}
+
+/*
+ * test and [ as coreutils does them.  With four arguments or
+ * fewer the POSIX rules decide what each argument is,
+ * otherwise it's a recursive descent over -o, -a, ! and
+ * parentheses.  A syntax error jumps straight back out of
+ * however deep the parse is and test returns 2.
+ */
+
+struct test_state
+{
+  char **argv;
+  int argc;
+  int pos;
+  const char *name;
+  jmp_buf error;
+};
+
+void test_error( struct test_state *t, const char *format, const char *arg )
+{
+  fprintf( stderr, "%s: ", t->name );
+  fprintf( stderr, format, arg != NULL ? quote_arg( arg ) : "" );
+  fputc( '\n', stderr );
+  longjmp( t->error, 1 );
+}
+
+void test_beyond( struct test_state *t )
+{
+  test_error( t, "missing argument after %s", t->argv[t->argc - 1] );
+}
+
+void test_advance( struct test_state *t, int need_more )
+{
+  t->pos++;
+  if ( need_more && t->pos >= t->argc )
+    test_beyond( t );
+}
+
+int test_binop( const char *s )
+{
+  const char *ops[] = { "=", "!=", "==", ">", "<", "-nt", "-ot", "-ef",
+                        "-eq", "-ne", "-lt", "-le", "-gt", "-ge", NULL };
+  int i;
+
+  for ( i = 0; ops[i] != NULL; i++ )
+  {
+    if ( strcmp( s, ops[i] ) == 0 )
+      return 1;
+  }
+  return 0;
+}
+
+int test_unop( const char *s )
+{
+  return s[0] == '-' && s[1] != '\0' && s[2] == '\0' && strchr( "abcdefghknOprstuwxzGLS", s[1] ) != NULL;
+}
+
+/*
+ * Function: test_int
+ * Parameters: t - The parse
+ * s - An argument that should be an integer
+ * Returns: The digits, past any blanks, sign and leading zeros,
+ * with *negative set.  Integers can be any length, so they are
+ * compared as strings rather than converted.
+ */
+
+const char *test_int( struct test_state *t, const char *s, int *negative, size_t *length )
+{
+  const char *p = s;
+  const char *digits;
+
+  while ( *p == ' ' || *p == '\t' || *p == '\n' || *p == '\v' || *p == '\f' || *p == '\r' )
+    p++;
+  *negative = *p == '-';
+  if ( *p == '-' || *p == '+' )
+    p++;
+  if ( !isdigit( ( unsigned char )*p ) )
+    test_error( t, "invalid integer %s", s );
+  while ( *p == '0' && isdigit( ( unsigned char )p[1] ) )
+    p++;
+  digits = p;
+  while ( isdigit( ( unsigned char )*p ) )
+    p++;
+  *length = p - digits;
+  while ( *p == ' ' || *p == '\t' || *p == '\n' || *p == '\v' || *p == '\f' || *p == '\r' )
+    p++;
+  if ( *p != '\0' )
+    test_error( t, "invalid integer %s", s );
+  if ( *length == 1 && *digits == '0' )
+    *negative = 0;
+  return digits;
+}
+
+int test_compare_ints( struct test_state *t, const char *left, const char *right )
+{
+  int left_negative, right_negative, cmp;
+  size_t left_length, right_length;
+  const char *l = test_int( t, left, &left_negative, &left_length );
+  const char *r = test_int( t, right, &right_negative, &right_length );
+
+  if ( left_negative != right_negative )
+    return left_negative ? -1 : 1;
+  if ( left_length != right_length )
+    cmp = left_length < right_length ? -1 : 1;
+  else
+    cmp = strncmp( l, r, left_length );
+  cmp = cmp < 0 ? -1 : cmp > 0;
+  return left_negative ? -cmp : cmp;
+}
+
+int test_binary( struct test_state *t, int left_is_length )
+{
+  char length_buffer[48]; // The left length, then the right
+  const char *left, *right, *op;
+  struct stat left_info, right_info;
+  int left_ok, right_ok, cmp;
+  int at = t->pos + left_is_length;
+
+  op = t->argv[at + 1];
+  left = t->argv[at];
+  if ( left_is_length )
+  {
+    snprintf( length_buffer, 24, "%zu", strlen( left ) );
+    left = length_buffer;
+  }
+  right = t->argv[at + 2];
+  t->pos = at + 3;
+
+  if ( op[0] == '-' && ( strcmp( op, "-nt" ) == 0 || strcmp( op, "-ot" ) == 0 || strcmp( op, "-ef" ) == 0 ) )
+  {
+    if ( left_is_length )
+      test_error( t, "%s does not accept -l", op );
+    left_ok = stat( left, &left_info ) == 0;
+    right_ok = stat( right, &right_info ) == 0;
+    if ( op[1] == 'e' )
+      return left_ok && right_ok && left_info.st_dev == right_info.st_dev && left_info.st_ino == right_info.st_ino;
+    if ( !left_ok || !right_ok )
+      return op[1] == 'n' ? left_ok : right_ok;
+    cmp = left_info.st_mtim.tv_sec != right_info.st_mtim.tv_sec ?
+          ( left_info.st_mtim.tv_sec > right_info.st_mtim.tv_sec ? 1 : -1 ) :
+          ( left_info.st_mtim.tv_nsec > right_info.st_mtim.tv_nsec ) - ( left_info.st_mtim.tv_nsec < right_info.st_mtim.tv_nsec );
+    return op[1] == 'n' ? cmp > 0 : cmp < 0;
+  }
+  if ( op[0] == '-' )
+  {
+    if ( strcmp( right, "-l" ) == 0 && t->pos < t->argc )
+    {
+      t->pos++;
+      right = length_buffer + 24;
+      snprintf( length_buffer + 24, 24, "%zu", strlen( t->argv[t->pos - 1] ) );
+    }
+    cmp = test_compare_ints( t, left, right );
+    if ( strcmp( op, "-eq" ) == 0 )
+      return cmp == 0;
+    if ( strcmp( op, "-ne" ) == 0 )
+      return cmp != 0;
+    if ( strcmp( op, "-lt" ) == 0 )
+      return cmp < 0;
+    if ( strcmp( op, "-le" ) == 0 )
+      return cmp <= 0;
+    if ( strcmp( op, "-gt" ) == 0 )
+      return cmp > 0;
+    return cmp >= 0;
+  }
+  if ( strcmp( op, "=" ) == 0 || strcmp( op, "==" ) == 0 )
+    return strcmp( left, right ) == 0;
+  if ( strcmp( op, "!=" ) == 0 )
+    return strcmp( left, right ) != 0;
+  cmp = strcoll( left, right );
+  return op[0] == '>' ? cmp > 0 : cmp < 0;
+}
+
+int test_unary( struct test_state *t )
+{
+  struct stat info;
+  const char *arg;
+  char op = t->argv[t->pos][1];
+  int negative;
+  size_t length;
+  const char *digits;
+
+  test_advance( t, 1 );
+  arg = t->argv[t->pos++];
+  switch ( op )
+  {
+    case 'a':
+    case 'e': return stat( arg, &info ) == 0;
+    case 'r': return euidaccess( arg, R_OK ) == 0;
+    case 'w': return euidaccess( arg, W_OK ) == 0;
+    case 'x': return euidaccess( arg, X_OK ) == 0;
+    case 'O': return stat( arg, &info ) == 0 && info.st_uid == geteuid();
+    case 'G': return stat( arg, &info ) == 0 && info.st_gid == getegid();
+    case 'f': return stat( arg, &info ) == 0 && S_ISREG( info.st_mode );
+    case 'd': return stat( arg, &info ) == 0 && S_ISDIR( info.st_mode );
+    case 's': return stat( arg, &info ) == 0 && info.st_size > 0;
+    case 'S': return stat( arg, &info ) == 0 && S_ISSOCK( info.st_mode );
+    case 'c': return stat( arg, &info ) == 0 && S_ISCHR( info.st_mode );
+    case 'b': return stat( arg, &info ) == 0 && S_ISBLK( info.st_mode );
+    case 'p': return stat( arg, &info ) == 0 && S_ISFIFO( info.st_mode );
+    case 'h':
+    case 'L': return lstat( arg, &info ) == 0 && S_ISLNK( info.st_mode );
+    case 'u': return stat( arg, &info ) == 0 && ( info.st_mode & S_ISUID );
+    case 'g': return stat( arg, &info ) == 0 && ( info.st_mode & S_ISGID );
+    case 'k': return stat( arg, &info ) == 0 && ( info.st_mode & S_ISVTX );
+    case 't':
+      digits = test_int( t, arg, &negative, &length );
+      return !negative && length < 10 && isatty( atoi( digits ) );
+    case 'n': return arg[0] != '\0';
+    case 'z': return arg[0] == '\0';
+  }
+  return 0;
+}
+
+int test_posix( struct test_state *t, int nargs );
+
+int test_expr( struct test_state *t );
+
+int test_term( struct test_state *t )
+{
+  int invert = 0;
+  int value, nargs;
+
+  if ( t->pos >= t->argc )
+    test_beyond( t );
+  while ( t->pos < t->argc && strcmp( t->argv[t->pos], "!" ) == 0 )
+  {
+    test_advance( t, 1 );
+    invert = !invert;
+  }
+
+  if ( strcmp( t->argv[t->pos], "(" ) == 0 )
+  {
+    test_advance( t, 1 );
+    for ( nargs = 1; t->pos + nargs < t->argc && strcmp( t->argv[t->pos + nargs], ")" ) != 0; nargs++ )
+    {
+      if ( nargs == 4 )
+      {
+        nargs = t->argc - t->pos;
+        break;
+      }
+    }
+    value = test_posix( t, nargs );
+    if ( t->pos >= t->argc )
+      test_error( t, "')' expected", NULL );
+    else if ( strcmp( t->argv[t->pos], ")" ) != 0 )
+      test_error( t, "')' expected, found %s", t->argv[t->pos] );
+    test_advance( t, 0 );
+  }
+  else if ( t->argc - t->pos >= 4 && strcmp( t->argv[t->pos], "-l" ) == 0 && test_binop( t->argv[t->pos + 2] ) )
+    value = test_binary( t, 1 );
+  else if ( t->argc - t->pos >= 3 && test_binop( t->argv[t->pos + 1] ) )
+    value = test_binary( t, 0 );
+  else if ( t->argv[t->pos][0] == '-' && t->argv[t->pos][1] != '\0' && t->argv[t->pos][2] == '\0' )
+  {
+    if ( !test_unop( t->argv[t->pos] ) )
+      test_error( t, "%s: unary operator expected", t->argv[t->pos] );
+    value = test_unary( t );
+  }
+  else
+  {
+    value = t->argv[t->pos][0] != '\0';
+    test_advance( t, 0 );
+  }
+  return invert ^ value;
+}
+
+int test_and( struct test_state *t )
+{
+  int value = test_term( t );
+
+  while ( t->pos < t->argc && strcmp( t->argv[t->pos], "-a" ) == 0 )
+  {
+    test_advance( t, 0 );
+    value = test_term( t ) && value;
+  }
+  return value;
+}
+
+int test_expr( struct test_state *t )
+{
+  int value = test_and( t );
+
+  while ( t->pos < t->argc && strcmp( t->argv[t->pos], "-o" ) == 0 )
+  {
+    test_advance( t, 0 );
+    value = test_and( t ) || value;
+  }
+  return value;
+}
+
+int test_one( struct test_state *t )
+{
+  return t->argv[t->pos++][0] != '\0';
+}
+
+int test_two( struct test_state *t )
+{
+  if ( strcmp( t->argv[t->pos], "!" ) == 0 )
+  {
+    test_advance( t, 0 );
+    return !test_one( t );
+  }
+  if ( t->argv[t->pos][0] == '-' && t->argv[t->pos][1] != '\0' && t->argv[t->pos][2] == '\0' )
+  {
+    if ( !test_unop( t->argv[t->pos] ) )
+      test_error( t, "%s: unary operator expected", t->argv[t->pos] );
+    return test_unary( t );
+  }
+  test_beyond( t );
+  return 0;
+}
+
+int test_three( struct test_state *t )
+{
+  int value;
+
+  if ( test_binop( t->argv[t->pos + 1] ) )
+    return test_binary( t, 0 );
+  if ( strcmp( t->argv[t->pos], "!" ) == 0 )
+  {
+    test_advance( t, 1 );
+    return !test_two( t );
+  }
+  if ( strcmp( t->argv[t->pos], "(" ) == 0 && strcmp( t->argv[t->pos + 2], ")" ) == 0 )
+  {
+    test_advance( t, 0 );
+    value = test_one( t );
+    test_advance( t, 0 );
+    return value;
+  }
+  if ( strcmp( t->argv[t->pos + 1], "-a" ) == 0 || strcmp( t->argv[t->pos + 1], "-o" ) == 0 )
+    return test_expr( t );
+  test_error( t, "%s: binary operator expected", t->argv[t->pos + 1] );
+  return 0;
+}
+
+int test_posix( struct test_state *t, int nargs )
+{
+  int value;
+
+  switch ( nargs )
+  {
+    case 1:
+      return test_one( t );
+    case 2:
+      return test_two( t );
+    case 3:
+      return test_three( t );
+    case 4:
+      if ( strcmp( t->argv[t->pos], "!" ) == 0 )
+      {
+        test_advance( t, 1 );
+        return !test_three( t );
+      }
+      if ( strcmp( t->argv[t->pos], "(" ) == 0 && strcmp( t->argv[t->pos + 3], ")" ) == 0 )
+      {
+        test_advance( t, 0 );
+        value = test_two( t );
+        test_advance( t, 0 );
+        return value;
+      }
+  }
+  return test_expr( t );
+}
+
+/*
+ * Function: builtin_test
+ * Parameter: args - test expression, or [ expression ]
+ * Returns: 0 if the expression is true, 1 if it's false, 2 on
+ * a syntax error, or -1 to run the real [ for --help or
+ * --version
+ */
+
+int builtin_test( char **args )
+{
+  struct test_state t;
+  int value;
+
+  for ( t.argc = 0; args[t.argc] != NULL; t.argc++ )
+    ;
+  t.argv = args;
+  t.pos = 1;
+  t.name = args[0];
+
+  if ( strcmp( args[0], "[" ) == 0 )
+  {
+    if ( t.argc == 2 && ( strcmp( args[1], "--help" ) == 0 || strcmp( args[1], "--version" ) == 0 ) )
+      return -1;
+    if ( strcmp( args[t.argc - 1], "]" ) != 0 )
+    {
+      fprintf( stderr, "[: missing ']'\n" );
+      return 2;
+    }
+    t.argc--;
+  }
+
+  if ( setjmp( t.error ) != 0 )
+    return 2;
+  if ( t.pos >= t.argc )
+    return 1;
+  value = test_posix( &t, t.argc - 1 );
+  if ( t.pos != t.argc )
+    test_error( &t, "extra argument %s", args[t.pos] );
+  return !value;
+}
+
+/*
+ * printf as coreutils does it: the format is used again for as
+ * long as there are arguments left, missing arguments count as
+ * "" or 0, numbers can be in C notation or 'c for a character
+ * code, and %b takes escapes in its argument.  %q and \u are
+ * left to the real printf.
+ */
+
+struct printf_state
+{
+  int status;
+  int stop;       // Set by \c
+};
+
+/*
+ * Function: printf_escape
+ * Parameters: p - Just past a backslash
+ * octal_0 - 1 inside %b, where \0 starts up to three octal digits
+ * out - Where the output goes
+ * state - Set to stop on \c
+ * Returns: How many characters after the backslash were used,
+ * -1 if the real printf has to do it, or -2 after an error
+ * that ends printf
+ */
+
+int printf_escape( const char *p, int octal_0, FILE *out, struct printf_state *state )
+{
+  const char *start = p;
+  int value = 0;
+  int length;
+
+  if ( *p == 'x' )
+  {
+    for ( length = 0, p++; length < 2 && isxdigit( ( unsigned char )*p ); length++, p++ )
+      value = value * 16 + ( isdigit( ( unsigned char )*p ) ? *p - '0' : tolower( ( unsigned char )*p ) - 'a' + 10 );
+    if ( length == 0 )
+    {
+      fprintf( stderr, "printf: missing hexadecimal number in escape\n" );
+      return -2;
+    }
+    fputc( value, out );
+  }
+  else if ( *p >= '0' && *p <= '7' )
+  {
+    for ( length = 0, p += octal_0 && *p == '0'; length < 3 && *p >= '0' && *p <= '7'; length++, p++ )
+      value = value * 8 + *p - '0';
+    fputc( value, out );
+  }
+  else if ( *p != '\0' && strchr( "\"\\abcefnrtv", *p ) != NULL )
+  {
+    switch ( *p++ )
+    {
+      case 'a': fputc( '\a', out ); break;
+      case 'b': fputc( '\b', out ); break;
+      case 'c': state->stop = 1; break;
+      case 'e': fputc( '\033', out ); break;
+      case 'f': fputc( '\f', out ); break;
+      case 'n': fputc( '\n', out ); break;
+      case 'r': fputc( '\r', out ); break;
+      case 't': fputc( '\t', out ); break;
+      case 'v': fputc( '\v', out ); break;
+      default: fputc( p[-1], out ); break;
+    }
+  }
+  else if ( *p == 'u' || *p == 'U' )
+    return -1;
+  else
+  {
+    fputc( '\\', out );
+    if ( *p != '\0' )
+      fputc( *p++, out );
+  }
+  return p - start;
+}
+
+/*
+ * Function: printf_number
+ * Parameters: s - The argument
+ * end - Where the conversion stopped
+ * state - Gets status 1 on an error
+ * Description: The checks coreutils makes after converting an
+ * argument, with the same messages.  The value is still
+ * printed either way.
+ */
+
+void printf_number( const char *s, const char *end, struct printf_state *state )
+{
+  if ( errno != 0 )
+  {
+    fprintf( stderr, "printf: %s: %s\n", quote_arg( s ), strerror( errno ) );
+    state->status = 1;
+  }
+  else if ( *end != '\0' )
+  {
+    if ( s == end )
+      fprintf( stderr, "printf: %s: expected a numeric value\n", quote_arg( s ) );
+    else
+      fprintf( stderr, "printf: %s: value not completely converted\n", quote_arg( s ) );
+    state->status = 1;
+  }
+}
+
+int printf_character( const char *s, long double *value )
+{
+  if ( *s != '"' && *s != '\'' )
+    return 0;
+  *value = ( unsigned char )s[1];
+  if ( s[1] != '\0' && s[2] != '\0' )
+    fprintf( stderr, "printf: warning: %s: character(s) following character constant have been ignored\n", s + 2 );
+  return 1;
+}
+
+// The four ways a conversion can be called, depending on * for the width
+// and precision
+#define PRINTF_WITH( format, value ) \
+  ( have_width ? ( have_precision ? fprintf( out, format, width, precision, value ) : fprintf( out, format, width, value ) ) \
+               : ( have_precision ? fprintf( out, format, precision, value ) : fprintf( out, format, value ) ) )
+
+/*
+ * Function: printf_format
+ * Parameters: format - The format
+ * args - The arguments left
+ * out - Where the output goes
+ * state - Errors and \c
+ * Returns: How many arguments were used, -1 if the real
+ * printf has to do it, or -2 after an error that ends printf
+ */
+
+int printf_format( const char *format, char **args, FILE *out, struct printf_state *state )
+{
+  char spec[64];
+  char **first = args;
+  const char *f, *start, *arg;
+  char *end;
+  long double character;
+  intmax_t value, number;
+  int width = 0, precision = 0;
+  int have_width, have_precision, length, used;
+  char conversion;
+  char ok[256];
+
+  for ( f = format; *f != '\0' && !state->stop; f++ )
+  {
+    if ( *f == '\\' )
+    {
+      used = printf_escape( f + 1, 0, out, state );
+      if ( used < 0 )
+        return used;
+      f += used;
+      continue;
+    }
+    if ( *f != '%' )
+    {
+      fputc( *f, out );
+      continue;
+    }
+
+    start = f++;
+    length = 1;
+    have_width = have_precision = 0;
+    if ( *f == '%' )
+    {
+      fputc( '%', out );
+      continue;
+    }
+    if ( *f == 'b' )
+    {
+      if ( *args != NULL )
+      {
+        for ( arg = *args++; *arg != '\0' && !state->stop; arg++ )
+        {
+          if ( *arg != '\\' )
+            fputc( *arg, out );
+          else if ( ( used = printf_escape( arg + 1, 1, out, state ) ) < 0 )
+            return used;
+          else
+            arg += used;
+        }
+      }
+      continue;
+    }
+
+    // Flags, then which conversions they still allow
+    memset( ok, 0, sizeof( ok ) );
+    ok['a'] = ok['A'] = ok['c'] = ok['d'] = ok['e'] = ok['E'] = ok['f'] = ok['F'] = 1;
+    ok['g'] = ok['G'] = ok['i'] = ok['o'] = ok['s'] = ok['u'] = ok['x'] = ok['X'] = 1;
+    for ( ; ; f++, length++ )
+    {
+      if ( *f == 'I' || *f == '\'' )
+        ok['a'] = ok['A'] = ok['c'] = ok['e'] = ok['E'] = ok['o'] = ok['s'] = ok['x'] = ok['X'] = 0;
+      else if ( *f == '#' )
+        ok['c'] = ok['d'] = ok['i'] = ok['s'] = ok['u'] = 0;
+      else if ( *f == '0' )
+        ok['c'] = ok['s'] = 0;
+      else if ( *f != '-' && *f != '+' && *f != ' ' )
+        break;
+    }
+    if ( *f == '*' )
+    {
+      f++;
+      length++;
+      have_width = 1;
+      if ( *args != NULL )
+      {
+        errno = 0;
+        arg = *args++;
+        number = printf_character( arg, &character ) ? ( intmax_t )character : strtoimax( arg, &end, 0 );
+        if ( arg[0] != '"' && arg[0] != '\'' )
+          printf_number( arg, end, state );
+        if ( number < INT_MIN || number > INT_MAX )
+        {
+          fprintf( stderr, "printf: invalid field width: %s\n", quote_arg( arg ) );
+          return -2;
+        }
+        width = number;
+      }
+      else
+        width = 0;
+    }
+    else
+    {
+      for ( ; isdigit( ( unsigned char )*f ); f++ )
+        length++;
+    }
+    if ( *f == '.' )
+    {
+      f++;
+      length++;
+      ok['c'] = 0;
+      if ( *f == '*' )
+      {
+        f++;
+        length++;
+        have_precision = 1;
+        if ( *args != NULL )
+        {
+          errno = 0;
+          arg = *args++;
+          number = printf_character( arg, &character ) ? ( intmax_t )character : strtoimax( arg, &end, 0 );
+          if ( arg[0] != '"' && arg[0] != '\'' )
+            printf_number( arg, end, state );
+          if ( number > INT_MAX )
+          {
+            fprintf( stderr, "printf: invalid precision: %s\n", quote_arg( arg ) );
+            return -2;
+          }
+          precision = number < 0 ? -1 : number;
+        }
+        else
+          precision = 0;
+      }
+      else
+      {
+        for ( ; isdigit( ( unsigned char )*f ); f++ )
+          length++;
+      }
+    }
+    while ( *f == 'l' || *f == 'L' || *f == 'h' || *f == 'j' || *f == 't' || *f == 'z' )
+      f++;
+    conversion = *f;
+    if ( conversion == 'q' || length > 48 )
+      return -1;
+    if ( !ok[( unsigned char )conversion] )
+    {
+      fprintf( stderr, "printf: %.*s: invalid conversion specification\n", ( int )( f + 1 - start ), start );
+      return -2;
+    }
+
+    // The spec as written, with the length the value will have
+    memcpy( spec, start, length );
+    arg = *args != NULL ? *args++ : "";
+    errno = 0;
+    switch ( conversion )
+    {
+      case 'd':
+      case 'i':
+        strcpy( spec + length, "j" );
+        spec[length + 1] = conversion;
+        spec[length + 2] = '\0';
+        if ( printf_character( arg, &character ) )
+          value = ( intmax_t )character;
+        else
+        {
+          value = strtoimax( arg, &end, 0 );
+          printf_number( arg, end, state );
+        }
+        PRINTF_WITH( spec, value );
+        break;
+      case 'o':
+      case 'u':
+      case 'x':
+      case 'X':
+        strcpy( spec + length, "j" );
+        spec[length + 1] = conversion;
+        spec[length + 2] = '\0';
+        if ( printf_character( arg, &character ) )
+          value = ( intmax_t )character;
+        else
+        {
+          value = ( intmax_t )strtoumax( arg, &end, 0 );
+          printf_number( arg, end, state );
+        }
+        PRINTF_WITH( spec, ( uintmax_t )value );
+        break;
+      case 'a': case 'A': case 'e': case 'E':
+      case 'f': case 'F': case 'g': case 'G':
+        strcpy( spec + length, "L" );
+        spec[length + 1] = conversion;
+        spec[length + 2] = '\0';
+        if ( !printf_character( arg, &character ) )
+        {
+          character = strtold( arg, &end );
+          printf_number( arg, end, state );
+        }
+        PRINTF_WITH( spec, character );
+        break;
+      case 'c':
+        spec[length] = 'c';
+        spec[length + 1] = '\0';
+        PRINTF_WITH( spec, arg[0] );
+        break;
+      case 's':
+        spec[length] = 's';
+        spec[length + 1] = '\0';
+        PRINTF_WITH( spec, arg );
+        break;
+    }
+  }
+  return args - first;
+}
+
+/*
+ * Function: builtin_printf
+ * Parameter: args - printf format [argument ...]
+ * Returns: 0, 1 if an argument was bad, or -1 to run the real
+ * printf for anything it does that we don't
+ * Description: The output is built up in memory and only
+ * written once the whole format has been done, so if we
+ * have to hand over to the real printf part way through
+ * nothing has been printed twice.  The memory stream is
+ * kept for the next call.
+ */
+
+int builtin_printf( char **args )
+{
+  static FILE *out = NULL;
+  static char *buffer = NULL;
+  static size_t size = 0;
+  struct printf_state state = { 0, 0 };
+  const char *format;
+  int used;
+
+  if ( args[1] != NULL && args[2] == NULL &&
+       ( strcmp( args[1], "--help" ) == 0 || strcmp( args[1], "--version" ) == 0 ) )
+    return -1;
+  if ( args[1] != NULL && strcmp( args[1], "--" ) == 0 )
+    args++;
+  if ( args[1] == NULL )
+  {
+    fprintf( stderr, "printf: missing operand\nTry 'printf --help' for more information.\n" );
+    return 1;
+  }
+
+  if ( out == NULL )
+    out = open_memstream( &buffer, &size );
+  if ( out == NULL )
+    return -1;
+  rewind( out );
+
+  format = args[1];
+  args += 2;
+  do
+  {
+    used = printf_format( format, args, out, &state );
+    if ( used == -1 )
+      return -1;
+    if ( used == -2 )
+      break;
+    args += used;
+  }
+  while ( used > 0 && *args != NULL && !state.stop );
+
+  fflush( out );
+  fwrite( buffer, 1, ftell( out ), stdout );
+  if ( used == -2 )
+    return 1;
+  if ( state.stop )
+    return 0;
+  if ( *args != NULL )
+    fprintf( stderr, "printf: warning: ignoring excess arguments, starting with %s\n", quote_arg( *args ) );
+  return state.status;
+}
+
+/*
+ * Function: builtin_bench
+ * Parameter: args - builtinbench [lines]
+ * Returns: The exit status
+ * Description: Writes a script of the given number of lines
+ * (default 5000) of echo, printf, test, [, pwd and true, the
+ * commands scripts spend most of their launches on, and
+ * runs it with a second copy of the shell twice: once with
+ * them in the shell and once with builtins off.  Reports
+ * the time for each and whether the two outputs match.
+ * Uses builtinbench.msh and builtinbench.out* in the
+ * current directory.
+ */
+
+int builtin_bench( char **args )
+{
+  const char *lines[] = { "echo checking item 42\n", "test -d /tmp\n", "[ 3 -lt 5 ]\n",
+                          "printf %s=%d\\n count 7\n", "true\n", "pwd\n",
+                          "echo -e tab\\there\n", "printf %05.1f:%x:%-4s:\\n 3.14159 255 ab\n",
+                          "[ -n abc -a abc = abc ]\n", "echo done >> builtinbench.log\n" };
+  char *command[] = { "/proc/self/exe", "builtinbench.msh", NULL };
+  const char *outputs[] = { "builtinbench.out1", "builtinbench.out2" };
+  struct timespec start, end;
+  double seconds[2];
+  char block[4096], other[4096];
+  long count = 5000;
+  long i;
+  ssize_t n, m;
+  int run, fd, out, status, same;
+  pid_t pid;
+
+  if ( args[1] != NULL )
+    count = atol( args[1] );
+  if ( count < 1 )
+  {
+    printf( "builtinbench: usage: builtinbench [lines]\n" );
+    return 2;
+  }
+
+  for ( run = 0; run < 2; run++ )
+  {
+    fd = open( "builtinbench.msh", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    out = open( outputs[run], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    if ( fd == -1 || out == -1 )
+    {
+      printf( "builtinbench: %s\n", strerror( errno ) );
+      return 1;
+    }
+    if ( run == 1 )
+      write( fd, "builtins off\n", 13 );
+    for ( i = 0; i < count; i++ )
+      write( fd, lines[i % 10], strlen( lines[i % 10] ) );
+    close( fd );
+    unlink( "builtinbench.log" );
+
+    clock_gettime( CLOCK_MONOTONIC, &start );
+    pid = launch( command, 0, 0, out, -1 );
+    close( out );
+    if ( pid <= 0 || waitpid( pid, &status, 0 ) != pid )
+      return 1;
+    clock_gettime( CLOCK_MONOTONIC, &end );
+    seconds[run] = ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1e9;
+    printf( "%-9s %6ld lines in %7.3f s, %9.0f lines/s\n", run == 0 ? "builtins" : "programs",
+            count, seconds[run], count / seconds[run] );
+  }
+
+  // builtins off prints one line the other run doesn't have
+  fd = open( outputs[0], O_RDONLY | O_CLOEXEC );
+  out = open( outputs[1], O_RDONLY | O_CLOEXEC );
+  same = fd != -1 && out != -1 && read( out, other, 14 ) == 14;
+  while ( same && ( n = read( fd, block, sizeof( block ) ) ) > 0 )
+  {
+    for ( m = 0; m < n; m += i )
+    {
+      i = read( out, other + m, n - m );
+      if ( i <= 0 )
+        break;
+    }
+    same = m == n && memcmp( block, other, n ) == 0;
+  }
+  same = same && read( out, other, 1 ) == 0;
+  printf( "speedup %.1fx, output %s\n", seconds[1] / seconds[0], same ? "identical" : "differs" );
+  if ( fd != -1 )
+    close( fd );
+  if ( out != -1 )
+    close( out );
+  unlink( "builtinbench.msh" );
+  unlink( "builtinbench.log" );
+  unlink( outputs[0] );
+  unlink( outputs[1] );
+  return 0;
+}
+
+/*
+ * Function: stats_builtin
+ * Parameter: args - stats [-r] [name ...]
+ * Returns: The exit status
+ * Description: Shows, for every command run this session or
+ * just the ones named, how many times it ran, the mean,
+ * approximate percentiles from the histogram and the worst
+ * case, and the histogram itself, slowest total first so
+ * the tools a script spends its time in come out on top.
+ * -r forgets everything.
+ */
+
+int stats_builtin( char **args )
+{
+  struct command_stats **order;
+  struct command_stats *c;
+  const double percentiles[] = { 0.5, 0.9, 0.99 };
+  double bound[3];
+  unsigned long seen, widest;
+  unsigned int i, j, n = 0;
+  int b, p, k, bar, named;
+
+  if ( args[1] != NULL && strcmp( args[1], "-r" ) == 0 )
+  {
+    for ( i = 0; i < stats_size; i++ )
+      free( stats_table[i].name );
+    free( stats_table );
+    stats_table = NULL;
+    stats_size = stats_used = 0;
+    return 0;
+  }
+
+  order = malloc( ( stats_used + 1 ) * sizeof( struct command_stats * ) );
+  if ( order == NULL )
+    return 1;
+  for ( i = 0; i < stats_size; i++ )
+  {
+    if ( stats_table[i].name == NULL )
+      continue;
+    for ( named = args[1] == NULL, k = 1; !named && args[k] != NULL; k++ )
+      named = strcmp( args[k], stats_table[i].name ) == 0;
+    if ( !named )
+      continue;
+    for ( j = n++; j > 0 && order[j - 1]->total < stats_table[i].total; j-- )
+      order[j] = order[j - 1];
+    order[j] = &stats_table[i];
+  }
+
+  for ( i = 0; i < n; i++ )
+  {
+    c = order[i];
+    // A percentile is only known to within its bucket, so give the top of it
+    for ( p = 0; p < 3; p++ )
+    {
+      seen = 0;
+      for ( b = 0; b < STATS_BUCKETS - 1; b++ )
+      {
+        seen += c->buckets[b];
+        if ( seen >= percentiles[p] * c->count )
+          break;
+      }
+      bound[p] = ( double )( 2UL << b ) / 1e3;
+    }
+    printf( "%s: %lu runs, %.3f s total, mean %.3f ms, p50 < %.3f ms, p90 < %.3f ms, p99 < %.3f ms, max %.3f ms\n",
+            c->name, c->count, c->total, c->total / c->count * 1e3, bound[0], bound[1], bound[2], c->max * 1e3 );
+
+    for ( b = 0, widest = 1; b < STATS_BUCKETS; b++ )
+    {
+      if ( c->buckets[b] > widest )
+        widest = c->buckets[b];
+    }
+    for ( b = 0; b < STATS_BUCKETS; b++ )
+    {
+      if ( c->buckets[b] == 0 )
+        continue;
+      printf( "  %10.3f - %10.3f ms |", b == 0 ? 0 : ( double )( 1UL << b ) / 1e3, ( double )( 2UL << b ) / 1e3 );
+      for ( bar = 0; bar < ( int )( ( c->buckets[b] * 40 + widest - 1 ) / widest ); bar++ )
+        putchar( '#' );
+      printf( " %lu\n", c->buckets[b] );
+    }
+  }
+  if ( n == 0 )
+    printf( "stats: nothing run yet\n" );
+  free( order );
+  return 0;
+}
+
+/*
+ * Function: time_report
+ * Parameters: start - When the command started
+ * self - The shell's own usage then
+ * Returns: none
+ * Description: What time prints on stderr once the command
+ * is done: the wall clock, user and system time of the
+ * shell and every child the command waited for, the peak
+ * memory of the biggest child (or of the shell if the
+ * command ran in it), and context switches.
+ */
+
+void time_report( const struct timespec *start, const struct rusage *self )
+{
+  struct rusage now, total = foreground_usage;
+  double real = seconds_since( start );
+
+  fflush( stdout ); // The command's own output comes first
+  getrusage( RUSAGE_SELF, &now );
+  timersub( &now.ru_utime, &self->ru_utime, &now.ru_utime );
+  timersub( &now.ru_stime, &self->ru_stime, &now.ru_stime );
+  timeradd( &total.ru_utime, &now.ru_utime, &total.ru_utime );
+  timeradd( &total.ru_stime, &now.ru_stime, &total.ru_stime );
+  total.ru_nvcsw += now.ru_nvcsw - self->ru_nvcsw;
+  total.ru_nivcsw += now.ru_nivcsw - self->ru_nivcsw;
+  total.ru_minflt += now.ru_minflt - self->ru_minflt;
+  if ( foreground_children == 0 )
+    total.ru_maxrss = now.ru_maxrss;
+
+  fprintf( stderr, "\nreal\t%dm%.3fs\n", ( int )( real / 60 ), real - 60 * ( int )( real / 60 ) );
+  fprintf( stderr, "user\t%ldm%ld.%03lds\n", ( long )total.ru_utime.tv_sec / 60, ( long )total.ru_utime.tv_sec % 60,
+           ( long )total.ru_utime.tv_usec / 1000 );
+  fprintf( stderr, "sys\t%ldm%ld.%03lds\n", ( long )total.ru_stime.tv_sec / 60, ( long )total.ru_stime.tv_sec % 60,
+           ( long )total.ru_stime.tv_usec / 1000 );
+  fprintf( stderr, "maxrss\t%ld KB%s\n", total.ru_maxrss, foreground_children == 0 ? " (shell)" : "" );
+  fprintf( stderr, "faults\t%ld minor, %ld major\n", total.ru_minflt, total.ru_majflt );
+  fprintf( stderr, "ctxsw\t%ld voluntary, %ld involuntary\n", total.ru_nvcsw, total.ru_nivcsw );
+}
+
+/*
+ * Function: history_entry / history_skip
+ * Parameters: h - The history
+ * pos - A position in the ring
+ * Returns: The record at pos, or pos moved on to the next
+ * lap if it's in the unused end of one
+ */
+
+struct history_record *history_entry( struct history *h, uint64_t pos )
+{
+  return ( struct history_record * )( h->ring + pos % h->header->size );
+}
+
+uint64_t history_skip( struct history *h, uint64_t pos )
+{
+  uint64_t left = h->header->size - pos % h->header->size;
+
+  if ( pos < h->header->head &&
+       ( left < sizeof( struct history_record ) || history_entry( h, pos )->length == 0 ) )
+    pos += left;
+  return pos;
+}
+
+/*
+ * Function: history_grams
+ * Parameter: text - A command, or something to search for
+ * Returns: A bit for every pair of neighbouring letters in
+ * text, so a text can only contain another if it has all
+ * of its bits
+ */
+
+uint64_t history_grams( const char *text )
+{
+  uint64_t grams = 0;
+
+  for ( ; text[0] != '\0' && text[1] != '\0'; text++ )
+    grams |= 1ULL << ( ( ( (unsigned char)text[0] << 8 | (unsigned char)text[1] ) * 2654435761u ) >> 26 );
+  return grams;
+}
+
+/*
+ * Function: history_index
+ * Parameters: h - The history
+ * record - A record found in the ring
+ * pos - Where it is
+ * Returns: 0, or -1 if memory ran out
+ * Description: Adds a record to the index.  A command seen
+ * before only gets its new number; a new one is copied out
+ * of the ring, so nothing in the index points into it, and
+ * waits at the end of sorted for history_sort.
+ */
+
+int history_index( struct history *h, struct history_record *record, uint64_t pos )
+{
+  struct history_text *t;
+  unsigned int i, slot, size, *slots;
+  void *grown;
+
+  if ( h->count == h->max )
+  {
+    grown = realloc( h->where, ( h->max ? h->max * 2 : 1024 ) * sizeof( uint64_t ) );
+    if ( grown == NULL )
+      return -1;
+    h->where = grown;
+    h->max = h->max ? h->max * 2 : 1024;
+  }
+
+  // Rehash into a table twice the size once it's half full
+  if ( h->num_texts * 2 >= h->num_slots )
+  {
+    size = h->num_slots ? h->num_slots * 2 : 1024;
+    slots = calloc( size, sizeof( unsigned int ) );
+    if ( slots == NULL )
+      return -1;
+    for ( i = 0; i < h->num_texts; i++ )
+    {
+      for ( slot = hash_name( h->texts[i].text ) & ( size - 1 ); slots[slot] != 0; slot = ( slot + 1 ) & ( size - 1 ) )
+        ;
+      slots[slot] = i + 1;
+    }
+    free( h->slots );
+    h->slots = slots;
+    h->num_slots = size;
+  }
+
+  for ( slot = hash_name( record->text ) & ( h->num_slots - 1 ); h->slots[slot] != 0;
+        slot = ( slot + 1 ) & ( h->num_slots - 1 ) )
+  {
+    if ( strcmp( h->texts[h->slots[slot] - 1].text, record->text ) == 0 )
+      break;
+  }
+  if ( h->slots[slot] != 0 )
+    t = &h->texts[h->slots[slot] - 1];
+  else
+  {
+    if ( h->num_texts == h->max_texts )
+    {
+      grown = realloc( h->texts, ( h->max_texts ? h->max_texts * 2 : 1024 ) * sizeof( struct history_text ) );
+      if ( grown == NULL )
+        return -1;
+      h->texts = grown;
+      grown = realloc( h->sorted, ( h->max_texts ? h->max_texts * 2 : 1024 ) * sizeof( unsigned int ) );
+      if ( grown == NULL )
+        return -1;
+      h->sorted = grown;
+      h->max_texts = h->max_texts ? h->max_texts * 2 : 1024;
+    }
+    t = &h->texts[h->num_texts];
+    t->text = arena_alloc( &h->strings, record->length + 1 );
+    if ( t->text == NULL )
+      return -1;
+    memcpy( t->text, record->text, record->length + 1 );
+    t->grams = history_grams( t->text );
+    h->slots[slot] = ++h->num_texts;
+  }
+
+  if ( h->count == 0 )
+    h->first = record->number;
+  h->where[h->count++] = pos;
+  t->number = record->number;
+  return 0;
+}
 
 /*
- * Function: readline
+ * Function: history_compare / history_sort
+ * Parameters: a, b - Indexes into texts
+ * h - The history
+ * Returns: history_compare returns their order by text
+ * Description: Puts the texts added since the last sort
+ * in order by themselves and merges them into the rest,
+ * so a lookup after a command or two costs a pass over
+ * sorted and not a whole sort.
+ */
+
+int history_compare( const void *a, const void *b, void *h )
+{
+  struct history *history = h;
+
+  return strcmp( history->texts[*( const unsigned int * )a].text,
+                 history->texts[*( const unsigned int * )b].text );
+}
+
+void history_sort( struct history *h )
+{
+  unsigned int *merged;
+  unsigned int i, j, k;
+
+  if ( h->num_sorted == h->num_texts )
+    return;
+  for ( i = h->num_sorted; i < h->num_texts; i++ )
+    h->sorted[i] = i;
+  merged = malloc( h->max_texts * sizeof( unsigned int ) );
+  if ( merged == NULL )
+  {
+    qsort_r( h->sorted, h->num_texts, sizeof( unsigned int ), history_compare, h );
+    h->num_sorted = h->num_texts;
+    return;
+  }
+  qsort_r( h->sorted + h->num_sorted, h->num_texts - h->num_sorted, sizeof( unsigned int ), history_compare, h );
+
+  for ( i = 0, j = h->num_sorted, k = 0; k < h->num_texts; k++ )
+  {
+    if ( j == h->num_texts || ( i < h->num_sorted && history_compare( &h->sorted[i], &h->sorted[j], h ) <= 0 ) )
+      merged[k] = h->sorted[i++];
+    else
+      merged[k] = h->sorted[j++];
+  }
+  free( h->sorted );
+  h->sorted = merged;
+  h->num_sorted = h->num_texts;
+}
+
+/*
+ * Function: history_sync
+ * Parameter: h - The history, locked
+ * Returns: none
+ * Description: Indexes whatever other shells added since
+ * the last time.  If the ring went all the way round since
+ * then the index is thrown away and built again.  Records
+ * that fell off the tail stay in the index, but with
+ * numbers below the first one they don't count.
+ */
+
+void history_sync( struct history *h )
+{
+  struct history_header *header = h->header;
+  uint64_t pos, gone;
+
+  if ( header->tail > h->seen )
+  {
+    h->count = 0;
+    h->num_texts = h->num_sorted = 0;
+    if ( h->slots != NULL )
+      memset( h->slots, 0, h->num_slots * sizeof( unsigned int ) );
+    arena_reset( &h->strings );
+    h->seen = header->tail;
+  }
+
+  for ( pos = h->seen; pos < header->head; )
+  {
+    pos = history_skip( h, pos );
+    if ( history_index( h, history_entry( h, pos ), pos ) == -1 )
+      break;
+    pos += HISTORY_ALIGN( sizeof( struct history_record ) + history_entry( h, pos )->length + 1 );
+  }
+  h->seen = pos;
+
+  // Forget the positions of records that are gone once they're most of them
+  gone = header->first > h->first ? header->first - h->first : 0;
+  if ( h->count > 0 && gone > h->count / 2 )
+  {
+    if ( gone > h->count )
+      gone = h->count;
+    memmove( h->where, h->where + gone, ( h->count - gone ) * sizeof( uint64_t ) );
+    h->count -= gone;
+    h->first += gone;
+  }
+}
+
+/*
+ * Function: history_lock / history_unlock
+ * Parameters: h - The history
+ * how - LOCK_SH to read, LOCK_EX to change it
+ * Returns: history_lock returns 0, or -1 if there's no
+ * history
+ */
+
+int history_lock( struct history *h, int how )
+{
+  if ( h->header == NULL )
+    return -1;
+  while ( flock( h->fd, how ) == -1 )
+  {
+    if ( errno != EINTR )
+      return -1;
+  }
+  history_sync( h );
+  return 0;
+}
+
+void history_unlock( struct history *h )
+{
+  flock( h->fd, LOCK_UN );
+}
+
+/*
+ * Function: history_open / history_close
+ * Parameters: h - The history
+ * path - The file, made if it isn't there
+ * size - Bytes of ring for a new file
+ * Returns: history_open returns 0, or -1 if there's no
+ * history
+ * Description: Maps the file and indexes what's in it.  A
+ * file that isn't a history file is left alone.
+ */
+
+int history_open( struct history *h, const char *path, uint64_t size )
+{
+  struct history_header *header;
+  struct stat st;
+  int fresh = 0;
+  int fd = open( path, O_RDWR | O_CREAT | O_CLOEXEC, 0600 );
+
+  if ( fd == -1 )
+  {
+    printf( "msh: %s: %s\n", path, strerror( errno ) );
+    return -1;
+  }
+  flock( fd, LOCK_EX );
+  size = ( size + 4095 ) & ~( uint64_t )4095;
+  if ( fstat( fd, &st ) == 0 && st.st_size == 0 && ftruncate( fd, sizeof( *header ) + size ) == 0 )
+  {
+    st.st_size = sizeof( *header ) + size;
+    fresh = 1;
+  }
+  header = (uint64_t)st.st_size >= sizeof( *header ) ?
+           mmap( NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 ) : MAP_FAILED;
+  if ( header != MAP_FAILED && fresh )
+  {
+    memcpy( header->magic, HISTORY_MAGIC, 8 );
+    header->size = st.st_size - sizeof( *header );
+    header->first = header->number = 1;
+  }
+  if ( header == MAP_FAILED || memcmp( header->magic, HISTORY_MAGIC, 8 ) != 0 ||
+       header->size + sizeof( *header ) != (uint64_t)st.st_size || header->size % 8 != 0 ||
+       header->tail > header->head )
+  {
+    printf( "msh: %s: not a history file\n", path );
+    if ( header != MAP_FAILED )
+      munmap( header, st.st_size );
+    close( fd );
+    return -1;
+  }
+  flock( fd, LOCK_UN );
+
+  h->fd = fd;
+  h->header = header;
+  h->ring = ( char * )( header + 1 );
+  h->seen = 0;
+  history_lock( h, LOCK_SH );
+  history_unlock( h );
+  return 0;
+}
+
+void history_close( struct history *h )
+{
+  if ( h->header != NULL )
+  {
+    munmap( h->header, sizeof( struct history_header ) + h->header->size );
+    close( h->fd );
+  }
+  free( h->where );
+  free( h->texts );
+  free( h->slots );
+  free( h->sorted );
+  arena_reset( &h->strings );
+  free( h->strings.block );
+  memset( h, 0, sizeof( struct history ) );
+  h->fd = -1;
+}
+
+/*
+ * Function: history_default
  * Parameter: none
- * Returns: An unprocessed char string.
- * Description: Gets the user input from a stdin line
- * and returns it for processing.
+ * Returns: The shell's history, opened the first time, or
+ * NULL if there isn't one
+ * Description: The file is $MSH_HISTORY, or .msh_history in
+ * $HOME, and a new one gets a ring of $MSH_HISTORY_MB
+ * megabytes, 16 if that isn't set.  An empty MSH_HISTORY
+ * turns history off.
  */
 
-char *readline( void )
+struct history *history_default( void )
 {
-  char *input = NULL;
-  ssize_t buffer = 0;
-  getline(&input, &buffer, stdin); // Getline handles the buffer for us
-  return input;
+  static int tried = 0;
+  char *path = getenv( "MSH_HISTORY" );
+  char *megabytes = getenv( "MSH_HISTORY_MB" );
+  char buffer[PATH_MAX];
+
+  if ( !tried )
+  {
+    tried = 1;
+    if ( path == NULL && getenv( "HOME" ) != NULL )
+    {
+      snprintf( buffer, sizeof( buffer ), "%s/.msh_history", getenv( "HOME" ) );
+      path = buffer;
+    }
+    if ( path != NULL && *path != '\0' )
+      history_open( &shell_history, path, megabytes != NULL && atoi( megabytes ) > 0 ?
+                    ( uint64_t )atoi( megabytes ) << 20 : HISTORY_SIZE );
+  }
+  return shell_history.header != NULL ? &shell_history : NULL;
 }
 
 /*
- * Function: parse_command
- * Parameter: input - A pointer to a char string
- * that is the unprocessed user input string.
- * Returns: A parsed array of char strings
- * Description: Tokenizes the user input and splits
- * it so that execvp can recognize distinct flags
+ * Function: history_add
+ * Parameters: h - The history
+ * line - A command line as it's about to run
+ * Returns: none
+ * Description: Appends the line for every shell to see,
+ * unless it's blank, the same as the last one or too long
+ * for the ring.  What the record is about to overwrite is
+ * dropped off the tail first, the record is written, and
+ * only then does head move past it, so a shell that dies
+ * halfway through leaves the file as it was.
  */
 
-char **parse_command( char *input )
+void history_add( struct history *h, const char *line )
 {
-  int i = 0;
-  char **args = malloc( 255 );
-  char *arg;
+  struct history_header *header = h->header;
+  struct history_record *record;
+  uint64_t length = strlen( line );
+  uint64_t need = HISTORY_ALIGN( sizeof( struct history_record ) + length + 1 );
+  uint64_t start, left;
 
-  arg = strtok( input, " \r\t\n" );
-  while ( arg != NULL ) // Tokenize the arguments one by one
+  if ( line[strspn( line, " \t\r" )] == '\0' || header == NULL || need > header->size / 4 )
+    return;
+  if ( history_lock( h, LOCK_EX ) == -1 )
+    return;
+  if ( h->count > 0 && h->first + h->count == header->number &&
+       strcmp( history_entry( h, h->where[h->count - 1] )->text, line ) == 0 )
   {
-    args[i] = arg;
-    i++;
-    arg = strtok( NULL, " \r\t\n" );
+    history_unlock( h );
+    return;
+  }
+
+  start = header->head;
+  left = header->size - start % header->size;
+  if ( left < need )
+    start += left;
+  while ( header->tail < header->head && header->tail + header->size < start + need )
+  {
+    header->tail = history_skip( h, header->tail );
+    header->tail += HISTORY_ALIGN( sizeof( struct history_record ) + history_entry( h, header->tail )->length + 1 );
+    header->first++;
+  }
+  if ( left < need && left >= sizeof( struct history_record ) )
+    history_entry( h, header->head )->length = 0;
+
+  record = history_entry( h, start );
+  record->length = length;
+  record->time = time( NULL );
+  record->number = header->number;
+  memcpy( record->text, line, length + 1 );
+  header->number++;
+  header->head = start + need;
+  history_sync( h );
+  history_unlock( h );
+}
+
+/*
+ * Function: history_keep / history_starting /
+ * history_containing
+ * Parameters: h - The history, locked
+ * text - What to look for, or for history_keep a text found
+ * found - Where to put the indexes of the texts found
+ * max - How many to find
+ * Returns: How many were found, most recent first
+ * Description: The commands starting with text are in a
+ * row in sorted, found with a binary search.  For the ones
+ * containing it every text is looked at, but only the few
+ * with all of its bigrams get as far as strstr.
+ * history_keep puts a find in its place in found.
+ */
+
+void history_keep( struct history *h, unsigned int text, unsigned int *found, unsigned int *n, unsigned int max )
+{
+  unsigned int j = *n < max ? ( *n )++ : max;
+
+  // Keep the most recent max, newest first
+  while ( j > 0 && h->texts[found[j - 1]].number < h->texts[text].number )
+  {
+    if ( j < max )
+      found[j] = found[j - 1];
+    j--;
+  }
+  if ( j < max )
+    found[j] = text;
+}
+
+unsigned int history_starting( struct history *h, const char *text, unsigned int *found, unsigned int max )
+{
+  struct history_text *t;
+  size_t length = strlen( text );
+  unsigned int low = 0, high, middle, i, n = 0;
+
+  history_sort( h );
+  for ( high = h->num_sorted; low < high; )
+  {
+    middle = low + ( high - low ) / 2;
+    if ( strcmp( h->texts[h->sorted[middle]].text, text ) < 0 )
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  for ( i = low; i < h->num_sorted; i++ )
+  {
+    t = &h->texts[h->sorted[i]];
+    if ( strncmp( t->text, text, length ) != 0 )
+      break;
+    if ( t->number >= h->header->first )
+      history_keep( h, h->sorted[i], found, &n, max );
+  }
+  return n;
+}
+
+unsigned int history_containing( struct history *h, const char *text, unsigned int *found, unsigned int max )
+{
+  struct history_text *t;
+  uint64_t grams = history_grams( text );
+  unsigned int i, n = 0;
+
+  for ( i = 0; i < h->num_texts; i++ )
+  {
+    t = &h->texts[i];
+    if ( ( t->grams & grams ) == grams && t->number >= h->header->first && strstr( t->text, text ) != NULL )
+      history_keep( h, i, found, &n, max );
+  }
+  return n;
+}
+
+/*
+ * Function: history_expand
+ * Parameters: h - The history
+ * line - A line just read
+ * Returns: The line with its history event replaced, the
+ * line as it was if it has none, or NULL if the event
+ * isn't there
+ * Description: A line starting with ! runs an earlier
+ * command again, with the rest of the line added on: !!
+ * the last one, !n number n, !-n the nth last, !?text the
+ * last one containing text and !text the last one starting
+ * with it.  The new line goes in the line arena and is
+ * shown before it runs, as bash does.
+ */
+
+char *history_expand( struct history *h, char *line )
+{
+  char *event = line + strspn( line, " \t" );
+  char *rest, *end, *found = NULL, *expanded = NULL;
+  uint64_t number = 0;
+  unsigned int text;
+  long long n;
+  int question;
+  char save;
+
+  if ( event[0] != '!' || strchr( " \t=(", event[1] ) != NULL )
+    return line;
+  rest = event + strcspn( event, " \t" );
+  save = *rest;
+  *rest = '\0';
+
+  if ( history_lock( h, LOCK_SH ) == 0 )
+  {
+    n = strtoll( event + 1, &end, 10 );
+    if ( strcmp( event, "!!" ) == 0 )
+      number = h->header->number - 1;
+    else if ( *end == '\0' && end != event + 1 && isdigit( (unsigned char)end[-1] ) )
+      number = n < 0 ? h->header->number + n : ( uint64_t )n;
+    else if ( event[1] == '?' )
+    {
+      question = rest - event > 2 && rest[-1] == '?'; // !?text? as well
+      if ( question )
+        rest[-1] = '\0';
+      if ( history_containing( h, event + 2, &text, 1 ) == 1 )
+        found = h->texts[text].text;
+      if ( question )
+        rest[-1] = '?';
+    }
+    else if ( history_starting( h, event + 1, &text, 1 ) == 1 )
+      found = h->texts[text].text;
+    if ( number >= h->header->first && number < h->header->number && number - h->first < h->count )
+      found = history_entry( h, h->where[number - h->first] )->text;
+
+    *rest = save;
+    if ( found != NULL )
+      expanded = arena_alloc( &line_arena, strlen( found ) + strlen( rest ) + 1 );
+    if ( expanded != NULL )
+      strcat( strcpy( expanded, found ), rest );
+    history_unlock( h );
+  }
+  else
+    *rest = save;
+
+  if ( expanded == NULL )
+  {
+    printf( "msh: %.*s: event not found\n", ( int )strcspn( event, " \t" ), event );
+    return NULL;
+  }
+  printf( "%s\n", expanded );
+  return expanded;
+}
+
+/*
+ * Function: history_builtin
+ * Parameter: args - history [-t] [n], history -s text [n],
+ * history -p prefix [n] or history -c
+ * Returns: The exit status
+ * Description: Lists the history every shell shares, the
+ * last n if given and with when each ran for -t.  -s is
+ * reverse search, the n (default 10) most recent distinct
+ * commands containing text, and -p the same for ones
+ * starting with prefix.  -c clears it for every shell.
+ */
+
+int history_builtin( char **args )
+{
+  struct history *h = history_default();
+  struct history_record *record;
+  unsigned int *found;
+  unsigned int i, n, max;
+  uint64_t number, count = UINT64_MAX;
+  long limit = 10;
+  char *end;
+  char when[32];
+  time_t t;
+  int times = 0;
+
+  if ( h == NULL )
+  {
+    printf( "history: no history file\n" );
+    return 1;
+  }
+
+  if ( args[1] != NULL && strcmp( args[1], "-c" ) == 0 )
+  {
+    if ( history_lock( h, LOCK_EX ) == -1 )
+      return 1;
+    h->header->tail = h->header->head;
+    h->header->first = h->header->number;
+    history_unlock( h );
+    return 0;
+  }
+
+  if ( args[1] != NULL && ( strcmp( args[1], "-s" ) == 0 || strcmp( args[1], "-p" ) == 0 ) )
+  {
+    if ( args[2] == NULL )
+    {
+      printf( "history: %s: needs something to look for\n", args[1] );
+      return 2;
+    }
+    if ( args[3] != NULL )
+    {
+      limit = strtol( args[3], &end, 10 );
+      if ( limit <= 0 || *end != '\0' )
+      {
+        printf( "history: %s: invalid count\n", args[3] );
+        return 2;
+      }
+    }
+    if ( history_lock( h, LOCK_SH ) == -1 )
+      return 1;
+
+    // There can't be more finds than distinct commands
+    max = (size_t)limit < h->num_texts ? (unsigned int)limit : h->num_texts;
+    found = malloc( ( (size_t)max + 1 ) * sizeof( unsigned int ) );
+    if ( found == NULL )
+    {
+      history_unlock( h );
+      return 1;
+    }
+    if ( args[1][1] == 's' )
+      n = history_containing( h, args[2], found, max );
+    else
+      n = history_starting( h, args[2], found, max );
+    for ( i = 0; i < n; i++ )
+      printf( "%5" PRIu64 "  %s\n", h->texts[found[i]].number, h->texts[found[i]].text );
+    history_unlock( h );
+    free( found );
+    return n == 0;
+  }
+
+  if ( args[1] != NULL && strcmp( args[1], "-t" ) == 0 )
+  {
+    times = 1;
+    args++;
+  }
+  if ( args[1] != NULL )
+    count = strtoull( args[1], NULL, 10 );
+
+  if ( history_lock( h, LOCK_SH ) == -1 )
+    return 1;
+  number = h->header->first;
+  if ( count < h->header->number - number )
+    number = h->header->number - count;
+  for ( ; number < h->header->number && number - h->first < h->count; number++ )
+  {
+    record = history_entry( h, h->where[number - h->first] );
+    t = record->time;
+    when[0] = '\0';
+    if ( times )
+      strftime( when, sizeof( when ), "%F %T  ", localtime( &t ) );
+    printf( "%5" PRIu64 "  %s%s\n", record->number, when, record->text );
+  }
+  history_unlock( h );
+  return 0;
+}
+
+/*
+ * Function: history_bench
+ * Parameter: args - historybench [entries]
+ * Returns: The exit status
+ * Description: Fills historybench.tmp in the current
+ * directory with the given number of commands (default a
+ * million), about one in ten of them different, and times
+ * appending them, opening and indexing the file again, and
+ * looking commands up by prefix and by substring.
+ */
+
+int history_bench( char **args )
+{
+  const char *templates[] = { "make -j8 target%u", "gcc -O2 -Wall -o prog%u prog.c", "ssh host%u.example.com",
+                              "git checkout feature/%u", "grep -rn pattern%u src", "cd /srv/app/release-%u",
+                              "./run_tests --shard %u", "kubectl logs pod-%u" };
+  struct history bench = { .fd = -1 };
+  struct timespec start;
+  unsigned int found[10];
+  unsigned int seed = 1, value, hits = 0;
+  char line[64];
+  double seconds, worst;
+  long count = 1000000;
+  long i, lookups;
+
+  if ( args[1] != NULL )
+    count = atol( args[1] );
+  if ( count < 1 )
+  {
+    printf( "historybench: usage: historybench [entries]\n" );
+    return 2;
+  }
+
+  unlink( "historybench.tmp" );
+  if ( history_open( &bench, "historybench.tmp", count * 80 ) == -1 )
+    return 1;
+  clock_gettime( CLOCK_MONOTONIC, &start );
+  for ( i = 0; i < count; i++ )
+  {
+    seed = seed * 1103515245 + 12345;
+    value = ( seed >> 8 ) % ( count / 80 + 1 );
+    snprintf( line, sizeof( line ), templates[seed % 8], value );
+    history_add( &bench, line );
+  }
+  seconds = seconds_since( &start );
+  printf( "append    %8ld commands in %.3f s, %9.0f commands/s\n", count, seconds, count / seconds );
+
+  history_close( &bench );
+  clock_gettime( CLOCK_MONOTONIC, &start );
+  if ( history_open( &bench, "historybench.tmp", 0 ) == -1 )
+    return 1;
+  history_sort( &bench );
+  printf( "index     %8" PRIu64 " records, %u distinct, in %.3f s\n",
+          bench.header->number - bench.header->first, bench.num_texts, seconds_since( &start ) );
+
+  // Each lookup takes the lock and catches up, as !text does
+  lookups = 10000;
+  clock_gettime( CLOCK_MONOTONIC, &start );
+  for ( i = 0; i < lookups; i++ )
+  {
+    seed = seed * 1103515245 + 12345;
+    snprintf( line, sizeof( line ), "git checkout feature/%u", ( unsigned int )( ( seed >> 8 ) % ( count / 80 + 1 ) ) );
+    history_lock( &bench, LOCK_SH );
+    hits += history_starting( &bench, line, found, 1 );
+    history_unlock( &bench );
+  }
+  seconds = seconds_since( &start );
+  clock_gettime( CLOCK_MONOTONIC, &start );
+  history_lock( &bench, LOCK_SH );
+  history_starting( &bench, "g", found, 10 );
+  history_unlock( &bench );
+  worst = seconds_since( &start );
+  printf( "prefix    %8ld lookups, %ld found, %.2f us each, %.2f us for the 10 latest of \"g\"\n",
+          lookups, ( long )hits, seconds / lookups * 1e6, worst * 1e6 );
+
+  hits = 0;
+  clock_gettime( CLOCK_MONOTONIC, &start );
+  for ( i = 0; i < lookups; i++ )
+  {
+    seed = seed * 1103515245 + 12345;
+    snprintf( line, sizeof( line ), "pattern%u ", ( unsigned int )( ( seed >> 8 ) % ( count / 80 + 1 ) ) );
+    history_lock( &bench, LOCK_SH );
+    hits += history_containing( &bench, line, found, 1 );
+    history_unlock( &bench );
+  }
+  seconds = seconds_since( &start );
+  clock_gettime( CLOCK_MONOTONIC, &start );
+  history_lock( &bench, LOCK_SH );
+  history_containing( &bench, "not there", found, 1 );
+  history_unlock( &bench );
+  worst = seconds_since( &start );
+  printf( "substring %8ld lookups, %ld found, %.2f us each, %.2f us for one that isn't there\n",
+          lookups, ( long )hits, seconds / lookups * 1e6, worst * 1e6 );
+
+  history_close( &bench );
+  unlink( "historybench.tmp" );
+  return 0;
+}
+
+/*
+ * Function: builtin_cd / builtin_exit / builtin_splice /
+ * builtin_builtins
+ * Parameter: args - The command and its arguments
+ * Returns: The exit status
+ * Description: The builtins small enough not to need a
+ * function of their own elsewhere.  exit takes an optional
+ * status, and splice and builtins turn the in-shell cat and
+ * tee, and the in-shell echo, test and the rest, on or off.
+ */
+
+int builtin_cd( char **args )
+{
+  if ( chdir( args[1] ) == 0 )
+    return 0;
+  if ( args[1] != NULL )
+    printf( "cd: %s: %s\n", args[1], strerror( errno ) );
+  return 1;
+}
+
+int builtin_exit( char **args )
+{
+  shell_quit = 1;
+  return args[1] != NULL ? atoi( args[1] ) & 255 : last_status;
+}
+
+int builtin_splice( char **args )
+{
+  if ( args[1] != NULL )
+    splice_builtins = strcmp( args[1], "off" ) != 0;
+  printf( "splice: %s\n", splice_builtins ? "on" : "off" );
+  return 0;
+}
+
+int builtin_builtins( char **args )
+{
+  if ( args[1] != NULL )
+    program_builtins = strcmp( args[1], "off" ) != 0;
+  printf( "builtins: %s\n", program_builtins ? "on" : "off" );
+  return 0;
+}
+
+// Everything the shell runs itself.  The ones marked program stand in for a
+// program on PATH, so they can be turned off, and are also used when the
+// command has redirections.  builtin_table is a perfect hash of these by
+// name, built by builtin_init.
+struct builtin
+{
+  const char *name;
+  int (*run)( char **args );
+  int program;
+};
+
+struct builtin builtins[] =
+{
+  { "cd", builtin_cd, 0 },
+  { "exit", builtin_exit, 0 },
+  { "quit", builtin_exit, 0 },
+  { "jobs", jobs_builtin, 0 },
+  { "fg", jobs_builtin, 0 },
+  { "bg", jobs_builtin, 0 },
+  { "wait", jobs_builtin, 0 },
+  { "hash", hash_builtin, 0 },
+  { "par", par, 0 },
+  { "splice", builtin_splice, 0 },
+  { "builtins", builtin_builtins, 0 },
+  { "stats", stats_builtin, 0 },
+  { "history", history_builtin, 0 },
+  { "pipebench", pipe_bench, 0 },
+  { "spawnbench", spawn_bench, 0 },
+  { "scriptbench", script_bench, 0 },
+  { "builtinbench", builtin_bench, 0 },
+  { "historybench", history_bench, 0 },
+  { "echo", builtin_echo, 1 },
+  { "printf", builtin_printf, 1 },
+  { "test", builtin_test, 1 },
+  { "[", builtin_test, 1 },
+  { "pwd", builtin_pwd, 1 },
+  { "true", builtin_true, 1 },
+  { "false", builtin_true, 1 },
+};
+
+#define BUILTIN_SLOTS 64
+
+struct builtin *builtin_table[BUILTIN_SLOTS];
+unsigned int builtin_seed = 0;
+
+/*
+ * Function: builtin_hash
+ * Parameters: name - A command name
+ * seed - Mixed into the starting value
+ * Returns: The name's slot in builtin_table
+ */
+
+unsigned int builtin_hash( const char *name, unsigned int seed )
+{
+  unsigned int hash = 2166136261u ^ seed;
+
+  while ( *name != '\0' )
+  {
+    hash ^= (unsigned char)*name++;
+    hash *= 16777619u;
+  }
+  return ( hash ^ ( hash >> 16 ) ) & ( BUILTIN_SLOTS - 1 );
+}
+
+/*
+ * Function: builtin_init
+ * Parameter: none
+ * Returns: none
+ * Description: Tries seeds until every builtin lands in a
+ * slot of its own, so a lookup is one hash and one strcmp
+ * with no probing.  With this many names in 64 slots a
+ * seed turns up within a few dozen tries, and adding a
+ * builtin needs nothing more than a line in the list.
+ */
+
+void builtin_init( void )
+{
+  unsigned int i, slot;
+  unsigned int count = sizeof( builtins ) / sizeof( builtins[0] );
+
+  for ( builtin_seed = 0; ; builtin_seed++ )
+  {
+    memset( builtin_table, 0, sizeof( builtin_table ) );
+    for ( i = 0; i < count; i++ )
+    {
+      slot = builtin_hash( builtins[i].name, builtin_seed );
+      if ( builtin_table[slot] != NULL )
+        break;
+      builtin_table[slot] = &builtins[i];
+    }
+    if ( i == count )
+      return;
   }
-  args[i] = NULL; // Terminate our array in NULL so execvp knows when to stop
-  return args;
+}
+
+/*
+ * Function: builtin_find
+ * Parameter: name - A command name
+ * Returns: The builtin, or NULL if it's not one or it's a
+ * program stand-in while those are off
+ */
+
+struct builtin *builtin_find( const char *name )
+{
+  struct builtin *builtin = builtin_table[builtin_hash( name, builtin_seed )];
+
+  if ( builtin == NULL || strcmp( builtin->name, name ) != 0 )
+    return NULL;
+  if ( builtin->program && !program_builtins )
+    return NULL;
+  return builtin;
 }
 
 /*
  * Function: exec_command
- * Parameter: args - An array of arguments to pass
- * to execvp.
- * Returns: An integer value indicating whether
- * to continue processing commands or to quit the shell.
- * Description: Calls execvp and executes commands
- * in a child process as input by the user.
- * Special cases for changing directory and quitting
- * the shell.
+ * Parameter: args - A parsed array of char strings
+ * Returns: 1 if the shell should quit, otherwise 0
+ * Description: Runs a line: each command ended by & as a
+ * background job, then whatever is left in the foreground.
+ * A lone builtin runs in the shell; anything with a pipe,
+ * a redirection or no builtin becomes a pipeline.  A
+ * builtin that returns -1 wants the real program run.
+ * time in front of the foreground command reports what it
+ * cost, like in bash.  Builtins go into the stats here;
+ * children go in as they're reaped.
  */
 
 int exec_command( char **args )
 {
-  pid_t pid;
-  int quit = 0;
+  struct builtin *builtin;
+  struct timespec start;
+  struct rusage self;
+  int background = 0;
+  int timed;
   int status;
+  int i;
 
   // Catch an empty input line first
   if ( args[0] == NULL )
-    return quit;
+    return shell_quit;
 
-  // Special case for changing directory without forking a child process
-  else if ( strcmp( args[0], "cd" ) == 0 )
+  // Every command ended by & starts as a background job, and whatever is
+  // left after the last one runs as usual
+  for ( i = 0; args[i] != NULL; i++ )
   {
-    chdir( args[1] );
+    if ( strcmp( args[i], "&" ) != 0 )
+      continue;
+    if ( i == 0 )
+    {
+      printf( "msh: syntax error near &\n" );
+      last_status = 2;
+      return shell_quit;
+    }
+    args[i] = NULL;
+    if ( args[i + 1] == NULL )
+    {
+      background = 1;
+      break;
+    }
+    run_pipeline( args, 1, NULL );
+    args = args + i + 1;
+    i = -1;
   }
 
-  // Special case for quitting the shell
-  else if ( strcmp( args[0], "quit") == 0 || strcmp ( args [0], "exit" ) == 0 )
+  timed = !background && strcmp( args[0], "time" ) == 0;
+  if ( timed )
   {
-    quit = 1;
+    args++;
+    memset( &foreground_usage, 0, sizeof( foreground_usage ) );
+    foreground_children = 0;
+    getrusage( RUSAGE_SELF, &self );
   }
-  else
+  clock_gettime( CLOCK_MONOTONIC, &start );
+  if ( args[0] == NULL )
+  {
+    if ( timed )
+      time_report( &start, &self );
+    return shell_quit;
+  }
+
+  // Pipelines, redirections and background jobs, which the builtins don't
+  // take part in, apart from a lone builtin with redirections
+  for ( i = 0; args[i] != NULL && strchr( "|<>&", args[i][0] ) == NULL; i++ )
+    ;
+  builtin = builtin_find( args[0] );
+  status = -1;
+  if ( args[i] == NULL && !background && builtin != NULL )
   {
-    // fork a child process to execute commands while the shell is still running
-    pid = fork();
-    if ( pid == 0 )
+    status = builtin->run( args );
+    if ( status != -1 )
     {
-      // While in the child process, execute the parsed command
-      if ( execvp( args[0], args ) == -1 )
-      {
-        // Catch command not found errors and print to screen
-        printf( "%s: command not found\n", args[0]);
-      }
-      // If we're still here after execution, exit the child process
-      exit( EXIT_FAILURE );
+      last_status = status;
+      stats_record( args[0], seconds_since( &start ) );
     }
-    else // Wait here for the child process to exit
-     pid = wait( pid, &status );
+    builtin = NULL;
   }
+
+  // Start the command while the shell is still running, and wait for it
+  if ( status == -1 )
+    run_pipeline( args, background, builtin != NULL && builtin->program ? builtin->run : NULL );
+
+  if ( timed )
+    time_report( &start, &self );
+
   // After running, return an int to determine whether to quit the shell
-  return quit;
+  return shell_quit;
 }
 
-int main( void )
+int main( int argc, char **argv )
 {
   int quit = 0;
+  int interactive = argc < 2;
+  struct reader script = { -1, NULL, 0, 0, 0, 0 };
+  struct reader *input = &stdin_reader;
   char *cmd;
-  char **a
+  char **args;
+  sigset_t child;
+
+  // msh -c "command", msh script, or commands from stdin
+  if ( argc > 1 && strcmp( argv[1], "-c" ) == 0 )
+  {
+    if ( argc < 3 )
+    {
+      fprintf( stderr, "msh: -c: option requires an argument\n" );
+      return 2;
+    }
+    script.buffer = argv[2];
+    script.size = strlen( argv[2] ) + 1;
+    script.end = script.size - 1;
+    script.eof = 1;
+    input = &script;
+  }
+  else if ( argc > 1 )
+  {
+    script.fd = open( argv[1], O_RDONLY | O_CLOEXEC );
+    if ( script.fd == -1 )
+    {
+      fprintf( stderr, "msh: %s: %s\n", argv[1], strerror( errno ) );
+      return 127;
+    }
+    input = &script;
+  }
+
   signal(SIGINT, SIG_IGN ); // Catch ctrl+c and ignore
   signal(SIGTSTP, SIG_IGN ); // Catch ctrl+z and ignore
+  signal(SIGPIPE, SIG_IGN ); // Pipeline stages run in the shell see EPIPE instead
+  signal(SIGTTOU, SIG_IGN ); // So we can take the terminal back from fg jobs
+
+  // Children are reaped from the event loop rather than a handler
+  sigemptyset( &child );
+  sigaddset( &child, SIGCHLD );
+  sigprocmask( SIG_BLOCK, &child, NULL );
+  child_events = signalfd( -1, &child, SFD_NONBLOCK | SFD_CLOEXEC );
+  if ( child_events == -1 )
+  {
+    perror( "signalfd" );
+    return 1;
+  }
+  builtin_init();
+  if ( interactive )
+    history_default();
 
   while( quit == 0 ) // Main program loop
   {
-    printf( "msh> "); // Print prompt
-    cmd = readline(); // Get user input
-    args = parse_command( cmd ); // Parse input
-    quit = exec_command( args ); // Execute commands
+    job_notify(); // Report background jobs that finished
+    if ( interactive )
+    {
+      printf( "msh> "); // Print prompt
+      fflush( stdout );
+    }
+    wait_for_input( input ); // Reap children until there's something to read
+    cmd = readline( input ); // Get user input
+    if ( cmd == NULL ) // End of input quits like exit
+      break;
+    if ( interactive && shell_history.header != NULL )
+    {
+      cmd = history_expand( &shell_history, cmd ); // !! and the like
+      if ( cmd == NULL )
+        continue;
+      history_add( &shell_history, cmd ); // Saved for every shell before it runs
+    }
+    args = parse_command( cmd, &line_arena ); // Parse input
+    if ( args != NULL )
+      quit = exec_command( args ); // Execute commands
+    arena_reset( &line_arena ); // Everything for this line is done with
+    fflush( stdout );
   }
 
-  return 0 ;
+  return last_status;
 }
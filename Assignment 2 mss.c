@@ -16,6 +16,170 @@
 #include<sys/types.h>
 #include<sys/mman.h>
 #include<sys/stat.h>
+#include<string.h>
+#include<sys/ioctl.h>
+#include<sys/syscall.h>
+#include<linux/perf_event.h>
+
+// Hardware performance counters collected around each worker's scan loop when the
+// service is started with --perf
+#define NUM_COUNTERS 5
+#define PERF_CYCLES 0
+#define PERF_INSTRUCTIONS 1
+#define PERF_LLC_MISSES 2
+#define PERF_BRANCH_MISSES 3
+#define PERF_PAGE_FAULTS 4
+
+int perf_mode = 0;
+
+struct perf_counters
+{
+	int fd[NUM_COUNTERS];
+	long long count[NUM_COUNTERS];
+};
+
+const char *perf_names[NUM_COUNTERS] =
+	{ "cycles", "instructions", "llc-misses", "branch-misses", "page-faults" };
+
+
+/*
+ * Function: perf_open
+ * Parameter(s): The perf type and config of the event to count
+ * Returns: A file descriptor for the counter, or -1 if the event is unavailable
+ * Description: Opens a disabled counter for the calling thread only
+ */
+
+int perf_open( int type, long long config )
+{
+	struct perf_event_attr attr;
+
+	memset( &attr, 0, sizeof( attr ) );
+	attr.size = sizeof( attr );
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+
+	// Hardware events only need user space, which keeps us under most paranoid settings
+	attr.exclude_kernel = ( type == PERF_TYPE_HARDWARE );
+	attr.exclude_hv = 1;
+
+	return syscall( __NR_perf_event_open, &attr, 0, -1, -1, 0 );
+}
+
+
+/*
+ * Function: perf_start
+ * Parameter(s): A struct to hold this worker's counters
+ * Returns: None
+ * Description: Opens and enables every counter we can get.  Any counter the kernel
+ *      refuses (no PMU in a VM, perf_event_paranoid, etc) is left at -1 and reported
+ *      as n/a instead of failing the search
+ */
+
+void perf_start( struct perf_counters *pc )
+{
+	int i;
+
+	pc->fd[PERF_CYCLES] = perf_open( PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES );
+	pc->fd[PERF_INSTRUCTIONS] = perf_open( PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS );
+	pc->fd[PERF_LLC_MISSES] = perf_open( PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES );
+	pc->fd[PERF_BRANCH_MISSES] = perf_open( PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES );
+	pc->fd[PERF_PAGE_FAULTS] = perf_open( PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS );
+
+	for ( i = 0; i < NUM_COUNTERS; i++ )
+	{
+		pc->count[i] = -1;
+		if ( pc->fd[i] >= 0 )
+		{
+			ioctl( pc->fd[i], PERF_EVENT_IOC_RESET, 0 );
+			ioctl( pc->fd[i], PERF_EVENT_IOC_ENABLE, 0 );
+		}
+	}
+	return;
+}
+
+
+/*
+ * Function: perf_stop
+ * Parameter(s): The struct that perf_start filled in
+ * Returns: None
+ * Description: Disables and reads each open counter, then closes it
+ */
+
+void perf_stop( struct perf_counters *pc )
+{
+	int i;
+
+	for ( i = 0; i < NUM_COUNTERS; i++ )
+	{
+		if ( pc->fd[i] < 0 )
+			continue;
+		ioctl( pc->fd[i], PERF_EVENT_IOC_DISABLE, 0 );
+		if ( read( pc->fd[i], &pc->count[i], sizeof( long long ) ) != sizeof( long long ) )
+			pc->count[i] = -1;
+		close( pc->fd[i] );
+	}
+	return;
+}
+
+
+/*
+ * Function: perf_report
+ * Parameter(s): A label for the line, the counts to print and how many bytes were scanned
+ * Returns: None
+ * Description: Prints raw counts plus the derived IPC and bytes/cycle figures.  A count
+ *      of -1 means the counter was unavailable
+ */
+
+void perf_report( char *label, long long *count, long long bytes )
+{
+	int i;
+
+	printf( "%-10s", label );
+	for ( i = 0; i < NUM_COUNTERS; i++ )
+	{
+		if ( count[i] < 0 )
+			printf( " %s=n/a", perf_names[i] );
+		else
+			printf( " %s=%lld", perf_names[i], count[i] );
+	}
+	if ( count[PERF_CYCLES] > 0 && count[PERF_INSTRUCTIONS] >= 0 )
+		printf( " ipc=%.2f", (double)count[PERF_INSTRUCTIONS] / count[PERF_CYCLES] );
+	if ( count[PERF_CYCLES] > 0 )
+		printf( " bytes/cycle=%.3f", (double)bytes / count[PERF_CYCLES] );
+	printf( "\n" );
+	return;
+}
+
+
+/*
+ * Function: perf_sum
+ * Parameter(s): A running total and one worker's counts
+ * Returns: None
+ * Description: Adds a worker into the aggregate.  If any worker lost a counter the
+ *      aggregate for it is marked unavailable rather than under-reported
+ */
+
+void perf_sum( long long *total, long long *count )
+{
+	int i;
+
+	for ( i = 0; i < NUM_COUNTERS; i++ )
+	{
+		if ( total[i] < 0 || count[i] < 0 )
+			total[i] = -1;
+		else
+			total[i] += count[i];
+	}
+	return;
+}
+
+// What each worker process sends back to the parent over its pipe
+struct worker_report
+{
+	int hits;
+	long long counts[NUM_COUNTERS];
+};
 
 /*
  * Function: readline
@@ -80,6 +244,34 @@ void help()
 	return;
 }
 
+/*
+ * Function: perf_summary
+ * Parameter(s): The reports sent back by each worker, how many there are, and the
+ *      number of bytes each worker scanned
+ * Returns: None
+ * Description: Prints each worker's counters and the aggregate across all workers
+ */
+
+void perf_summary( struct worker_report *reports, int num_workers, int chunk )
+{
+	long long total[NUM_COUNTERS] = { 0 };
+	char label[32];
+	int i;
+
+	for ( i = 0; i < num_workers; i++ )
+	{
+		snprintf( label, sizeof( label ), "worker %d", i );
+		perf_report( label, reports[i].counts, chunk );
+		perf_sum( total, reports[i].counts );
+	}
+	perf_report( "total", total, (long long)chunk * num_workers );
+
+	if ( total[PERF_CYCLES] < 0 && total[PERF_PAGE_FAULTS] < 0 )
+		printf( "perf events are unavailable here (check /proc/sys/kernel/perf_event_paranoid)\n" );
+	return;
+}
+
+
 /*
  * Function: split_and_srch
  * Parameter(s): Two char strings indicating the text to search for and the number of workers
@@ -101,12 +293,13 @@ void split_and_srch( char* search_term, char* workers_string )
 	int i = 0;
 	int hits = 0;
 	int status = 0;
-	int result = 0;
 	int result_sum = 0;
 
 	// Determine the length of the search term
 	size_t search_length = strlen( search_term );
 	pid_t cpid, wpid;
+	struct perf_counters pc;
+	struct worker_report report;
 
 	// Set up a struct to store information about the file
 	struct stat sbuf;
@@ -147,6 +340,10 @@ void split_and_srch( char* search_term, char* workers_string )
 
 	// Create our pipe array for communication between processes
 	int comms[num_workers][2];
+	struct worker_report reports[num_workers];
+
+	// Flush pending output so the workers don't inherit and repeat it on exit
+	fflush( stdout );
 	do
 	{
 		// Determine offsets for this worker to search
@@ -187,6 +384,10 @@ void split_and_srch( char* search_term, char* workers_string )
 		// Close the read end of this pipe
 		close( comms[worker_num][0] );
 
+		// Start this worker's counters just before the scan loop
+		if ( perf_mode )
+			perf_start( &pc );
+
 		// Iterate through the address space as declared when this process was forked
 		for ( i = offset_start; i < offset_finish; i++ )
 		{
@@ -195,8 +396,16 @@ void split_and_srch( char* search_term, char* workers_string )
 				hits++;
 		}
 
-		// After searching this worker's space, send the number of hits to the pipe
-		write( comms[worker_num][1], &hits, sizeof(int));
+		// Stop the counters, or mark them all unavailable if we weren't counting
+		if ( perf_mode )
+			perf_stop( &pc );
+		else
+			memset( pc.count, -1, sizeof( pc.count ) );
+
+		// After searching this worker's space, send the hits and counters to the pipe
+		report.hits = hits;
+		memcpy( report.counts, pc.count, sizeof( pc.count ) );
+		write( comms[worker_num][1], &report, sizeof( report ) );
 
 		// Close the pipe so the parent process sees an EOF and knows to continue
 		close( comms[worker_num][1] );
@@ -210,9 +419,15 @@ void split_and_srch( char* search_term, char* workers_string )
 	for ( i = 0; i < num_workers; i++ )
 	{
 		// Collect the results for each worker and sum to the result_sum variable
-		while ( read ( comms[i][0], &result, sizeof(int) ) > 0 )
+		if ( read ( comms[i][0], &reports[i], sizeof( report ) ) == sizeof( report ) )
 		{
-			result_sum = result_sum + result;
+			result_sum = result_sum + reports[i].hits;
+		}
+		else
+		{
+			// A worker whose report never arrived counts nothing and has no counters
+			reports[i].hits = 0;
+			memset( reports[i].counts, -1, sizeof( reports[i].counts ) );
 		}
 	}
 
@@ -226,23 +441,32 @@ void split_and_srch( char* search_term, char* workers_string )
 	time_elapsed = ((end.tv_sec*1000000+end.tv_usec) - (start.tv_sec*1000000+start.tv_usec));
 
 	//
-	printf("Found %d instances of %s in %d microseconds\n>", result_sum, search_term, time_elapsed);
+	printf("Found %d instances of %s in %d microseconds\n", result_sum, search_term, time_elapsed);
+
+	// Report the per-worker and aggregate counters in --perf mode
+	if ( perf_mode )
+		perf_summary( reports, num_workers, chunk );
+	printf(">");
 	return;
 }
 
 /*
  * Function: main
- * Parameter(s): None
+ * Parameter(s): The command line; --perf turns on hardware counter reporting
  * Returns: Exit value
  * Description: Main function that starts the program and calls functions as appropriate
  */
 
-int main( void )
+int main( int argc, char **argv )
 {
 	int quit = 0;
 	char *rawinput;
 	char **parsedinput;
 
+	// Check for the optional performance counter mode
+	if ( argc > 1 && strcmp( argv[1], "--perf" ) == 0 )
+		perf_mode = 1;
+
 	// Prompt the user for input
 	printf("Welcome to the Shakespeare word count service.\n");
 	printf("Enter: search [word] [workers] to start your search.\n>");
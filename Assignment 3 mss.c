@@ -19,6 +19,10 @@
 #include<sys/mman.h>
 #include<sys/stat.h>
 #include<pthread.h>
+#include<string.h>
+#include<sys/ioctl.h>
+#include<sys/syscall.h>
+#include<linux/perf_event.h>
 
 // Global variables!  I know there's a way to pass file descriptors and structures
 // between functions but this works fine for our purposes
@@ -27,6 +31,160 @@ struct stat sbuf;
 char * data;
 int result;
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Hardware performance counters collected around each worker's scan loop when the
+// service is started with --perf
+#define NUM_COUNTERS 5
+#define PERF_CYCLES 0
+#define PERF_INSTRUCTIONS 1
+#define PERF_LLC_MISSES 2
+#define PERF_BRANCH_MISSES 3
+#define PERF_PAGE_FAULTS 4
+
+int perf_mode = 0;
+
+struct perf_counters
+{
+	int fd[NUM_COUNTERS];
+	long long count[NUM_COUNTERS];
+};
+
+const char *perf_names[NUM_COUNTERS] =
+	{ "cycles", "instructions", "llc-misses", "branch-misses", "page-faults" };
+
+
+/*
+ * Function: perf_open
+ * Parameter(s): The perf type and config of the event to count
+ * Returns: A file descriptor for the counter, or -1 if the event is unavailable
+ * Description: Opens a disabled counter for the calling thread only
+ */
+
+int perf_open( int type, long long config )
+{
+	struct perf_event_attr attr;
+
+	memset( &attr, 0, sizeof( attr ) );
+	attr.size = sizeof( attr );
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+
+	// Hardware events only need user space, which keeps us under most paranoid settings
+	attr.exclude_kernel = ( type == PERF_TYPE_HARDWARE );
+	attr.exclude_hv = 1;
+
+	return syscall( __NR_perf_event_open, &attr, 0, -1, -1, 0 );
+}
+
+
+/*
+ * Function: perf_start
+ * Parameter(s): A struct to hold this worker's counters
+ * Returns: None
+ * Description: Opens and enables every counter we can get.  Any counter the kernel
+ *      refuses (no PMU in a VM, perf_event_paranoid, etc) is left at -1 and reported
+ *      as n/a instead of failing the search
+ */
+
+void perf_start( struct perf_counters *pc )
+{
+	int i;
+
+	pc->fd[PERF_CYCLES] = perf_open( PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES );
+	pc->fd[PERF_INSTRUCTIONS] = perf_open( PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS );
+	pc->fd[PERF_LLC_MISSES] = perf_open( PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES );
+	pc->fd[PERF_BRANCH_MISSES] = perf_open( PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES );
+	pc->fd[PERF_PAGE_FAULTS] = perf_open( PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS );
+
+	for ( i = 0; i < NUM_COUNTERS; i++ )
+	{
+		pc->count[i] = -1;
+		if ( pc->fd[i] >= 0 )
+		{
+			ioctl( pc->fd[i], PERF_EVENT_IOC_RESET, 0 );
+			ioctl( pc->fd[i], PERF_EVENT_IOC_ENABLE, 0 );
+		}
+	}
+	return;
+}
+
+
+/*
+ * Function: perf_stop
+ * Parameter(s): The struct that perf_start filled in
+ * Returns: None
+ * Description: Disables and reads each open counter, then closes it
+ */
+
+void perf_stop( struct perf_counters *pc )
+{
+	int i;
+
+	for ( i = 0; i < NUM_COUNTERS; i++ )
+	{
+		if ( pc->fd[i] < 0 )
+			continue;
+		ioctl( pc->fd[i], PERF_EVENT_IOC_DISABLE, 0 );
+		if ( read( pc->fd[i], &pc->count[i], sizeof( long long ) ) != sizeof( long long ) )
+			pc->count[i] = -1;
+		close( pc->fd[i] );
+	}
+	return;
+}
+
+
+/*
+ * Function: perf_report
+ * Parameter(s): A label for the line, the counts to print and how many bytes were scanned
+ * Returns: None
+ * Description: Prints raw counts plus the derived IPC and bytes/cycle figures.  A count
+ *      of -1 means the counter was unavailable
+ */
+
+void perf_report( char *label, long long *count, long long bytes )
+{
+	int i;
+
+	printf( "%-10s", label );
+	for ( i = 0; i < NUM_COUNTERS; i++ )
+	{
+		if ( count[i] < 0 )
+			printf( " %s=n/a", perf_names[i] );
+		else
+			printf( " %s=%lld", perf_names[i], count[i] );
+	}
+	if ( count[PERF_CYCLES] > 0 && count[PERF_INSTRUCTIONS] >= 0 )
+		printf( " ipc=%.2f", (double)count[PERF_INSTRUCTIONS] / count[PERF_CYCLES] );
+	if ( count[PERF_CYCLES] > 0 )
+		printf( " bytes/cycle=%.3f", (double)bytes / count[PERF_CYCLES] );
+	printf( "\n" );
+	return;
+}
+
+
+/*
+ * Function: perf_sum
+ * Parameter(s): A running total and one worker's counts
+ * Returns: None
+ * Description: Adds a worker into the aggregate.  If any worker lost a counter the
+ *      aggregate for it is marked unavailable rather than under-reported
+ */
+
+void perf_sum( long long *total, long long *count )
+{
+	int i;
+
+	for ( i = 0; i < NUM_COUNTERS; i++ )
+	{
+		if ( total[i] < 0 || count[i] < 0 )
+			total[i] = -1;
+		else
+			total[i] += count[i];
+	}
+	return;
+}
+
 struct thread
 {
 	pthread_t thread_id;
@@ -35,6 +193,7 @@ struct thread
 	int length;
 	int start;
 	int finish;
+	long long counts[NUM_COUNTERS];
 };
 
 
@@ -171,6 +330,11 @@ void search_and_replace( struct thread *worker )
 	// Local counter variable to track before we update the global var at the end
 	int hit = 0;
 	int i;
+	struct perf_counters pc;
+
+	// Start this thread's counters just before the scan loop
+	if ( perf_mode )
+		perf_start( &pc );
 
 	// Check to see if we're just searching
 	if ( worker->replace == NULL )
@@ -205,6 +369,42 @@ void search_and_replace( struct thread *worker )
 				memcpy( &data[i], worker->replace, worker->length );
 		}
 	}
+
+	// Stop the counters and keep the results for split to report
+	if ( perf_mode )
+	{
+		perf_stop( &pc );
+		memcpy( worker->counts, pc.count, sizeof( pc.count ) );
+	}
+	return;
+}
+
+
+/*
+ * Function: perf_summary
+ * Parameter(s): The array of finished worker threads and how many there are
+ * Returns: None
+ * Description: Prints each thread's counters and the aggregate across all threads
+ */
+
+void perf_summary( struct thread *worker, int num_workers )
+{
+	long long total[NUM_COUNTERS] = { 0 };
+	long long bytes = 0;
+	char label[32];
+	int i;
+
+	for ( i = 0; i < num_workers; i++ )
+	{
+		snprintf( label, sizeof( label ), "worker %d", i );
+		perf_report( label, worker[i].counts, worker[i].finish - worker[i].start );
+		perf_sum( total, worker[i].counts );
+		bytes += worker[i].finish - worker[i].start;
+	}
+	perf_report( "total", total, bytes );
+
+	if ( total[PERF_CYCLES] < 0 && total[PERF_PAGE_FAULTS] < 0 )
+		printf( "perf events are unavailable here (check /proc/sys/kernel/perf_event_paranoid)\n" );
 	return;
 }
 
@@ -296,9 +496,12 @@ void split( char* search_term, char* replace_term, char* workers_string )
 
 	// Print output if appropriate
 	if ( replace_term == NULL )
-		printf("Found %d instances of %s in %d microseconds\n>", result, search_term, time_elapsed);
-	else
-		printf(">");
+		printf("Found %d instances of %s in %d microseconds\n", result, search_term, time_elapsed);
+
+	// Report the per-thread and aggregate counters in --perf mode
+	if ( perf_mode )
+		perf_summary( worker, num_workers );
+	printf(">");
 
 	// Close the file to clean up
 	close( fd );
@@ -308,17 +511,21 @@ void split( char* search_term, char* replace_term, char* workers_string )
 
 /*
  * Function: main
- * Parameter(s): None
+ * Parameter(s): The command line; --perf turns on hardware counter reporting
  * Returns: Exit value
  * Description: Main function that starts the program and calls functions as appropriate
  */
 
-int main( void )
+int main( int argc, char **argv )
 {
 	int quit = 0;
 	char *rawinput;
 	char **parsedinput;
 
+	// Check for the optional performance counter mode
+	if ( argc > 1 && strcmp( argv[1], "--perf" ) == 0 )
+		perf_mode = 1;
+
 	// Prompt the user for input
 	printf("Welcome to the Shakespeare word count service.\n");
 	printf("Enter: search [word] [workers] to start your search.\n>");
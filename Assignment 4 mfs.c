@@ -5,6 +5,7 @@
  * Description: Mav File System, a filesystem demonstration.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <signal.h>
@@ -12,37 +13,385 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <glob.h>
 
-// Defining global constants allow us to easily modify the structure of the filesystem later
-#define NUM_BLOCKS 1250
-#define BLOCK_SIZE 4096
-#define NUM_FILES 128
+// Default format parameters, used for the in-memory file system and for images that
+// are formatted without giving their own
+#define DEFAULT_BLOCKS 1250
+#define DEFAULT_BLOCK_SIZE 4096
+#define DEFAULT_FILES 128
 #define NAME_LENGTH 255
 
-// The actual file system data structure
-unsigned char fileData[NUM_BLOCKS][BLOCK_SIZE];
+// Every image starts with a superblock recording the format parameters chosen when
+// it was made and where each region lives, so mounting is just mapping the image
+// and pointing at the regions.  The counters are written back on fsync and quit,
+// and clean tells the next mount whether it can trust them
+#define MFS_MAGIC 0x3153464d
+#define SUPER_SIZE 4096
 
-// A parallel array that indicates whether a given block is available to use
-int arrayStatus[NUM_BLOCKS];
+typedef struct
+{
+	unsigned int magic;
+	int blockSize;
+	int numBlocks;
+	int numFiles;
+	int hashSize;
+	int clean;
+	long long bitmapOffset;
+	long long dirOffset;
+	long long hashOffset;
+	long long freeSlotsOffset;
+	long long dataOffset;
+	long long imageSize;
+	int freeBlocks;
+	int hint;
+	int numFreeSlots;
+	int nextSlot;
+	long long refOffset;
+	long long fingerprintOffset;
+	long long fpIndexOffset;
+	int fpIndexSize;
+	int dedup;
+	long long logicalBlocks;
+	long long sharedBlocks;
+	int compress;
+	long long compressedBytes;
+	long long storedBytes;
+	int journal;
+	int journalPages;
+	long long journalOffset;
+} superBlock;
+
+// The mapped image, its superblock, and the backing file (-1 when in memory).  With
+// a buffer cache only the metadata in front of the data region is mapped
+unsigned char *image;
+long long imageSize;
+long long mapSize;
+superBlock *sb;
+int imageFd = -1;
+
+// Block size of the mounted image, used everywhere we address a block
+int blockSize;
+
+// The actual file system data structure.  Only blockGet uses this directly, so
+// that a buffer cache can stand in for it
+unsigned char *fileData;
+#define BLOCK( n ) ( fileData + (size_t)( n ) * blockSize )
+
+// Block buffer cache, used instead of mapping the data region when mfs is started
+// with -c so images can be bigger than memory.  Buffers are found through hash
+// chains on the block number and evicted with CLOCK, and dirty buffers are written
+// back by a flusher thread.  Reads happen without cacheLock: the buffer is pinned
+// and marked loading first, and anyone else after the block waits on loadCond.
+// cacheSize is 0 when the data region is mapped
+#define BLOCK_READ 0
+#define BLOCK_OVERWRITE 1
+
+typedef struct
+{
+	int block;
+	int next;
+	int pins;
+	int dirty;
+	int referenced;
+	int loading;
+	unsigned char *data;
+} cacheBuffer;
+
+cacheBuffer *cache;
+unsigned char *cacheMemory;
+int cacheSize = 0;
+int *cacheHash;
+unsigned int cacheHashMask;
+int clockHand;
+int cacheDirty;
+pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t flushCond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t loadCond = PTHREAD_COND_INITIALIZER;
+pthread_t flusher;
+int flusherRunning;
+
+// Buffers that transfers may still pin.  Each transfer reserves its whole batch
+// before pinning any of it, so concurrent transfers wait their turn instead of
+// running the cache out of buffers part way through
+int cachePinBudget;
+pthread_cond_t pinCond = PTHREAD_COND_INITIALIZER;
+
+struct
+{
+	long long hits;
+	long long misses;
+	long long evictions;
+	long long writebacks;
+	long long flushed;
+	long long readahead;
+} cacheStats;
+
+// Block allocation bitmap, one bit per block (1 = in use), packed into 64-bit words
+// so free blocks can be found a word at a time.  freeBlocks is kept up to date on
+// every allocate and free so that df never has to scan anything.  Large bitmaps are
+// split into shards with a lock and search hint each, and every thread allocates
+// from its own home shard first so concurrent puts don't queue on one lock
+#define ALLOC_SHARDS 16
+#define SHARD_MIN_WORDS 64
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	int firstWord;
+	int endWord;
+	int hint;
+	int freeBlocks;
+} bitmapShard;
+
+typedef struct
+{
+	uint64_t *words;
+	int numBlocks;
+	int numWords;
+	int freeBlocks;
+	int hint;
+	int numShards;
+	int shardWords;
+	bitmapShard shards[ALLOC_SHARDS];
+} blockBitmap;
+
+__thread int homeShard = -1;
+int nextHomeShard;
+
+// The bitmap that indicates whether a given block is available to use
+blockBitmap arrayStatus;
+
+// A file is stored as a list of extents, each one a run of contiguous blocks
+typedef struct
+{
+	int start;
+	int length;
+} extent;
+
+// The first few extents live in the directory entry itself.  Files that need more
+// chain on indirect blocks, each of which holds another block's worth of extents
+#define NUM_EXTENTS 8
+#define EXTENTS_PER_BLOCK ( (int)( ( blockSize - 2 * sizeof( int ) ) / sizeof( extent ) ) )
+
+typedef struct
+{
+	int next;
+	int count;
+	extent extents[];
+} indirectBlock;
 
 // Defining the file information struct that will store our file directory info
 typedef struct
 {
 	int valid;
 	char name[NAME_LENGTH];
-	int index[32];
-	int size;
-	struct tm *timeStamp;
+	extent extents[NUM_EXTENTS];
+	int numExtents;
+	int indirect;
+	int lastIndirect;
+	long long size;
+	time_t timeStamp;
+	int flags;
+	unsigned int generation;
+	long long storedSize;
 } fileInfoStruct;
 
-// Declare an array of these structs, one element per possible file
-fileInfoStruct fileInfo[NUM_FILES];
+// fileInfoStruct flags.  generation is bumped whenever the entry is taken or
+// released, so something that let go of an entry can tell it was reused
+#define FILE_DEDUP 1
+#define FILE_COMPRESSED 2
+
+// The directory, one element per possible file
+fileInfoStruct *fileInfo;
+
+// Block level deduplication.  Every block written by a dedup put gets a 64-bit
+// fingerprint and an entry in a fingerprint -> block hash index (block plus one,
+// linear probing, sized like dirHash).  refCount says how many file blocks point at
+// each block, so a shared block is only freed when its last reference goes.  Blocks
+// written without dedup keep a count and fingerprint of zero and are never shared.
+// dedupLock covers all of it
+unsigned int *refCount;
+uint64_t *fingerprints;
+int *fpIndex;
+unsigned int fpMask;
+pthread_mutex_t dedupLock = PTHREAD_MUTEX_INITIALIZER;
+
+// How put and get move file data.  IO_VECTOR gathers a file's extents into
+// preadv/pwritev batches of up to IOV_BATCH runs.  IO_COPY_RANGE has the kernel copy
+// straight between the host file and the image file; it is only offered when the
+// image is a file without a buffer cache, and we drop back to IO_VECTOR if the
+// kernel refuses it
+#define IO_VECTOR 0
+#define IO_COPY_RANGE 1
+#define IOV_BATCH 1024
+int ioMode = IO_VECTOR;
+
+// Set to 0 to stop get from announcing each file it writes
+int verbose = 1;
+
+// Time spent allocating blocks for file data, collected while allocTiming is set
+int allocTiming;
+
+struct
+{
+	long long calls;
+	long long nsec;
+} allocStats;
+
+// Transparent compression.  With compress on, put cuts a file into COMPRESS_CHUNK
+// pieces and compresses each into an extent of its own, which starts with the
+// compressed length.  A chunk that doesn't save a block is stored as it is and is
+// recognised by its extent being as long as the chunk.  storedSize in the entry
+// is what the file takes after compression, and the superblock keeps totals of
+// both for df.  Chunks decompress independently, so get spreads them over the
+// thread pool
+#define COMPRESS_CHUNK 65536
+
+struct
+{
+	long long compressBytes;
+	long long compressUsec;
+	long long decompressBytes;
+	long long decompressUsec;
+} compressStats;
+
+// Worker threads for anything that wants to run in parallel, see poolRun.  The
+// pool is sized to the machine, up to POOL_MAX_THREADS counting the caller
+#define POOL_MAX_THREADS 8
+typedef void (*poolJob)( void *arg );
+pthread_t poolThreads[POOL_MAX_THREADS];
+int poolSize;
+int poolBusy;
+int poolActive;
+int poolGeneration;
+poolJob poolFunction;
+void *poolArg;
+pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t poolWork = PTHREAD_COND_INITIALIZER;
+pthread_cond_t poolDone = PTHREAD_COND_INITIALIZER;
+
+// Open addressing hash index from file name to directory entry.  The table is a power
+// of two at least twice the number of files so probe sequences stay short, and deletes
+// shift entries back instead of leaving tombstones.  Entries hold the directory entry
+// plus one so that a freshly zeroed table is already empty
+#define HASH_EMPTY 0
+int *dirHash;
+unsigned int hashMask;
+
+// Directory updates (the index, the free entry stack and the superblock counters)
+// are serialised by dirLock.  Lookups never take it: like an RCU read side they
+// just probe, reading dirSequence before and after and trying again if an update
+// ran in between (it is odd while one is in progress), so a backward shift delete
+// can't make a reader miss an entry.  Each entry also has a reader/writer lock in
+// fileLocks that get and list hold shared, and put and del hold exclusively for
+// as long as they work on the file
+pthread_mutex_t dirLock = PTHREAD_MUTEX_INITIALIZER;
+unsigned int dirSequence;
+pthread_rwlock_t *fileLocks;
+
+// Write-ahead metadata journal, used when an image file has journaling turned on.
+// Everything in front of the journal region (superblock, bitmap, directory and
+// the indexes) is then mapped privately, so changes stay in memory until they
+// have been logged.  Operations mark the metadata they change with journalDirty
+// and run inside journalBegin/journalEnd.  A commit waits for the operations in
+// progress, copies every dirty page into one transaction (a descriptor listing the
+// pages, the page images and a commit record with a checksum), appends it to the
+// journal and fdatasyncs once.  Operations that finish while a commit is being
+// written wait for the next one, so they share its fsync.  A checkpoint writes
+// the pages home and empties the journal, and mount replays whatever committed
+// transactions it finds.  Blocks freed in a transaction aren't handed out again
+// until it is durable
+#define JOURNAL_MAGIC 0x4c4e524a
+#define JOURNAL_PAGE 4096
+#define JOURNAL_MIN_PAGES 1024
+#define JOURNAL_SUPER 1
+#define JOURNAL_DESCRIPTOR 2
+#define JOURNAL_COMMIT 3
+
+typedef struct
+{
+	unsigned int magic;
+	int type;
+	long long sequence;
+	int count;
+	int pad;
+	uint64_t checksum;
+} journalHeader;
+
+int journalActive;
+int metaPages;
+uint64_t *dirtyPages;
+uint64_t *checkpointPages;
+unsigned char *journalBuffer;
+int journalHead;
+int journalMaxTransaction;
+long long journalSequence;
+long long journalCommitted;
+int journalCommitting;
+pthread_rwlock_t journalHandles;
+pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journalCond = PTHREAD_COND_INITIALIZER;
+
+// Frees waiting for their transaction to commit, and the ones in the commit
+// being written
+extent *pendingFrees;
+int numPendingFrees;
+int maxPendingFrees;
+extent *commitFrees;
+int numCommitFrees;
+pthread_mutex_t pendingLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Runs allocated for work done outside a journaled operation, which commits log
+// as free until the operation that uses them takes them over
+extent *reservedRuns;
+int numReservedRuns;
+int maxReservedRuns;
+
+// Set by journalbench to make every operation durable by syncing the whole image
+// when there is no journal
+int syncEveryOp;
+
+struct
+{
+	long long commits;
+	long long transactions;
+	long long pages;
+	long long checkpoints;
+} journalStats;
+
+// Background defragmentation, see defrag.  The thread holds defragLock while it
+// moves a file, so turning the journal on or off can wait for it to finish
+pthread_mutex_t defragLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t defragCond = PTHREAD_COND_INITIALIZER;
+pthread_t defragThread;
+int defragRunning;
+int defragInterval;
+
+struct
+{
+	long long passes;
+	long long moved;
+	long long blocks;
+} defragStats;
+
+// Stack of released directory entries so a new file never has to search for one.
+// Entries that have never been used are handed out from sb->nextSlot instead, which
+// means a new image doesn't need the stack filled in
+int *freeSlots;
 
 
 /*
  * Function: readline
  * Parameter: none
- * Returns: An unprocessed char string
+ * Returns: An unprocessed char string, or NULL at end of input
  * Description: Gets the user input from a stdin line
  *              and returns it for processing
  */
@@ -50,10 +399,14 @@ fileInfoStruct fileInfo[NUM_FILES];
 char *readline( void )
 {
 	char *input = NULL;
-	ssize_t buffer = 0;
+	size_t buffer = 0;
 
-	// Getline handles the buffer for us
-	getline(&input, &buffer, stdin);
+	// Getline handles the buffer for us, hand back NULL at the end of the input
+	if( getline(&input, &buffer, stdin) == -1 )
+	{
+		free( input );
+		return NULL;
+	}
 	return input;
 }
 
@@ -62,17 +415,22 @@ char *readline( void )
  * Function: parse_command
  * Parameter: input - A pointer to a char string that is
  *              the unprocessed user input string
- * Returns: A parsed array of char strings
+ * Returns: A parsed array of char strings, pointing into input,
+ *          or NULL if there was no memory for it
  * Description: Tokenizes the user input and splits it so
- *              we can pass specific parts to relevant functions
+ *              we can pass specific parts to relevant functions.
+ *              Tokens are separated by at least one character,
+ *              which bounds how many the line can hold
  */
 
 char **parse_command( char *input )
 {
 	int i = 0;
-	char **args = malloc( 255 );
+	char **args = malloc( ( strlen( input ) / 2 + 2 ) * sizeof( char * ) );
 	char *arg;
 
+	if( args == NULL )
+		return NULL;
 	arg = strtok( input, " \r\t\n" );
 
 	// Tokenize the arguments one by one
@@ -90,357 +448,5823 @@ char **parse_command( char *input )
 
 
 /*
- * Function: displayFree
- * Parameter: display - An integer that dictates whether to display
- *                      the free space or just return it
- * Returns: An integer that equals the amount of free space in the file system
- * Description: Searches through the arrayStatus array and stores the free space
- *              in a variable, then outputs the free space if requested and
- *              returns the value
+ * Function: elapsedUsec
+ * Parameter: start - A time captured with gettimeofday
+ * Returns: The number of microseconds since start
+ * Description: Small timing helper for the benchmark commands
+ */
+
+long long elapsedUsec( struct timeval *start )
+{
+	struct timeval end;
+
+	gettimeofday( &end, NULL );
+	return ( end.tv_sec - start->tv_sec ) * 1000000LL + ( end.tv_usec - start->tv_usec );
+}
+
+
+/*
+ * Function: nowNsec
+ * Parameter: none
+ * Returns: A monotonic time in nanoseconds
+ * Description: Finer grained timer for measuring single operations
+ */
+
+long long nowNsec( void )
+{
+	struct timespec now;
+
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+/*
+ * Function: allocCharge
+ * Parameter: start - nowNsec() from before the allocation
+ * Returns: none
+ * Description: Adds an allocation's time to allocStats.  Callers only time
+ *              allocations while allocTiming is set
+ */
+
+void allocCharge( long long start )
+{
+	__atomic_add_fetch( &allocStats.nsec, nowNsec() - start, __ATOMIC_RELAXED );
+	__atomic_add_fetch( &allocStats.calls, 1, __ATOMIC_RELAXED );
+	return;
+}
+
+
+/*
+ * Function: poolWorker / poolRun
+ * Parameters: job - A function every thread should run
+ *             arg - Shared state for the job, which hands out the work itself
+ * Returns: none
+ * Description: A small pool of worker threads, started the first time it's used.
+ *              poolRun has every pool thread and the caller run job( arg ), and
+ *              returns once they have all finished.  Jobs split up their own work,
+ *              usually by taking the next item from a counter under a lock.  If
+ *              the pool is already busy, say a parallel put that reaches a
+ *              parallel get, the caller just does all of the work itself
+ */
+
+void *poolWorker( void *unused )
+{
+	int seen = 0;
+	poolJob job;
+	void *arg;
+
+	pthread_mutex_lock( &poolLock );
+	while( 1 )
+	{
+		while( poolGeneration == seen )
+			pthread_cond_wait( &poolWork, &poolLock );
+		seen = poolGeneration;
+		job = poolFunction;
+		arg = poolArg;
+		pthread_mutex_unlock( &poolLock );
+
+		job( arg );
+
+		pthread_mutex_lock( &poolLock );
+		if( --poolBusy == 0 )
+			pthread_cond_signal( &poolDone );
+	}
+	return NULL;
+}
+
+void poolRun( poolJob job, void *arg )
+{
+	int i;
+
+	pthread_mutex_lock( &poolLock );
+	if( poolActive )
+	{
+		pthread_mutex_unlock( &poolLock );
+		job( arg );
+		return;
+	}
+	poolActive = 1;
+
+	if( poolSize == 0 )
+	{
+		poolSize = sysconf( _SC_NPROCESSORS_ONLN ) - 1;
+		if( poolSize > POOL_MAX_THREADS - 1 )
+			poolSize = POOL_MAX_THREADS - 1;
+		if( poolSize < 1 )
+			poolSize = 1;
+		for( i = 0; i < poolSize; i++ )
+			pthread_create( &poolThreads[i], NULL, poolWorker, NULL );
+	}
+
+	poolFunction = job;
+	poolArg = arg;
+	poolBusy = poolSize;
+	poolGeneration++;
+	pthread_cond_broadcast( &poolWork );
+	pthread_mutex_unlock( &poolLock );
+
+	// The caller does its share too
+	job( arg );
+
+	pthread_mutex_lock( &poolLock );
+	while( poolBusy > 0 )
+		pthread_cond_wait( &poolDone, &poolLock );
+	poolActive = 0;
+	pthread_mutex_unlock( &poolLock );
+	return;
+}
+
+
+/*
+ * Function: journalDirty
+ * Parameters: address, length - Metadata that has just been changed
+ * Returns: none
+ * Description: Marks the pages holding it for the next commit.  Does nothing
+ *              without a journal, or for memory outside the metadata such as
+ *              the scratch bitmap allocbench uses
+ */
+
+void journalDirty( void *address, size_t length )
+{
+	long long offset = (unsigned char *)address - image;
+	int page, last;
+
+	if( !journalActive || offset < 0 || offset >= sb->journalOffset )
+		return;
+
+	last = ( offset + length - 1 ) / JOURNAL_PAGE;
+	for( page = offset / JOURNAL_PAGE; page <= last; page++ )
+		__atomic_fetch_or( &dirtyPages[page / 64], 1ULL << ( page % 64 ), __ATOMIC_RELAXED );
+	return;
+}
+
+
+/*
+ * Function: hashName
+ * Parameter: name - The file name to hash
+ * Returns: The FNV-1a hash of the name
+ * Description: Hash function for the directory index
+ */
+
+unsigned int hashName( const char *name )
+{
+	unsigned int hash = 2166136261u;
+
+	while( *name != '\0' )
+	{
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+
+/*
+ * Function: dirLookup
+ * Parameter: name - The file name to find
+ * Returns: The directory entry holding the file, or -1 if there is none
+ * Description: Probes the hash index for the name.  Only valid entries are ever
+ *              in the index, so a deleted file can't be matched by its old name.
+ *              Safe to call without dirLock, see dirSequence; the entry has to be
+ *              locked and checked before it is used
+ */
+
+int dirLookup( const char *name )
+{
+	unsigned int home = hashName( name ) & hashMask;
+	unsigned int pos, seq;
+	int entry, found;
+
+	do
+	{
+		while( ( seq = __atomic_load_n( &dirSequence, __ATOMIC_ACQUIRE ) ) & 1 );
+
+		found = -1;
+		pos = home;
+		while( ( entry = __atomic_load_n( &dirHash[pos], __ATOMIC_RELAXED ) ) != HASH_EMPTY )
+		{
+			if( strcmp( fileInfo[entry - 1].name, name ) == 0 )
+			{
+				found = entry - 1;
+				break;
+			}
+			pos = ( pos + 1 ) & hashMask;
+		}
+		__atomic_thread_fence( __ATOMIC_ACQUIRE );
+	} while( __atomic_load_n( &dirSequence, __ATOMIC_RELAXED ) != seq );
+
+	return found;
+}
+
+
+/*
+ * Function: dirBeginUpdate / dirEndUpdate
+ * Parameter: none
+ * Returns: none
+ * Description: Bracket a change to the hash index so lookups running at the same
+ *              time notice it and probe again.  Called with dirLock held
+ */
+
+void dirBeginUpdate( void )
+{
+	__atomic_store_n( &dirSequence, dirSequence + 1, __ATOMIC_RELAXED );
+	__atomic_thread_fence( __ATOMIC_RELEASE );
+	return;
+}
+
+void dirEndUpdate( void )
+{
+	__atomic_store_n( &dirSequence, dirSequence + 1, __ATOMIC_RELEASE );
+	return;
+}
+
+
+/*
+ * Function: fileLock
+ * Parameters: name - The file to find
+ *             exclusive - 1 to lock the entry for writing, 0 for reading
+ * Returns: The file's directory entry, locked, or -1 if there is no such file
+ * Description: Looks the name up and locks the entry, then makes sure the entry
+ *              wasn't deleted or reused for another file while we waited
+ */
+
+int fileLock( const char *name, int exclusive )
+{
+	int fileNum;
+
+	while( ( fileNum = dirLookup( name ) ) != -1 )
+	{
+		if( exclusive )
+			pthread_rwlock_wrlock( &fileLocks[fileNum] );
+		else
+			pthread_rwlock_rdlock( &fileLocks[fileNum] );
+
+		if( fileInfo[fileNum].valid && strcmp( fileInfo[fileNum].name, name ) == 0 )
+			return fileNum;
+		pthread_rwlock_unlock( &fileLocks[fileNum] );
+	}
+	return -1;
+}
+
+
+/*
+ * Function: dirInsert
+ * Parameter: fileNum - A directory entry whose name has already been set
+ * Returns: none
+ * Description: Adds the entry to the hash index under its name.  Called with
+ *              dirLock held
+ */
+
+void dirInsert( int fileNum )
+{
+	unsigned int pos = hashName( fileInfo[fileNum].name ) & hashMask;
+
+	while( dirHash[pos] != HASH_EMPTY )
+		pos = ( pos + 1 ) & hashMask;
+	dirBeginUpdate();
+	dirHash[pos] = fileNum + 1;
+	dirEndUpdate();
+	journalDirty( &dirHash[pos], sizeof( int ) );
+	return;
+}
+
+
+/*
+ * Function: dirRemove
+ * Parameter: fileNum - A directory entry that is in the index
+ * Returns: none
+ * Description: Takes the entry out of the hash index, then walks the rest of the
+ *              probe chain and moves back any entry that could no longer be
+ *              reached past the hole we just made.  Called with dirLock held
+ */
+
+void dirRemove( int fileNum )
+{
+	unsigned int pos = hashName( fileInfo[fileNum].name ) & hashMask;
+	unsigned int next, home;
+
+	while( dirHash[pos] != fileNum + 1 )
+		pos = ( pos + 1 ) & hashMask;
+	dirBeginUpdate();
+	dirHash[pos] = HASH_EMPTY;
+	journalDirty( &dirHash[pos], sizeof( int ) );
+
+	next = ( pos + 1 ) & hashMask;
+	while( dirHash[next] != HASH_EMPTY )
+	{
+		// Move the entry into the hole if its home slot isn't between the hole and here
+		home = hashName( fileInfo[dirHash[next] - 1].name ) & hashMask;
+		if( ( ( next - home ) & hashMask ) >= ( ( next - pos ) & hashMask ) )
+		{
+			dirHash[pos] = dirHash[next];
+			dirHash[next] = HASH_EMPTY;
+			journalDirty( &dirHash[pos], sizeof( int ) );
+			journalDirty( &dirHash[next], sizeof( int ) );
+			pos = next;
+		}
+		next = ( next + 1 ) & hashMask;
+	}
+	dirEndUpdate();
+	return;
+}
+
+
+/*
+ * Function: dirAllocSlot
+ * Parameter: none
+ * Returns: An unused directory entry, or -1 if the directory is full
+ * Description: Reuses a released entry if there is one, otherwise takes the next
+ *              entry that has never been used.  Called with dirLock held
+ */
+
+int dirAllocSlot( void )
+{
+	if( sb->numFreeSlots > 0 )
+		return freeSlots[--sb->numFreeSlots];
+	if( sb->nextSlot < sb->numFiles )
+		return sb->nextSlot++;
+	return -1;
+}
+
+
+/*
+ * Function: bitmapSetRange
+ * Parameters: bm - The bitmap to update
+ *             start, count - The run of blocks to change
+ *             used - 1 to mark the run in use, 0 to mark it free
+ * Returns: none
+ * Description: Sets or clears a run of bits a whole word at a time where possible.
+ *              The caller is responsible for keeping freeBlocks in step
+ */
+
+void bitmapSetRange( blockBitmap *bm, int start, int count, int used )
+{
+	int word, bit, span;
+	uint64_t mask;
+
+	if( count > 0 )
+		journalDirty( &bm->words[start / 64], ( ( start + count - 1 ) / 64 - start / 64 + 1 ) * sizeof( uint64_t ) );
+
+	while( count > 0 )
+	{
+		word = start / 64;
+		bit = start % 64;
+		span = 64 - bit;
+		if( span > count )
+			span = count;
+
+		// Build a mask of span bits starting at bit
+		mask = ( span == 64 ) ? ~0ULL : ( ( 1ULL << span ) - 1 ) << bit;
+		if( used )
+			bm->words[word] |= mask;
+		else
+			bm->words[word] &= ~mask;
+
+		start += span;
+		count -= span;
+	}
+	return;
+}
+
+
+/*
+ * Function: bitmapShards
+ * Parameter: bm - A bitmap whose words, numWords and hint are set
+ * Returns: none
+ * Description: Splits the bitmap into shards of at least SHARD_MIN_WORDS words,
+ *              each with its own lock, hint and free count so full shards can be
+ *              passed over without searching.  The shard holding the saved hint
+ *              starts from it, the others from their first word
+ */
+
+void bitmapShards( blockBitmap *bm )
+{
+	int i, w;
+
+	bm->numShards = bm->numWords / SHARD_MIN_WORDS;
+	if( bm->numShards > ALLOC_SHARDS )
+		bm->numShards = ALLOC_SHARDS;
+	if( bm->numShards < 1 )
+		bm->numShards = 1;
+	bm->shardWords = ( bm->numWords + bm->numShards - 1 ) / bm->numShards;
+
+	for( i = 0; i < bm->numShards; i++ )
+	{
+		pthread_mutex_init( &bm->shards[i].lock, NULL );
+		bm->shards[i].firstWord = i * bm->shardWords;
+		bm->shards[i].endWord = ( i + 1 ) * bm->shardWords;
+		if( bm->shards[i].endWord > bm->numWords )
+			bm->shards[i].endWord = bm->numWords;
+		bm->shards[i].hint = bm->shards[i].firstWord;
+		if( bm->hint >= bm->shards[i].firstWord && bm->hint < bm->shards[i].endWord )
+			bm->shards[i].hint = bm->hint;
+
+		bm->shards[i].freeBlocks = 0;
+		for( w = bm->shards[i].firstWord; w < bm->shards[i].endWord; w++ )
+			bm->shards[i].freeBlocks += 64 - __builtin_popcountll( bm->words[w] );
+	}
+	return;
+}
+
+
+/*
+ * Function: bitmapInit
+ * Parameters: bm - The bitmap to set up
+ *             words - Storage for ( numBlocks + 63 ) / 64 words
+ *             numBlocks - How many blocks the bitmap tracks
+ * Returns: none
+ * Description: Marks every block free.  The padding bits past the last block are
+ *              marked in use so the searches below never hand them out
+ */
+
+void bitmapInit( blockBitmap *bm, uint64_t *words, int numBlocks )
+{
+	bm->words = words;
+	bm->numBlocks = numBlocks;
+	bm->numWords = ( numBlocks + 63 ) / 64;
+	bm->freeBlocks = numBlocks;
+	bm->hint = 0;
+
+	memset( words, 0, bm->numWords * sizeof( uint64_t ) );
+	if( numBlocks % 64 != 0 )
+		bitmapSetRange( bm, numBlocks, 64 - numBlocks % 64, 1 );
+	bitmapShards( bm );
+	return;
+}
+
+
+/*
+ * Function: bitmapHome
+ * Parameter: bm - The bitmap about to be allocated from
+ * Returns: The shard this thread should try first
+ * Description: Threads are dealt home shards round robin the first time they
+ *              allocate, so concurrent puts mostly stay out of each other's way
+ */
+
+int bitmapHome( blockBitmap *bm )
+{
+	if( homeShard == -1 )
+		homeShard = __atomic_fetch_add( &nextHomeShard, 1, __ATOMIC_RELAXED );
+	return homeShard % bm->numShards;
+}
+
+
+/*
+ * Function: bitmapAlloc
+ * Parameter: bm - The bitmap to allocate from
+ * Returns: The block number allocated, or -1 if the bitmap is full
+ * Description: Finds the first word with a clear bit, starting from the word the last
+ *              allocation in this thread's shard ended in, and takes its lowest free
+ *              block.  Other shards are tried in turn if the home shard is full
+ */
+
+int bitmapAlloc( blockBitmap *bm )
+{
+	bitmapShard *shard;
+	int i, s, span, word, block;
+	int home = bitmapHome( bm );
+
+	for( s = 0; s < bm->numShards; s++ )
+	{
+		if( __atomic_load_n( &bm->freeBlocks, __ATOMIC_RELAXED ) == 0 )
+			return -1;
+
+		shard = &bm->shards[( home + s ) % bm->numShards];
+		if( __atomic_load_n( &shard->freeBlocks, __ATOMIC_RELAXED ) == 0 )
+			continue;
+		span = shard->endWord - shard->firstWord;
+		pthread_mutex_lock( &shard->lock );
+		for( i = 0; i < span && shard->freeBlocks > 0; i++ )
+		{
+			word = shard->firstWord + ( shard->hint - shard->firstWord + i ) % span;
+			if( bm->words[word] != ~0ULL )
+			{
+				block = word * 64 + __builtin_ctzll( ~bm->words[word] );
+				bm->words[word] |= 1ULL << ( block % 64 );
+				journalDirty( &bm->words[word], sizeof( uint64_t ) );
+				shard->hint = word;
+				shard->freeBlocks--;
+				pthread_mutex_unlock( &shard->lock );
+				__atomic_sub_fetch( &bm->freeBlocks, 1, __ATOMIC_RELAXED );
+				bm->hint = word;
+				return block;
+			}
+		}
+		pthread_mutex_unlock( &shard->lock );
+	}
+	return -1;
+}
+
+
+/*
+ * Function: shardAllocRun
+ * Parameters: bm, shard - The bitmap and the shard to search, with its lock held
+ *             want - How many contiguous blocks the caller would like
+ *             settle - 1 to take the longest run if none is long enough
+ *             got - Set to the number of blocks actually allocated
+ * Returns: The first block of the run, or -1 if nothing suitable was found
+ * Description: Allocates the next free run of at least want blocks, searching from
+ *              where the last allocation in the shard left off.  Runs are found
+ *              with ctz on whole words, so full and empty words cost one test each
+ */
+
+int shardAllocRun( blockBitmap *bm, bitmapShard *shard, int want, int settle, int *got )
+{
+	int i, w, bit, skip, runLen;
+	int span = shard->endWord - shard->firstWord;
+	int start = 0;
+	int len = 0;
+	int bestStart = -1;
+	int bestLen = 0;
+	uint64_t word, rest;
+
+	for( i = 0; i < span; i++ )
+	{
+		// Search next-fit from the hint, a run can't carry over the wrap back to the
+		// start of the shard, but the one it ends at the end of the shard still
+		// counts towards the longest
+		w = shard->firstWord + ( shard->hint - shard->firstWord + i ) % span;
+		if( w == shard->firstWord )
+		{
+			if( len > bestLen )
+			{
+				bestStart = start;
+				bestLen = len;
+			}
+			len = 0;
+		}
+		word = bm->words[w];
+		bit = 0;
+		while( bit < 64 )
+		{
+			// Skip over the blocks that are in use, which ends the current run
+			rest = ~word >> bit;
+			if( rest == 0 )
+				skip = 64 - bit;
+			else
+				skip = __builtin_ctzll( rest );
+			if( skip > 0 )
+			{
+				if( len > bestLen )
+				{
+					bestStart = start;
+					bestLen = len;
+				}
+				len = 0;
+				bit += skip;
+				if( bit >= 64 )
+					break;
+			}
+
+			// Measure the free run from here, which may carry on into the next word
+			rest = word >> bit;
+			runLen = ( rest == 0 ) ? 64 - bit : __builtin_ctzll( rest );
+			if( len == 0 )
+				start = w * 64 + bit;
+			len += runLen;
+			bit += runLen;
+
+			if( len >= want )
+			{
+				bestStart = start;
+				bestLen = want;
+				settle = 1;
+				i = span;
+				break;
+			}
+		}
+	}
+
+	// No run was long enough, so settle for the longest one we saw if allowed
+	if( len > bestLen && len < want )
+	{
+		bestStart = start;
+		bestLen = len;
+	}
+	if( bestLen == 0 || !settle )
+		return -1;
+
+	bitmapSetRange( bm, bestStart, bestLen, 1 );
+	shard->hint = ( bestStart + bestLen - 1 ) / 64;
+	shard->freeBlocks -= bestLen;
+	*got = bestLen;
+	return bestStart;
+}
+
+
+/*
+ * Function: bitmapAllocRun
+ * Parameters: bm - The bitmap to allocate from
+ *             want - How many contiguous blocks the caller would like
+ *             got - Set to the number of blocks actually allocated
+ * Returns: The first block of the run, or -1 if the bitmap is full
+ * Description: Looks for a run of want blocks in this thread's shard and then the
+ *              others.  If there is no run that long anywhere, the longest run in
+ *              the first shard with any space is allocated instead so the caller
+ *              can keep asking for the remainder
+ */
+
+int bitmapAllocRun( blockBitmap *bm, int want, int *got )
+{
+	bitmapShard *shard;
+	int s, pass, start;
+	int home = bitmapHome( bm );
+
+	*got = 0;
+	if( want <= 0 )
+		return -1;
+
+	for( pass = 0; pass < 2; pass++ )
+	{
+		for( s = 0; s < bm->numShards; s++ )
+		{
+			if( __atomic_load_n( &bm->freeBlocks, __ATOMIC_RELAXED ) == 0 )
+				return -1;
+
+			// The first pass only looks where a whole run could fit
+			shard = &bm->shards[( home + s ) % bm->numShards];
+			if( __atomic_load_n( &shard->freeBlocks, __ATOMIC_RELAXED ) < ( pass == 0 ? want : 1 ) )
+				continue;
+			pthread_mutex_lock( &shard->lock );
+			start = shardAllocRun( bm, shard, want, pass, got );
+			pthread_mutex_unlock( &shard->lock );
+			if( start != -1 )
+			{
+				__atomic_sub_fetch( &bm->freeBlocks, *got, __ATOMIC_RELAXED );
+				bm->hint = ( start + *got - 1 ) / 64;
+				return start;
+			}
+		}
+	}
+	return -1;
+}
+
+
+/*
+ * Function: bitmapFree
+ * Parameters: bm - The bitmap to update
+ *             start, count - The run of blocks to release
+ * Returns: none
+ * Description: Marks a run of blocks free and credits the free counter, taking
+ *              the lock of each shard the run falls in
+ */
+
+void bitmapFree( blockBitmap *bm, int start, int count )
+{
+	bitmapShard *shard;
+	int span;
+
+	__atomic_add_fetch( &bm->freeBlocks, count, __ATOMIC_RELAXED );
+	while( count > 0 )
+	{
+		shard = &bm->shards[start / 64 / bm->shardWords];
+		span = shard->endWord * 64 - start;
+		if( span > count )
+			span = count;
+
+		pthread_mutex_lock( &shard->lock );
+		bitmapSetRange( bm, start, span, 0 );
+		shard->hint = start / 64;
+		shard->freeBlocks += span;
+		pthread_mutex_unlock( &shard->lock );
+
+		start += span;
+		count -= span;
+	}
+	return;
+}
+
+
+/*
+ * Function: bitmapAllocLow
+ * Parameters: bm - The bitmap to allocate from
+ *             want - How many contiguous blocks are needed
+ *             below - The run has to start before this block
+ * Returns: The first block of the run, or -1 if there is no such run
+ * Description: First fit from the front of the bitmap rather than next fit from
+ *              the hints, so that defrag packs files towards the start and
+ *              leaves the free space in one piece at the end
+ */
+
+int bitmapAllocLow( blockBitmap *bm, int want, int below )
+{
+	bitmapShard *shard;
+	int s, hint, start, got;
+
+	for( s = 0; s < bm->numShards && bm->shards[s].firstWord * 64 < below; s++ )
+	{
+		shard = &bm->shards[s];
+		if( __atomic_load_n( &shard->freeBlocks, __ATOMIC_RELAXED ) < want )
+			continue;
+
+		// Search from the start of the shard, leaving its hint where it was
+		pthread_mutex_lock( &shard->lock );
+		hint = shard->hint;
+		shard->hint = shard->firstWord;
+		start = shardAllocRun( bm, shard, want, 0, &got );
+		if( start != -1 && start >= below )
+		{
+			bitmapSetRange( bm, start, got, 0 );
+			shard->freeBlocks += got;
+			start = -1;
+		}
+		shard->hint = hint;
+		pthread_mutex_unlock( &shard->lock );
+		if( start != -1 )
+		{
+			__atomic_sub_fetch( &bm->freeBlocks, got, __ATOMIC_RELAXED );
+			return start;
+		}
+	}
+	return -1;
+}
+
+
+/*
+ * Function: blockRelease
+ * Parameters: start, count - A run of blocks a file no longer uses
+ * Returns: none
+ * Description: Frees the run straight away without a journal.  With one the run
+ *              is queued and freed once the transaction freeing it has
+ *              committed, so its old contents can't be overwritten while a
+ *              crash could still bring back the file that owned them
+ */
+
+void blockRelease( int start, int count )
+{
+	extent *grown;
+
+	if( !journalActive )
+	{
+		bitmapFree( &arrayStatus, start, count );
+		return;
+	}
+
+	pthread_mutex_lock( &pendingLock );
+	if( numPendingFrees == maxPendingFrees )
+	{
+		grown = realloc( pendingFrees, ( maxPendingFrees * 2 + 64 ) * sizeof( extent ) );
+		if( grown == NULL )
+		{
+			pthread_mutex_unlock( &pendingLock );
+			bitmapFree( &arrayStatus, start, count );
+			return;
+		}
+		pendingFrees = grown;
+		maxPendingFrees = maxPendingFrees * 2 + 64;
+	}
+	pendingFrees[numPendingFrees].start = start;
+	pendingFrees[numPendingFrees].length = count;
+	numPendingFrees++;
+	pthread_mutex_unlock( &pendingLock );
+	return;
+}
+
+
+/*
+ * Function: blockReserve / blockClaim
+ * Parameters: start, count - A run that was just allocated
+ * Returns: blockReserve returns 0 on success, -1 if it ran out of memory
+ * Description: A reserved run stays allocated in memory but is logged as free,
+ *              so a crash before anything points at it doesn't leave it in use
+ *              for good.  blockClaim drops the reservation once the run has been
+ *              taken into an operation or freed.  Both are called inside
+ *              journalBegin/journalLeave, so no commit is gathering the bitmap
+ */
+
+int blockReserve( int start, int count )
+{
+	extent *grown;
+
+	pthread_mutex_lock( &pendingLock );
+	if( numReservedRuns == maxReservedRuns )
+	{
+		grown = realloc( reservedRuns, ( maxReservedRuns * 2 + 4 ) * sizeof( extent ) );
+		if( grown == NULL )
+		{
+			pthread_mutex_unlock( &pendingLock );
+			return -1;
+		}
+		reservedRuns = grown;
+		maxReservedRuns = maxReservedRuns * 2 + 4;
+	}
+	reservedRuns[numReservedRuns].start = start;
+	reservedRuns[numReservedRuns].length = count;
+	numReservedRuns++;
+	pthread_mutex_unlock( &pendingLock );
+	return 0;
+}
+
+void blockClaim( int start )
+{
+	int i;
+
+	pthread_mutex_lock( &pendingLock );
+	for( i = 0; i < numReservedRuns; i++ )
+	{
+		if( reservedRuns[i].start == start )
+		{
+			reservedRuns[i] = reservedRuns[--numReservedRuns];
+			break;
+		}
+	}
+	pthread_mutex_unlock( &pendingLock );
+	return;
+}
+
+
+/*
+ * Function: displayFree
+ * Parameter: display - An integer that dictates whether to display
+ *                      the free space or just return it
+ * Returns: The amount of free space in the file system, in bytes
+ * Description: Reads the free block counter kept by the allocator, then outputs
+ *              the free space if requested and returns the value.  Logical usage
+ *              counts every file block, physical counts blocks actually in use.
+ *              Compression throughput is for this session only
+ */
+
+long long displayFree( int display )
+{
+	long long freeSpace = (long long)arrayStatus.freeBlocks * blockSize;
+	long long physical = (long long)( arrayStatus.numBlocks - arrayStatus.freeBlocks ) * blockSize;
+	long long logical = sb->logicalBlocks * blockSize;
+
+	// If the call requested a display, output the free space, plus how well dedup
+	// is doing once it has been used
+	if( display == 1 )
+	{
+		printf( "%lld bytes free.\n", freeSpace );
+		if( sb->dedup || sb->sharedBlocks > 0 )
+			printf( "%lld bytes logical, %lld bytes physical, dedup ratio %.2f\n",
+			        logical, physical, physical > 0 ? (double)logical / physical : 1.0 );
+		if( sb->compress || sb->compressedBytes > 0 )
+			printf( "%lld bytes compressed to %lld, ratio %.2f\n", sb->compressedBytes, sb->storedBytes,
+			        sb->storedBytes > 0 ? (double)sb->compressedBytes / sb->storedBytes : 1.0 );
+		if( compressStats.compressUsec > 0 || compressStats.decompressUsec > 0 )
+			printf( "compress %.1f MB/s, decompress %.1f MB/s\n",
+			        compressStats.compressUsec > 0 ? (double)compressStats.compressBytes / compressStats.compressUsec : 0.0,
+			        compressStats.decompressUsec > 0 ? (double)compressStats.decompressBytes / compressStats.decompressUsec : 0.0 );
+	}
+
+	// Return the amount free whether a display was requested or not
+	return freeSpace;
+}
+
+/*
+ * Function: vectorIO
+ * Parameters: fd - The host file
+ *             iov, count - The runs of image memory to fill or drain
+ *             offset - Where in the host file the first run lines up
+ *             toImage - 1 to read the host file into the image, 0 to write it out
+ * Returns: 0 on success, -1 on an I/O error
+ * Description: Issues preadv/pwritev until every run has been moved, picking up
+ *              after short transfers.  Running out of host file on a read isn't an
+ *              error, the rest of the blocks are just left as they are
+ */
+
+int vectorIO( int fd, struct iovec *iov, int count, off_t offset, int toImage )
+{
+	ssize_t done;
+
+	while( count > 0 )
+	{
+		if( toImage )
+			done = preadv( fd, iov, count, offset );
+		else
+			done = pwritev( fd, iov, count, offset );
+		if( done == -1 && errno == EINTR )
+			continue;
+		if( done == -1 )
+			return -1;
+		if( done == 0 )
+			return 0;
+		offset += done;
+
+		// Drop the runs that finished and trim the one that was cut short
+		while( count > 0 && done >= (ssize_t)iov->iov_len )
+		{
+			done -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if( count > 0 )
+		{
+			iov->iov_base = (char *)iov->iov_base + done;
+			iov->iov_len -= done;
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * Function: cacheFind
+ * Parameter: block - The block number to look for
+ * Returns: The cache buffer holding the block, or -1 if it isn't cached
+ * Description: Hash chain lookup, called with cacheLock held
+ */
+
+int cacheFind( int block )
+{
+	int i;
+
+	for( i = cacheHash[block & cacheHashMask]; i != -1; i = cache[i].next )
+	{
+		if( cache[i].block == block )
+			return i;
+	}
+	return -1;
+}
+
+
+/*
+ * Function: cacheWrite
+ * Parameter: i - A dirty cache buffer
+ * Returns: none
+ * Description: Writes a buffer back to its block in the image, called with
+ *              cacheLock held
+ */
+
+void cacheWrite( int i )
+{
+	off_t offset = sb->dataOffset + (off_t)cache[i].block * blockSize;
+
+	if( pwrite( imageFd, cache[i].data, blockSize, offset ) != blockSize )
+		perror( "cache write back" );
+	cache[i].dirty = 0;
+	cacheDirty--;
+	return;
+}
+
+
+/*
+ * Function: cacheVictim
+ * Parameter: block - The block that will be loaded into the buffer
+ * Returns: A buffer now assigned to block and pinned once, or -1 if every
+ *          buffer is pinned
+ * Description: CLOCK eviction.  The hand sweeps the buffers clearing reference
+ *              bits and takes the first unpinned buffer that hasn't been used
+ *              since the last sweep, writing it back first if it is dirty.
+ *              Called with cacheLock held
+ */
+
+int cacheVictim( int block )
+{
+	int i, *link;
+	int sweeps;
+
+	for( sweeps = 0; sweeps < 2 * cacheSize; sweeps++ )
+	{
+		i = clockHand;
+		clockHand = ( clockHand + 1 ) % cacheSize;
+
+		if( cache[i].pins > 0 )
+			continue;
+		if( cache[i].referenced )
+		{
+			cache[i].referenced = 0;
+			continue;
+		}
+
+		// Throw out whatever the buffer held
+		if( cache[i].block != -1 )
+		{
+			if( cache[i].dirty )
+			{
+				cacheWrite( i );
+				cacheStats.writebacks++;
+			}
+			for( link = &cacheHash[cache[i].block & cacheHashMask]; *link != i; link = &cache[*link].next );
+			*link = cache[i].next;
+			cacheStats.evictions++;
+		}
+
+		// And file it under the new block
+		cache[i].block = block;
+		cache[i].next = cacheHash[block & cacheHashMask];
+		cacheHash[block & cacheHashMask] = i;
+		cache[i].pins = 1;
+		cache[i].referenced = 1;
+		return i;
+	}
+	return -1;
+}
+
+
+/*
+ * Function: blockGet
+ * Parameters: block - The block to access
+ *             mode - BLOCK_READ if the current contents are needed, or
+ *                    BLOCK_OVERWRITE if the caller will replace the whole block
+ * Returns: A pointer to the block's data, or NULL if the cache is all pinned
+ * Description: Every access to the data region goes through here.  With a mapped
+ *              image the block is just its address in the mapping.  With a buffer
+ *              cache the block is found or loaded and stays pinned in memory until
+ *              the matching blockPut.  A block still being read by another thread
+ *              is waited for
+ */
+
+unsigned char *blockGet( int block, int mode )
+{
+	int i;
+
+	if( cacheSize == 0 )
+		return BLOCK( block );
+
+	pthread_mutex_lock( &cacheLock );
+	i = cacheFind( block );
+	if( i != -1 )
+	{
+		cacheStats.hits++;
+		cache[i].pins++;
+		cache[i].referenced = 1;
+		while( cache[i].loading )
+			pthread_cond_wait( &loadCond, &cacheLock );
+	}
+	else
+	{
+		cacheStats.misses++;
+		i = cacheVictim( block );
+		if( i == -1 )
+		{
+			pthread_mutex_unlock( &cacheLock );
+			printf( "cache error: every buffer is in use\n" );
+			return NULL;
+		}
+		if( mode == BLOCK_OVERWRITE )
+			memset( cache[i].data, 0, blockSize );
+		else
+		{
+			// The pin keeps the buffer ours while the lock is dropped for the read
+			cache[i].loading = 1;
+			pthread_mutex_unlock( &cacheLock );
+			if( pread( imageFd, cache[i].data, blockSize, sb->dataOffset + (off_t)block * blockSize ) != blockSize )
+				perror( "cache read" );
+			pthread_mutex_lock( &cacheLock );
+			cache[i].loading = 0;
+			pthread_cond_broadcast( &loadCond );
+		}
+	}
+	pthread_mutex_unlock( &cacheLock );
+	return cache[i].data;
+}
+
+
+/*
+ * Function: blockPut
+ * Parameters: block - A block returned by blockGet
+ *             dirty - 1 if the caller changed the block
+ * Returns: none
+ * Description: Unpins a block.  Dirty blocks are left for the flusher thread or
+ *              eviction to write back
+ */
+
+void blockPut( int block, int dirty )
+{
+	int i;
+
+	if( cacheSize == 0 )
+		return;
+
+	pthread_mutex_lock( &cacheLock );
+	i = cacheFind( block );
+	cache[i].pins--;
+	if( dirty && !cache[i].dirty )
+	{
+		cache[i].dirty = 1;
+		cacheDirty++;
+
+		// Wake the flusher early if dirty blocks are piling up
+		if( cacheDirty > cacheSize / 2 )
+			pthread_cond_signal( &flushCond );
+	}
+	pthread_mutex_unlock( &cacheLock );
+	return;
+}
+
+
+/*
+ * Function: cacheReadahead
+ * Parameters: start, count - A run of blocks that is about to be read in order
+ * Returns: none
+ * Description: Loads any of the run that isn't cached yet, reading each stretch of
+ *              missing blocks with a single preadv without holding cacheLock.  The
+ *              run is capped at a quarter of the cache so readahead can't push out
+ *              everything else
+ */
+
+void cacheReadahead( int start, int count )
+{
+	struct iovec iov[IOV_BATCH];
+	int bufs[IOV_BATCH];
+	int block, i, n, limit;
+
+	if( cacheSize == 0 )
+		return;
+
+	limit = cacheSize / 4;
+	if( limit > IOV_BATCH )
+		limit = IOV_BATCH;
+	if( count > limit )
+		count = limit;
+
+	pthread_mutex_lock( &cacheLock );
+	block = start;
+	while( block < start + count )
+	{
+		// Skip the blocks we already have
+		if( cacheFind( block ) != -1 )
+		{
+			block++;
+			continue;
+		}
+
+		// Gather the stretch of missing blocks starting here
+		n = 0;
+		while( block + n < start + count && cacheFind( block + n ) == -1 )
+		{
+			i = cacheVictim( block + n );
+			if( i == -1 )
+				break;
+			cache[i].referenced = 0;
+			cache[i].loading = 1;
+			bufs[n] = i;
+			iov[n].iov_base = cache[i].data;
+			iov[n].iov_len = blockSize;
+			n++;
+		}
+		if( n == 0 )
+			break;
+
+		pthread_mutex_unlock( &cacheLock );
+		vectorIO( imageFd, iov, n, sb->dataOffset + (off_t)block * blockSize, 1 );
+		pthread_mutex_lock( &cacheLock );
+		for( i = 0; i < n; i++ )
+		{
+			cache[bufs[i]].loading = 0;
+			cache[bufs[i]].pins--;
+		}
+		pthread_cond_broadcast( &loadCond );
+		cacheStats.readahead += n;
+		block += n;
+	}
+	pthread_mutex_unlock( &cacheLock );
+	return;
+}
+
+
+/*
+ * Function: cacheFlush
+ * Parameter: none
+ * Returns: none
+ * Description: Writes back every dirty buffer that isn't pinned, called with
+ *              cacheLock held
+ */
+
+void cacheFlush( void )
+{
+	int i;
+
+	for( i = 0; i < cacheSize && cacheDirty > 0; i++ )
+	{
+		if( cache[i].dirty && cache[i].pins == 0 )
+		{
+			cacheWrite( i );
+			cacheStats.flushed++;
+		}
+	}
+	return;
+}
+
+
+/*
+ * Function: flusherThread
+ * Parameter: unused
+ * Returns: NULL
+ * Description: Background write-back.  Wakes up every second, or sooner when
+ *              blockPut sees half the cache dirty, and flushes the dirty buffers
+ *              so eviction rarely has to wait on a write
+ */
+
+void *flusherThread( void *unused )
+{
+	struct timespec wake;
+
+	pthread_mutex_lock( &cacheLock );
+	while( flusherRunning )
+	{
+		clock_gettime( CLOCK_REALTIME, &wake );
+		wake.tv_sec += 1;
+		pthread_cond_timedwait( &flushCond, &cacheLock, &wake );
+		cacheFlush();
+	}
+	pthread_mutex_unlock( &cacheLock );
+	return NULL;
+}
+
+
+/*
+ * Function: cacheInit
+ * Parameter: size - How many blocks the cache holds
+ * Returns: 0 on success, -1 if the memory couldn't be allocated
+ * Description: Sets up the buffers and hash chains and starts the flusher
+ */
+
+int cacheInit( int size )
+{
+	int i;
+
+	cacheSize = size;
+	for( cacheHashMask = 1; cacheHashMask < 2 * size; cacheHashMask *= 2 );
+	cacheHash = malloc( cacheHashMask * sizeof( int ) );
+	cacheHashMask--;
+	cache = calloc( size, sizeof( cacheBuffer ) );
+	cacheMemory = malloc( (size_t)size * blockSize );
+	if( cacheHash == NULL || cache == NULL || cacheMemory == NULL )
+	{
+		printf( "cache error: couldn't allocate %d blocks\n", size );
+		cacheSize = 0;
+		return -1;
+	}
+
+	for( i = 0; i <= (int)cacheHashMask; i++ )
+		cacheHash[i] = -1;
+	for( i = 0; i < size; i++ )
+	{
+		cache[i].block = -1;
+		cache[i].next = -1;
+		cache[i].data = cacheMemory + (size_t)i * blockSize;
+	}
+
+	cachePinBudget = size * 3 / 4 > 0 ? size * 3 / 4 : 1;
+	flusherRunning = 1;
+	pthread_create( &flusher, NULL, flusherThread, NULL );
+	return 0;
+}
+
+
+/*
+ * Function: cacheReserve / cacheRelease
+ * Parameter: count - How many buffers the caller will pin at once
+ * Returns: none
+ * Description: Take and give back part of cachePinBudget, waiting until enough
+ *              of it is free
+ */
+
+void cacheReserve( int count )
+{
+	if( cacheSize == 0 )
+		return;
+
+	pthread_mutex_lock( &cacheLock );
+	while( cachePinBudget < count )
+		pthread_cond_wait( &pinCond, &cacheLock );
+	cachePinBudget -= count;
+	pthread_mutex_unlock( &cacheLock );
+	return;
+}
+
+void cacheRelease( int count )
+{
+	if( cacheSize == 0 )
+		return;
+
+	pthread_mutex_lock( &cacheLock );
+	cachePinBudget += count;
+	pthread_cond_broadcast( &pinCond );
+	pthread_mutex_unlock( &cacheLock );
+	return;
+}
+
+
+/*
+ * Function: cacheShutdown
+ * Parameter: none
+ * Returns: none
+ * Description: Stops the flusher and writes back whatever is still dirty
+ */
+
+void cacheShutdown( void )
+{
+	if( cacheSize == 0 )
+		return;
+
+	pthread_mutex_lock( &cacheLock );
+	flusherRunning = 0;
+	pthread_cond_signal( &flushCond );
+	pthread_mutex_unlock( &cacheLock );
+	pthread_join( flusher, NULL );
+
+	pthread_mutex_lock( &cacheLock );
+	cacheFlush();
+	pthread_mutex_unlock( &cacheLock );
+	return;
+}
+
+
+/*
+ * Function: cacheStat
+ * Parameter: none
+ * Returns: none
+ * Description: Prints the cache size, hit ratio and eviction and write-back counts
+ */
+
+void cacheStat( void )
+{
+	long long lookups;
+
+	if( cacheSize == 0 )
+	{
+		printf( "No buffer cache, the image is mapped directly\n" );
+		return;
+	}
+
+	pthread_mutex_lock( &cacheLock );
+	lookups = cacheStats.hits + cacheStats.misses;
+	printf( "cache:      %d blocks (%lld KiB), %d dirty\n", cacheSize, (long long)cacheSize * blockSize / 1024, cacheDirty );
+	printf( "lookups:    %lld hits, %lld misses, %.1f%% hit ratio\n", cacheStats.hits, cacheStats.misses,
+	        lookups ? 100.0 * cacheStats.hits / lookups : 0.0 );
+	printf( "readahead:  %lld blocks\n", cacheStats.readahead );
+	printf( "evictions:  %lld (%lld written back on eviction)\n", cacheStats.evictions, cacheStats.writebacks );
+	printf( "flusher:    %lld blocks written back\n", cacheStats.flushed );
+	pthread_mutex_unlock( &cacheLock );
+	return;
+}
+
+
+/*
+ * Function: addExtent
+ * Parameters: fileNum - The directory entry to extend
+ *             start, length - The run of blocks to add to the end of the file
+ * Returns: 0 on success, -1 if an indirect block was needed and none was free
+ * Description: Appends a run of blocks to a file.  A run that carries straight on
+ *              from the file's last extent is merged into it (unless the file is
+ *              compressed), otherwise it goes in
+ *              the directory entry or, once those are full, the last indirect block
+ */
+
+int addExtent( int fileNum, int start, int length )
+{
+	fileInfoStruct *file = &fileInfo[fileNum];
+	indirectBlock *ind = NULL;
+	indirectBlock *newInd;
+	extent *last = NULL;
+	int block;
+
+	journalDirty( file, sizeof( fileInfoStruct ) );
+
+	// Find the file's current last extent, pinning its indirect block if it has one
+	if( file->numExtents > 0 && file->numExtents <= NUM_EXTENTS )
+		last = &file->extents[file->numExtents - 1];
+	else if( file->numExtents > NUM_EXTENTS )
+	{
+		ind = (indirectBlock *)blockGet( file->lastIndirect, BLOCK_READ );
+		if( ind == NULL )
+			return -1;
+		last = &ind->extents[ind->count - 1];
+	}
+
+	// Merge runs that continue the last extent.  Each chunk of a compressed file
+	// has to stay an extent of its own
+	if( last != NULL && last->start + last->length == start && !( file->flags & FILE_COMPRESSED ) )
+	{
+		last->length += length;
+		if( ind != NULL )
+			blockPut( file->lastIndirect, 1 );
+		return 0;
+	}
+
+	// Room in the directory entry
+	if( file->numExtents < NUM_EXTENTS )
+	{
+		file->extents[file->numExtents].start = start;
+		file->extents[file->numExtents].length = length;
+		file->numExtents++;
+		return 0;
+	}
+
+	// Chain on a new indirect block if there isn't one or the last one is full
+	if( ind == NULL || ind->count == EXTENTS_PER_BLOCK )
+	{
+		block = bitmapAlloc( &arrayStatus );
+		newInd = block == -1 ? NULL : (indirectBlock *)blockGet( block, BLOCK_OVERWRITE );
+		if( newInd == NULL )
+		{
+			if( block != -1 )
+				bitmapFree( &arrayStatus, block, 1 );
+			if( ind != NULL )
+				blockPut( file->lastIndirect, 0 );
+			return -1;
+		}
+		newInd->next = -1;
+		newInd->count = 0;
+		if( ind == NULL )
+			file->indirect = block;
+		else
+		{
+			ind->next = block;
+			blockPut( file->lastIndirect, 1 );
+		}
+		file->lastIndirect = block;
+		ind = newInd;
+	}
+
+	ind->extents[ind->count].start = start;
+	ind->extents[ind->count].length = length;
+	ind->count++;
+	blockPut( file->lastIndirect, 1 );
+	file->numExtents++;
+	return 0;
+}
+
+
+/*
+ * Function: extentOpen / extentNext / extentClose
+ * Parameters: cursor - Iteration state
+ *             fileNum - The directory entry to walk
+ * Returns: extentNext returns the next extent of the file, or NULL at the end
+ * Description: Walks a file's extents in order, first the ones in the directory
+ *              entry and then along the chain of indirect blocks.  The indirect
+ *              block being walked stays pinned until the cursor moves past it or
+ *              is closed; set cursor->dirty after changing an extent in it
+ */
+
+typedef struct
+{
+	fileInfoStruct *file;
+	int n;
+	int block;
+	int pos;
+	indirectBlock *ind;
+	int dirty;
+} extentCursor;
+
+void extentOpen( extentCursor *cursor, int fileNum )
+{
+	cursor->file = &fileInfo[fileNum];
+	cursor->n = 0;
+	cursor->block = cursor->file->indirect;
+	cursor->pos = 0;
+	cursor->ind = NULL;
+	cursor->dirty = 0;
+	return;
+}
+
+extent *extentNext( extentCursor *cursor )
+{
+	int next;
+
+	if( cursor->n >= cursor->file->numExtents )
+		return NULL;
+
+	if( cursor->n < NUM_EXTENTS )
+		return &cursor->file->extents[cursor->n++];
+
+	// Pin the first indirect block, or move on to the next once we've used this one up
+	if( cursor->ind == NULL )
+		cursor->ind = (indirectBlock *)blockGet( cursor->block, BLOCK_READ );
+	else if( cursor->pos == cursor->ind->count )
+	{
+		next = cursor->ind->next;
+		blockPut( cursor->block, cursor->dirty );
+		cursor->block = next;
+		cursor->pos = 0;
+		cursor->dirty = 0;
+		cursor->ind = (indirectBlock *)blockGet( cursor->block, BLOCK_READ );
+	}
+	if( cursor->ind == NULL )
+		return NULL;
+
+	cursor->n++;
+	return &cursor->ind->extents[cursor->pos++];
+}
+
+void extentClose( extentCursor *cursor )
+{
+	if( cursor->ind != NULL )
+		blockPut( cursor->block, cursor->dirty );
+	cursor->ind = NULL;
+	return;
+}
+
+
+/*
+ * Function: blockFingerprint
+ * Parameter: data - One block of data
+ * Returns: A non-zero 64-bit fingerprint of the block
+ * Description: Multiply/rotate hash over four 64-bit lanes in the style of xxHash,
+ *              fast enough to run over every block a dedup put writes.  Zero is
+ *              reserved to mean "no fingerprint"
+ */
+
+uint64_t blockFingerprint( const unsigned char *data )
+{
+	const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+	const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+	uint64_t lane[4] = { prime1 + prime2, prime2, 0, -prime1 };
+	uint64_t word, hash;
+	int i, j;
+
+	for( i = 0; i < blockSize; i += 32 )
+	{
+		for( j = 0; j < 4; j++ )
+		{
+			memcpy( &word, data + i + j * 8, sizeof( word ) );
+			lane[j] += word * prime2;
+			lane[j] = ( lane[j] << 31 ) | ( lane[j] >> 33 );
+			lane[j] *= prime1;
+		}
+	}
+
+	hash = ( ( lane[0] << 1 ) | ( lane[0] >> 63 ) ) + ( ( lane[1] << 7 ) | ( lane[1] >> 57 ) ) +
+	       ( ( lane[2] << 12 ) | ( lane[2] >> 52 ) ) + ( ( lane[3] << 18 ) | ( lane[3] >> 46 ) );
+	hash ^= hash >> 33;
+	hash *= prime2;
+	hash ^= hash >> 29;
+	return hash == 0 ? 1 : hash;
+}
+
+
+/*
+ * Function: fpLookup
+ * Parameters: fp - The fingerprint of data
+ *             data - The block we want to store
+ * Returns: A block already holding exactly this data, or -1
+ * Description: Probes the fingerprint index and compares the bytes of every block
+ *              with a matching fingerprint, so a hash collision can never make two
+ *              different blocks share storage
+ */
+
+int fpLookup( uint64_t fp, const unsigned char *data )
+{
+	unsigned int pos = (unsigned int)fp & fpMask;
+	unsigned char *stored;
+	int block, same;
+
+	while( fpIndex[pos] != 0 )
+	{
+		block = fpIndex[pos] - 1;
+		if( fingerprints[block] == fp )
+		{
+			stored = blockGet( block, BLOCK_READ );
+			same = stored != NULL && memcmp( stored, data, blockSize ) == 0;
+			if( stored != NULL )
+				blockPut( block, 0 );
+			if( same )
+				return block;
+		}
+		pos = ( pos + 1 ) & fpMask;
+	}
+	return -1;
+}
+
+
+/*
+ * Function: fpInsert / fpRemove
+ * Parameter: block - A block whose fingerprints[] entry is set
+ * Returns: none
+ * Description: Add a block to the fingerprint index, or take it out with the same
+ *              backward shift delete that dirRemove uses
+ */
+
+void fpInsert( int block )
+{
+	unsigned int pos = (unsigned int)fingerprints[block] & fpMask;
+
+	while( fpIndex[pos] != 0 )
+		pos = ( pos + 1 ) & fpMask;
+	fpIndex[pos] = block + 1;
+	journalDirty( &fpIndex[pos], sizeof( int ) );
+	journalDirty( &fingerprints[block], sizeof( uint64_t ) );
+	return;
+}
+
+void fpRemove( int block )
+{
+	unsigned int pos = (unsigned int)fingerprints[block] & fpMask;
+	unsigned int next, home;
+
+	while( fpIndex[pos] != block + 1 )
+		pos = ( pos + 1 ) & fpMask;
+	fpIndex[pos] = 0;
+	journalDirty( &fpIndex[pos], sizeof( int ) );
+
+	next = ( pos + 1 ) & fpMask;
+	while( fpIndex[next] != 0 )
+	{
+		home = (unsigned int)fingerprints[fpIndex[next] - 1] & fpMask;
+		if( ( ( next - home ) & fpMask ) >= ( ( next - pos ) & fpMask ) )
+		{
+			fpIndex[pos] = fpIndex[next];
+			fpIndex[next] = 0;
+			journalDirty( &fpIndex[pos], sizeof( int ) );
+			journalDirty( &fpIndex[next], sizeof( int ) );
+			pos = next;
+		}
+		next = ( next + 1 ) & fpMask;
+	}
+	return;
+}
+
+
+/*
+ * Function: dedupRelease
+ * Parameter: block - A block referenced by a dedup file
+ * Returns: none
+ * Description: Drops one reference to the block, and frees it and forgets its
+ *              fingerprint once nothing points at it any more
+ */
+
+void dedupRelease( int block )
+{
+	journalDirty( &refCount[block], sizeof( unsigned int ) );
+	journalDirty( &fingerprints[block], sizeof( uint64_t ) );
+	if( refCount[block] > 1 )
+	{
+		refCount[block]--;
+		sb->sharedBlocks--;
+		return;
+	}
+
+	if( fingerprints[block] != 0 )
+	{
+		fpRemove( block );
+		fingerprints[block] = 0;
+	}
+	refCount[block] = 0;
+	blockRelease( block, 1 );
+	return;
+}
+
+
+/*
+ * Function: dedupPut
+ * Parameters: fd - The host file being put
+ *             fileNum - Its directory entry, with no extents yet
+ *             size - How many bytes to read
+ * Returns: 0 on success, -1 if we ran out of space or hit a read error
+ * Description: Reads the file a chunk at a time and fingerprints each block.  A
+ *              block whose contents are already stored just takes another
+ *              reference; anything new gets a fresh block and goes in the index.
+ *              On failure the caller deletes the file, which releases whatever
+ *              references were taken
+ */
+
+int dedupPut( int fd, int fileNum, long long size )
+{
+	const int chunkBlocks = 256;
+	unsigned char *chunk, *data;
+	long long offset = 0;
+	ssize_t got, n;
+	uint64_t fp;
+	int i, block, numBlocks;
+	int status = 0;
+	long long allocStart;
+
+	chunk = malloc( (size_t)chunkBlocks * blockSize );
+	if( chunk == NULL )
+		return -1;
+	fileInfo[fileNum].flags |= FILE_DEDUP;
+
+	while( offset < size && status == 0 )
+	{
+		// Fill the chunk, zero padding the end of the last block
+		got = 0;
+		while( got < (ssize_t)chunkBlocks * blockSize && offset + got < size )
+		{
+			n = pread( fd, chunk + got, (size_t)chunkBlocks * blockSize - got, offset + got );
+			if( n == -1 && errno == EINTR )
+				continue;
+			if( n <= 0 )
+				break;
+			got += n;
+		}
+		if( got == 0 )
+		{
+			status = -1;
+			break;
+		}
+		numBlocks = ( got + blockSize - 1 ) / blockSize;
+		memset( chunk + got, 0, (size_t)numBlocks * blockSize - got );
+
+		for( i = 0; i < numBlocks; i++ )
+		{
+			data = chunk + (size_t)i * blockSize;
+			fp = blockFingerprint( data );
+			pthread_mutex_lock( &dedupLock );
+			block = fpLookup( fp, data );
+
+			if( block != -1 )
+			{
+				// Same contents are already stored, just share them
+				refCount[block]++;
+				journalDirty( &refCount[block], sizeof( unsigned int ) );
+				sb->sharedBlocks++;
+			}
+			else
+			{
+				// New contents, store them and remember the fingerprint
+				allocStart = allocTiming ? nowNsec() : 0;
+				block = bitmapAlloc( &arrayStatus );
+				if( allocTiming )
+					allocCharge( allocStart );
+				if( block == -1 )
+				{
+					pthread_mutex_unlock( &dedupLock );
+					status = -1;
+					break;
+				}
+
+				// The contents go in before the fingerprint is published, so anyone
+				// matching it can compare against them
+				unsigned char *dest = blockGet( block, BLOCK_OVERWRITE );
+				if( dest == NULL )
+				{
+					bitmapFree( &arrayStatus, block, 1 );
+					pthread_mutex_unlock( &dedupLock );
+					status = -1;
+					break;
+				}
+				memcpy( dest, data, blockSize );
+				blockPut( block, 1 );
+
+				refCount[block] = 1;
+				journalDirty( &refCount[block], sizeof( unsigned int ) );
+				fingerprints[block] = fp;
+				fpInsert( block );
+			}
+			pthread_mutex_unlock( &dedupLock );
+
+			if( addExtent( fileNum, block, 1 ) == -1 )
+			{
+				pthread_mutex_lock( &dedupLock );
+				dedupRelease( block );
+				pthread_mutex_unlock( &dedupLock );
+				status = -1;
+				break;
+			}
+		}
+		offset += got;
+	}
+
+	free( chunk );
+	return status;
+}
+
+
+/*
+ * Function: lzCompress
+ * Parameters: src, srcLen - The data to compress
+ *             dst, dstCap - Where to put the result and how much room there is
+ * Returns: The compressed length, or -1 if it wouldn't fit in dstCap
+ * Description: Small LZ77 codec in the LZ4 block style.  Each sequence is a token
+ *              byte (literal count in the high nibble, match length - 4 in the low
+ *              nibble, 15 meaning more length bytes follow), the literals, then a
+ *              two byte offset back into the output.  The last sequence is just
+ *              literals.  Matches are found with a hash of the next four bytes
+ */
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+
+int lzPutLength( unsigned char *dst, int pos, int dstCap, int length )
+{
+	while( length >= 255 )
+	{
+		if( pos >= dstCap )
+			return -1;
+		dst[pos++] = 255;
+		length -= 255;
+	}
+	if( pos >= dstCap )
+		return -1;
+	dst[pos++] = length;
+	return pos;
+}
+
+int lzEmit( unsigned char *dst, int pos, int dstCap, const unsigned char *literals, int litLen, int offset, int matchLen )
+{
+	int token = ( litLen < 15 ? litLen : 15 ) << 4;
+
+	if( offset > 0 )
+		token |= matchLen - LZ_MIN_MATCH < 15 ? matchLen - LZ_MIN_MATCH : 15;
+	if( pos >= dstCap )
+		return -1;
+	dst[pos++] = token;
+
+	if( litLen >= 15 && ( pos = lzPutLength( dst, pos, dstCap, litLen - 15 ) ) == -1 )
+		return -1;
+	if( pos + litLen > dstCap )
+		return -1;
+	memcpy( dst + pos, literals, litLen );
+	pos += litLen;
+
+	// The final literal-only sequence has no match part
+	if( offset == 0 )
+		return pos;
+
+	if( pos + 2 > dstCap )
+		return -1;
+	dst[pos++] = offset & 0xff;
+	dst[pos++] = offset >> 8;
+	if( matchLen - LZ_MIN_MATCH >= 15 )
+		pos = lzPutLength( dst, pos, dstCap, matchLen - LZ_MIN_MATCH - 15 );
+	return pos;
+}
+
+int lzCompress( const unsigned char *src, int srcLen, unsigned char *dst, int dstCap )
+{
+	int table[1 << LZ_HASH_BITS];
+	int ip = 0;
+	int anchor = 0;
+	int pos = 0;
+	int ref, matchLen;
+	uint32_t seq, refSeq, hash;
+
+	memset( table, -1, sizeof( table ) );
+
+	while( ip + LZ_MIN_MATCH <= srcLen )
+	{
+		memcpy( &seq, src + ip, 4 );
+		hash = ( seq * 2654435761u ) >> ( 32 - LZ_HASH_BITS );
+		ref = table[hash];
+		table[hash] = ip;
+
+		if( ref >= 0 && ip - ref <= 65535 )
+		{
+			memcpy( &refSeq, src + ref, 4 );
+			if( refSeq == seq )
+			{
+				// Extend the match as far as it goes
+				matchLen = LZ_MIN_MATCH;
+				while( ip + matchLen < srcLen && src[ref + matchLen] == src[ip + matchLen] )
+					matchLen++;
+
+				pos = lzEmit( dst, pos, dstCap, src + anchor, ip - anchor, ip - ref, matchLen );
+				if( pos == -1 )
+					return -1;
+				ip += matchLen;
+				anchor = ip;
+				continue;
+			}
+		}
+		ip++;
+	}
+
+	return lzEmit( dst, pos, dstCap, src + anchor, srcLen - anchor, 0, 0 );
+}
+
+
+/*
+ * Function: lzDecompress
+ * Parameters: src, srcLen - Compressed data from lzCompress
+ *             dst, dstLen - Where to put the result and how big it should be
+ * Returns: The number of bytes produced, or -1 if the input is corrupt
+ * Description: Replays the sequences, checking every length and offset against
+ *              the buffers so a damaged block can't write out of bounds
+ */
+
+int lzDecompress( const unsigned char *src, int srcLen, unsigned char *dst, int dstLen )
+{
+	int ip = 0;
+	int op = 0;
+	int token, litLen, matchLen, offset, extra;
+
+	while( ip < srcLen )
+	{
+		token = src[ip++];
+
+		// Literals
+		litLen = token >> 4;
+		if( litLen == 15 )
+		{
+			do
+			{
+				if( ip >= srcLen )
+					return -1;
+				extra = src[ip++];
+				litLen += extra;
+			} while( extra == 255 );
+		}
+		if( ip + litLen > srcLen || op + litLen > dstLen )
+			return -1;
+		memcpy( dst + op, src + ip, litLen );
+		ip += litLen;
+		op += litLen;
+
+		// The last sequence ends with its literals
+		if( ip == srcLen )
+			break;
+
+		// Match, which may overlap the bytes it is copying so go a byte at a time
+		if( ip + 2 > srcLen )
+			return -1;
+		offset = src[ip] | ( src[ip + 1] << 8 );
+		ip += 2;
+		matchLen = ( token & 15 ) + LZ_MIN_MATCH;
+		if( ( token & 15 ) == 15 )
+		{
+			do
+			{
+				if( ip >= srcLen )
+					return -1;
+				extra = src[ip++];
+				matchLen += extra;
+			} while( extra == 255 );
+		}
+		if( offset == 0 || offset > op || op + matchLen > dstLen )
+			return -1;
+		while( matchLen-- > 0 )
+		{
+			dst[op] = dst[op - offset];
+			op++;
+		}
+	}
+	return op;
+}
+
+
+/*
+ * Function: compressPut
+ * Parameters: fd - The host file being put
+ *             fileNum - Its directory entry, with no blocks yet
+ *             size - How much of the host file to store
+ * Returns: 0 on success, 1 if free space is too fragmented for a chunk, or -1
+ *          if the file couldn't be read or stored
+ * Description: Reads the file a chunk at a time and compresses each chunk into an
+ *              extent of its own.  Compressed chunks need a contiguous run, which
+ *              is never longer than the chunk itself.  When there isn't one the
+ *              blocks taken so far are given back and the entry left empty, for
+ *              the caller to store the file uncompressed instead.  Nothing the
+ *              file holds has been committed yet, so they go straight back to
+ *              the bitmap
+ */
+
+int compressPut( int fd, int fileNum, long long size )
+{
+	int chunkBlocks = COMPRESS_CHUNK > blockSize ? COMPRESS_CHUNK / blockSize : 1;
+	int chunkBytes = chunkBlocks * blockSize;
+	unsigned char *chunk, *packed, *stored, *dest;
+	long long offset = 0;
+	struct timeval start;
+	extentCursor cursor;
+	extent *ext;
+	ssize_t n;
+	uint32_t header;
+	int i, got, block, next, run, length, storedLength, numBlocks, packedLength;
+	int status = 0;
+	long long allocStart;
+
+	chunk = malloc( chunkBytes );
+	packed = malloc( chunkBytes );
+	if( chunk == NULL || packed == NULL )
+	{
+		free( chunk );
+		free( packed );
+		return -1;
+	}
+	fileInfo[fileNum].flags |= FILE_COMPRESSED;
+	fileInfo[fileNum].storedSize = 0;
+
+	while( offset < size && status == 0 )
+	{
+		length = size - offset < chunkBytes ? size - offset : chunkBytes;
+		got = 0;
+		while( got < length )
+		{
+			n = pread( fd, chunk + got, length - got, offset + got );
+			if( n == -1 && errno == EINTR )
+				continue;
+			if( n <= 0 )
+				break;
+			got += n;
+		}
+		if( got < length )
+		{
+			status = -1;
+			break;
+		}
+		numBlocks = ( length + blockSize - 1 ) / blockSize;
+
+		// Keep the compressed copy only if it saves at least a block
+		gettimeofday( &start, NULL );
+		packedLength = lzCompress( chunk, length, packed + sizeof( header ), chunkBytes - sizeof( header ) );
+		__atomic_add_fetch( &compressStats.compressUsec, elapsedUsec( &start ), __ATOMIC_RELAXED );
+		__atomic_add_fetch( &compressStats.compressBytes, length, __ATOMIC_RELAXED );
+		if( packedLength != -1 &&
+		    ( packedLength + (int)sizeof( header ) + blockSize - 1 ) / blockSize < numBlocks )
+		{
+			header = packedLength;
+			memcpy( packed, &header, sizeof( header ) );
+			stored = packed;
+			storedLength = packedLength + sizeof( header );
+		}
+		else
+		{
+			stored = chunk;
+			storedLength = length;
+		}
+		run = ( storedLength + blockSize - 1 ) / blockSize;
+
+		allocStart = allocTiming ? nowNsec() : 0;
+		block = bitmapAllocRun( &arrayStatus, run, &got );
+		if( allocTiming )
+			allocCharge( allocStart );
+		if( block != -1 && got < run )
+		{
+			bitmapFree( &arrayStatus, block, got );
+			status = 1;
+			break;
+		}
+		if( block == -1 || addExtent( fileNum, block, run ) == -1 )
+		{
+			if( block != -1 )
+				bitmapFree( &arrayStatus, block, run );
+			status = -1;
+			break;
+		}
+
+		for( i = 0; i < run; i++ )
+		{
+			dest = blockGet( block + i, BLOCK_OVERWRITE );
+			if( dest == NULL )
+			{
+				status = -1;
+				break;
+			}
+			n = storedLength - i * blockSize < blockSize ? storedLength - i * blockSize : blockSize;
+			memcpy( dest, stored + (size_t)i * blockSize, n );
+			memset( dest + n, 0, blockSize - n );
+			blockPut( block + i, 1 );
+		}
+		fileInfo[fileNum].storedSize += storedLength;
+		offset += length;
+	}
+
+	if( status == 1 )
+	{
+		extentOpen( &cursor, fileNum );
+		while( ( ext = extentNext( &cursor ) ) != NULL )
+			bitmapFree( &arrayStatus, ext->start, ext->length );
+		extentClose( &cursor );
+		for( block = fileInfo[fileNum].indirect; block != -1; block = next )
+		{
+			dest = blockGet( block, BLOCK_READ );
+			next = dest == NULL ? -1 : ( (indirectBlock *)dest )->next;
+			if( dest != NULL )
+				blockPut( block, 0 );
+			bitmapFree( &arrayStatus, block, 1 );
+		}
+		fileInfo[fileNum].numExtents = 0;
+		fileInfo[fileNum].indirect = -1;
+		fileInfo[fileNum].lastIndirect = -1;
+		fileInfo[fileNum].flags &= ~FILE_COMPRESSED;
+		fileInfo[fileNum].storedSize = size;
+	}
+
+	free( chunk );
+	free( packed );
+	return status;
+}
+
+
+/*
+ * Function: decompressWorker
+ * Parameter: arg - The decompressJob for the file being read
+ * Returns: none
+ * Description: Pool job for decompressGet.  Takes chunks off the shared counter
+ *              until there are none left, decompressing each one and writing it
+ *              to its place in the output file
+ */
+
+typedef struct
+{
+	extent *chunks;
+	int numChunks;
+	int chunkBytes;
+	long long size;
+	int fd;
+	int next;
+	int error;
+	pthread_mutex_t lock;
+} decompressJob;
+
+void decompressWorker( void *arg )
+{
+	decompressJob *job = arg;
+	unsigned char *in, *out, *data, *src;
+	uint32_t header;
+	ssize_t n;
+	long long offset;
+	int i, b, length, numBlocks, written;
+
+	in = malloc( job->chunkBytes );
+	out = malloc( job->chunkBytes );
+
+	while( in != NULL && out != NULL )
+	{
+		pthread_mutex_lock( &job->lock );
+		i = job->error ? job->numChunks : job->next++;
+		pthread_mutex_unlock( &job->lock );
+		if( i >= job->numChunks )
+			break;
+
+		offset = (long long)i * job->chunkBytes;
+		length = job->size - offset < job->chunkBytes ? job->size - offset : job->chunkBytes;
+		numBlocks = ( length + blockSize - 1 ) / blockSize;
+
+		// A mapped image already has the chunk in one piece, through the cache it
+		// has to be gathered a block at a time
+		if( cacheSize == 0 )
+			data = BLOCK( job->chunks[i].start );
+		else
+		{
+			for( b = 0; b < job->chunks[i].length; b++ )
+			{
+				src = blockGet( job->chunks[i].start + b, BLOCK_READ );
+				if( src == NULL )
+					break;
+				memcpy( in + (size_t)b * blockSize, src, blockSize );
+				blockPut( job->chunks[i].start + b, 0 );
+			}
+			data = b == job->chunks[i].length ? in : NULL;
+		}
+
+		// A chunk stored as is takes every block of the chunk
+		if( data != NULL && job->chunks[i].length < numBlocks )
+		{
+			memcpy( &header, data, sizeof( header ) );
+			if( header + sizeof( header ) > (size_t)job->chunks[i].length * blockSize ||
+			    lzDecompress( data + sizeof( header ), header, out, length ) != length )
+				data = NULL;
+			else
+				data = out;
+		}
+
+		for( written = 0; data != NULL && written < length; written += n )
+		{
+			n = pwrite( job->fd, data + written, length - written, offset + written );
+			if( n == -1 && errno == EINTR )
+				n = 0;
+			else if( n <= 0 )
+				data = NULL;
+		}
+
+		if( data == NULL )
+		{
+			pthread_mutex_lock( &job->lock );
+			job->error = 1;
+			pthread_mutex_unlock( &job->lock );
+		}
+	}
+
+	if( in == NULL || out == NULL )
+	{
+		pthread_mutex_lock( &job->lock );
+		job->error = 1;
+		pthread_mutex_unlock( &job->lock );
+	}
+	free( in );
+	free( out );
+	return;
+}
+
+
+/*
+ * Function: decompressGet
+ * Parameters: fd - The host file to write
+ *             fileNum - The compressed file to read
+ * Returns: 0 on success, -1 on a corrupt chunk or an I/O error
+ * Description: Collects the file's chunks, one per extent, then has the thread
+ *              pool decompress them in parallel
+ */
+
+int decompressGet( int fd, int fileNum )
+{
+	decompressJob job;
+	extentCursor cursor;
+	extent *ext;
+	struct timeval start;
+	int i = 0;
+
+	job.chunkBytes = COMPRESS_CHUNK > blockSize ? COMPRESS_CHUNK / blockSize * blockSize : blockSize;
+	job.numChunks = fileInfo[fileNum].numExtents;
+	job.chunks = malloc( ( job.numChunks + 1 ) * sizeof( extent ) );
+	if( job.chunks == NULL )
+		return -1;
+
+	extentOpen( &cursor, fileNum );
+	while( ( ext = extentNext( &cursor ) ) != NULL )
+		job.chunks[i++] = *ext;
+	extentClose( &cursor );
+
+	job.numChunks = i;
+	job.size = fileInfo[fileNum].size;
+	job.fd = fd;
+	job.next = 0;
+	job.error = 0;
+	pthread_mutex_init( &job.lock, NULL );
+
+	gettimeofday( &start, NULL );
+	poolRun( decompressWorker, &job );
+	__atomic_add_fetch( &compressStats.decompressUsec, elapsedUsec( &start ), __ATOMIC_RELAXED );
+	__atomic_add_fetch( &compressStats.decompressBytes, job.size, __ATOMIC_RELAXED );
+
+	pthread_mutex_destroy( &job.lock );
+	free( job.chunks );
+	if( job.error )
+		errno = EIO;
+	return job.error ? -1 : 0;
+}
+
+
+/*
+ * Function: freeIndirect
+ * Parameters: block - The first indirect block of a file, or -1
+ *             numExtents - How many extents the file has
+ * Returns: none
+ * Description: Releases a file's chain of indirect blocks.  Only as many blocks
+ *              are followed as the extents need; after a crash the chain can
+ *              run on into blocks that were never committed
+ */
+
+void freeIndirect( int block, int numExtents )
+{
+	indirectBlock *ind;
+	int next;
+	int remaining = numExtents - NUM_EXTENTS;
+
+	for( ; block != -1 && remaining > 0; block = next )
+	{
+		ind = (indirectBlock *)blockGet( block, BLOCK_READ );
+		next = ind == NULL ? -1 : ind->next;
+		if( ind != NULL )
+		{
+			remaining -= ind->count;
+			blockPut( block, 0 );
+		}
+		blockRelease( block, 1 );
+	}
+	return;
+}
+
+
+/*
+ * Function: freeExtents
+ * Parameter: fileNum - The directory entry whose blocks should be released
+ * Returns: none
+ * Description: Frees every extent of a file and then the indirect blocks that
+ *              described them, leaving the entry with no blocks at all.  Blocks
+ *              of a dedup file are released one at a time since they may be shared
+ */
+
+void freeExtents( int fileNum )
+{
+	extentCursor cursor;
+	extent *ext;
+	int i;
+
+	extentOpen( &cursor, fileNum );
+	while( ( ext = extentNext( &cursor ) ) != NULL )
+	{
+		if( fileInfo[fileNum].flags & FILE_DEDUP )
+		{
+			pthread_mutex_lock( &dedupLock );
+			for( i = 0; i < ext->length; i++ )
+				dedupRelease( ext->start + i );
+			pthread_mutex_unlock( &dedupLock );
+		}
+		else
+			blockRelease( ext->start, ext->length );
+	}
+	extentClose( &cursor );
+	freeIndirect( fileInfo[fileNum].indirect, fileInfo[fileNum].numExtents );
+
+	journalDirty( &fileInfo[fileNum], sizeof( fileInfoStruct ) );
+	fileInfo[fileNum].numExtents = 0;
+	fileInfo[fileNum].indirect = -1;
+	fileInfo[fileNum].lastIndirect = -1;
+	return;
+}
+
+
+/*
+ * Function: copyRangeIO
+ * Parameters: fd - The host file
+ *             fileNum - The directory entry whose extents are being copied
+ *             size - How many bytes of the file to copy
+ *             toImage - 1 to copy the host file into the image, 0 to copy it out
+ * Returns: 0 on success, -1 with errno set on failure
+ * Description: Has the kernel copy each extent between the host file and the image
+ *              file with copy_file_range, so the data never comes up to user space.
+ *              Running out of source before size bytes is an I/O error, for
+ *              instance a host file truncated while it was being put
+ */
+
+int copyRangeIO( int fd, int fileNum, long long size, int toImage )
+{
+	extentCursor cursor;
+	extent *ext;
+	loff_t hostOffset = 0;
+	loff_t imageOffset;
+	long long length;
+	ssize_t done;
+
+	extentOpen( &cursor, fileNum );
+	while( size > 0 && ( ext = extentNext( &cursor ) ) != NULL )
+	{
+		length = (long long)ext->length * blockSize;
+		if( length > size )
+			length = size;
+		size -= length;
+
+		imageOffset = sb->dataOffset + (long long)ext->start * blockSize;
+		while( length > 0 )
+		{
+			if( toImage )
+				done = copy_file_range( fd, &hostOffset, imageFd, &imageOffset, length, 0 );
+			else
+				done = copy_file_range( imageFd, &imageOffset, fd, &hostOffset, length, 0 );
+			if( done == -1 && errno == EINTR )
+				continue;
+			if( done <= 0 )
+			{
+				extentClose( &cursor );
+				if( done == 0 )
+					errno = EIO;
+				return -1;
+			}
+			length -= done;
+		}
+	}
+	extentClose( &cursor );
+	return 0;
+}
+
+
+/*
+ * Function: transferFile
+ * Parameters: fd - The host file
+ *             fileNum - The directory entry whose extents hold the data
+ *             size - How many bytes of the file to move
+ *             toImage - 1 for put, 0 for get
+ * Returns: 0 on success, -1 on an I/O error
+ * Description: Moves a whole file between the host and the image in as few system
+ *              calls as possible.  copy_file_range is tried first when selected;
+ *              if the kernel won't do it for this pair of files we fall back to
+ *              vectored I/O from then on.  Vectored I/O gathers the file's blocks
+ *              into batches, merging blocks that sit next to each other in memory,
+ *              so a mapped image moves a whole extent per iovec.  With a buffer
+ *              cache each batch stays pinned until its system call is done, and get
+ *              reads each extent ahead into the cache
+ */
+
+int transferFile( int fd, int fileNum, long long size, int toImage )
+{
+	struct iovec iov[IOV_BATCH];
+	int pinned[IOV_BATCH];
+	extentCursor cursor;
+	extent *ext;
+	unsigned char *data;
+	off_t offset = 0;
+	long long length;
+	long long batchBytes = 0;
+	int count = 0;
+	int numPinned = 0;
+	int batchLimit = IOV_BATCH;
+	int status = 0;
+	int i, j;
+
+	if( ioMode == IO_COPY_RANGE )
+	{
+		if( copyRangeIO( fd, fileNum, size, toImage ) == 0 )
+			return 0;
+		if( errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP )
+			return -1;
+		ioMode = IO_VECTOR;
+	}
+
+	// Pin at most a quarter of the cache at once, the same as the readahead window
+	if( cacheSize > 0 && cacheSize / 4 < batchLimit )
+		batchLimit = cacheSize / 4 > 0 ? cacheSize / 4 : 1;
+	cacheReserve( batchLimit );
+
+	extentOpen( &cursor, fileNum );
+	while( size > 0 && status == 0 && ( ext = extentNext( &cursor ) ) != NULL )
+	{
+		for( i = 0; i < ext->length && size > 0; i++ )
+		{
+			// Read the rest of the extent ahead before we start on it
+			if( !toImage && i % batchLimit == 0 )
+				cacheReadahead( ext->start + i, ext->length - i );
+
+			data = blockGet( ext->start + i, toImage ? BLOCK_OVERWRITE : BLOCK_READ );
+			if( data == NULL )
+			{
+				status = -1;
+				break;
+			}
+			if( cacheSize > 0 )
+				pinned[numPinned++] = ext->start + i;
+
+			length = size < blockSize ? size : blockSize;
+			size -= length;
+
+			// Grow the last iovec if this block follows on from it in memory
+			if( count > 0 && (unsigned char *)iov[count - 1].iov_base + iov[count - 1].iov_len == data )
+				iov[count - 1].iov_len += length;
+			else
+			{
+				iov[count].iov_base = data;
+				iov[count].iov_len = length;
+				count++;
+			}
+			batchBytes += length;
+
+			// Send the batch when it's full or we've reached the end of the file
+			if( count == IOV_BATCH || numPinned == batchLimit || size == 0 )
+			{
+				if( vectorIO( fd, iov, count, offset, toImage ) == -1 )
+					status = -1;
+				for( j = 0; j < numPinned; j++ )
+					blockPut( pinned[j], toImage );
+				offset += batchBytes;
+				batchBytes = 0;
+				count = 0;
+				numPinned = 0;
+				if( status == -1 )
+					break;
+			}
+		}
+	}
+	extentClose( &cursor );
+
+	// Let go of anything still pinned if we stopped early
+	for( j = 0; j < numPinned; j++ )
+		blockPut( pinned[j], 0 );
+	cacheRelease( batchLimit );
+	return status;
+}
+
+
+/*
+ * Function: flushImage
+ * Parameter: none
+ * Returns: none
+ * Description: Writes the in-memory counters back to the superblock, writes back
+ *              any dirty cache buffers and flushes everything to the image file
+ */
+
+void flushImage( void )
+{
+	sb->freeBlocks = arrayStatus.freeBlocks;
+	sb->hint = arrayStatus.hint;
+
+	if( imageFd == -1 )
+		return;
+
+	if( cacheSize > 0 )
+	{
+		pthread_mutex_lock( &cacheLock );
+		cacheFlush();
+		pthread_mutex_unlock( &cacheLock );
+	}
+	if( msync( image, mapSize, MS_SYNC ) == -1 )
+		perror( "msync" );
+	if( cacheSize > 0 && fsync( imageFd ) == -1 )
+		perror( "fsync" );
+	return;
+}
+
+
+/*
+ * Function: journalTransactionPages
+ * Parameter: pages - How many pages of metadata could be dirty
+ * Returns: The journal space a transaction holding all of them takes
+ * Description: Descriptor pages, one page per page of metadata, and the commit
+ *              record
+ */
+
+int journalTransactionPages( int pages )
+{
+	return ( sizeof( journalHeader ) + pages * sizeof( int ) + JOURNAL_PAGE - 1 ) / JOURNAL_PAGE + pages + 1;
+}
+
+
+/*
+ * Function: journalChecksum
+ * Parameters: sum - The checksum so far
+ *             data, length - More bytes to fold in
+ * Returns: The updated checksum
+ * Description: FNV-1a over 64-bit words, enough to spot a transaction that was
+ *              only partly written when the system went down
+ */
+
+uint64_t journalChecksum( uint64_t sum, const unsigned char *data, size_t length )
+{
+	uint64_t word;
+	size_t i;
+
+	for( i = 0; i + sizeof( word ) <= length; i += sizeof( word ) )
+	{
+		memcpy( &word, data + i, sizeof( word ) );
+		sum = ( sum ^ word ) * 0x100000001b3ULL;
+	}
+	for( ; i < length; i++ )
+		sum = ( sum ^ data[i] ) * 0x100000001b3ULL;
+	return sum;
+}
+
+
+/*
+ * Function: journalWrite
+ * Parameters: data, length - What to write
+ *             offset - Where in the image file
+ * Returns: 0 on success, -1 on an I/O error
+ * Description: pwrite that carries on after short writes
+ */
+
+int journalWrite( const unsigned char *data, size_t length, off_t offset )
+{
+	ssize_t n;
+
+	while( length > 0 )
+	{
+		n = pwrite( imageFd, data, length, offset );
+		if( n == -1 && errno == EINTR )
+			continue;
+		if( n <= 0 )
+		{
+			perror( "journal write" );
+			return -1;
+		}
+		data += n;
+		length -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+
+/*
+ * Function: journalReset
+ * Parameter: none
+ * Returns: 0 on success, -1 on an I/O error
+ * Description: Writes the journal superblock, which says the next transaction to
+ *              expect is journalSequence, and empties the journal behind it.
+ *              Anything older still in the journal no longer matches
+ */
+
+int journalReset( void )
+{
+	static unsigned char page[JOURNAL_PAGE];
+	journalHeader *header = (journalHeader *)page;
+
+	header->magic = JOURNAL_MAGIC;
+	header->type = JOURNAL_SUPER;
+	header->sequence = journalSequence;
+	if( journalWrite( page, JOURNAL_PAGE, sb->journalOffset ) == -1 || fdatasync( imageFd ) == -1 )
+		return -1;
+	journalHead = 1;
+	return 0;
+}
+
+
+/*
+ * Function: journalCheckpoint
+ * Parameter: none
+ * Returns: 0 on success, -1 on an I/O error
+ * Description: Writes every page changed since the last checkpoint back to its
+ *              home in the image, then empties the journal.  Called straight
+ *              after a commit with journalHandles still held exclusively, so the
+ *              pages match what was just committed
+ */
+
+int journalCheckpoint( void )
+{
+	int page, run;
+
+	for( page = 0; page < metaPages; page += run )
+	{
+		// Write runs of consecutive pages with one call
+		run = 1;
+		if( !( checkpointPages[page / 64] & ( 1ULL << ( page % 64 ) ) ) )
+			continue;
+		while( page + run < metaPages && ( checkpointPages[( page + run ) / 64] & ( 1ULL << ( ( page + run ) % 64 ) ) ) )
+			run++;
+		if( journalWrite( image + (size_t)page * JOURNAL_PAGE, (size_t)run * JOURNAL_PAGE, (off_t)page * JOURNAL_PAGE ) == -1 )
+			return -1;
+	}
+	if( fdatasync( imageFd ) == -1 )
+	{
+		perror( "checkpoint" );
+		return -1;
+	}
+
+	memset( checkpointPages, 0, ( ( metaPages + 63 ) / 64 ) * sizeof( uint64_t ) );
+	journalStats.checkpoints++;
+	return journalReset();
+}
+
+
+/*
+ * Function: journalCommit
+ * Parameter: checkpoint - 1 to write everything home afterwards as well
+ * Returns: The sequence number of the transaction committed, or -1 if it couldn't
+ *          be written
+ * Description: Waits for the operations in progress, gathers the dirty pages into
+ *              a transaction and lets operations carry on while it is written
+ *              and synced.  Only one commit runs at a time, see journalWait.  If
+ *              the journal couldn't take another transaction as large as the
+ *              metadata this one becomes a checkpoint.  Data and indirect blocks
+ *              aren't logged, so they are synced before the transaction that
+ *              points at them is written.  A failed commit leaves the journal as
+ *              it was: its pages and frees go in the next one, under the same
+ *              sequence number
+ */
+
+long long journalCommit( int checkpoint )
+{
+	journalHeader *header;
+	int *pageList;
+	long long sequence;
+	uint64_t bits;
+	int i, w, count, descPages, total, freed, status;
+
+	pthread_rwlock_wrlock( &journalHandles );
+
+	// Frees are written into this transaction's bitmap pages, but put straight
+	// back in the live bitmap until it is durable.  Reserved runs are logged as
+	// free the same way
+	pthread_mutex_lock( &pendingLock );
+	commitFrees = pendingFrees;
+	numCommitFrees = numPendingFrees;
+	pendingFrees = NULL;
+	numPendingFrees = 0;
+	maxPendingFrees = 0;
+	pthread_mutex_unlock( &pendingLock );
+
+	freed = 0;
+	for( i = 0; i < numCommitFrees; i++ )
+	{
+		bitmapSetRange( &arrayStatus, commitFrees[i].start, commitFrees[i].length, 0 );
+		freed += commitFrees[i].length;
+	}
+	for( i = 0; i < numReservedRuns; i++ )
+	{
+		bitmapSetRange( &arrayStatus, reservedRuns[i].start, reservedRuns[i].length, 0 );
+		freed += reservedRuns[i].length;
+	}
+
+	// The superblock always goes, with the counters that are kept elsewhere
+	sb->freeBlocks = arrayStatus.freeBlocks + freed;
+	sb->hint = arrayStatus.hint;
+	dirtyPages[0] |= 1;
+
+	// List the dirty pages after the descriptor header
+	pageList = (int *)( journalBuffer + sizeof( journalHeader ) );
+	count = 0;
+	for( w = 0; w < ( metaPages + 63 ) / 64; w++ )
+	{
+		bits = dirtyPages[w];
+		dirtyPages[w] = 0;
+		checkpointPages[w] |= bits;
+		while( bits != 0 )
+		{
+			pageList[count++] = w * 64 + __builtin_ctzll( bits );
+			bits &= bits - 1;
+		}
+	}
+
+	descPages = ( sizeof( journalHeader ) + count * sizeof( int ) + JOURNAL_PAGE - 1 ) / JOURNAL_PAGE;
+	total = descPages + count + 1;
+	header = (journalHeader *)journalBuffer;
+	header->magic = JOURNAL_MAGIC;
+	header->type = JOURNAL_DESCRIPTOR;
+	header->sequence = journalSequence;
+	header->count = count;
+	memset( journalBuffer + sizeof( journalHeader ) + count * sizeof( int ), 0,
+	        descPages * JOURNAL_PAGE - sizeof( journalHeader ) - count * sizeof( int ) );
+	for( i = 0; i < count; i++ )
+		memcpy( journalBuffer + (size_t)( descPages + i ) * JOURNAL_PAGE, image + (size_t)pageList[i] * JOURNAL_PAGE, JOURNAL_PAGE );
+
+	for( i = 0; i < numCommitFrees; i++ )
+		bitmapSetRange( &arrayStatus, commitFrees[i].start, commitFrees[i].length, 1 );
+	for( i = 0; i < numReservedRuns; i++ )
+		bitmapSetRange( &arrayStatus, reservedRuns[i].start, reservedRuns[i].length, 1 );
+
+	header = (journalHeader *)( journalBuffer + (size_t)( total - 1 ) * JOURNAL_PAGE );
+	memset( header, 0, JOURNAL_PAGE );
+	header->magic = JOURNAL_MAGIC;
+	header->type = JOURNAL_COMMIT;
+	header->sequence = journalSequence;
+	header->count = count;
+	header->checksum = journalChecksum( 0xcbf29ce484222325ULL, journalBuffer, (size_t)( total - 1 ) * JOURNAL_PAGE );
+	sequence = journalSequence++;
+
+	if( journalHead + total + journalMaxTransaction > sb->journalPages )
+		checkpoint = 1;
+	if( !checkpoint )
+		pthread_rwlock_unlock( &journalHandles );
+
+	// Data and indirect blocks written by these operations have to be on disk
+	// before a transaction that refers to them can be replayed
+	if( cacheSize > 0 )
+	{
+		pthread_mutex_lock( &cacheLock );
+		cacheFlush();
+		pthread_mutex_unlock( &cacheLock );
+		status = fdatasync( imageFd );
+	}
+	else
+		status = msync( image + sb->journalOffset, mapSize - sb->journalOffset, MS_SYNC );
+	if( status == -1 )
+		perror( "journal commit" );
+	else if( journalWrite( journalBuffer, (size_t)total * JOURNAL_PAGE, sb->journalOffset + (off_t)journalHead * JOURNAL_PAGE ) == -1 )
+		status = -1;
+	else if( fdatasync( imageFd ) == -1 )
+	{
+		perror( "journal commit" );
+		status = -1;
+	}
+
+	if( status == -1 )
+	{
+		// Nothing after the last good transaction can be replayed, so this one
+		// is simply written again by the next commit
+		printf( "journal error: commit failed\n" );
+		if( !checkpoint )
+			pthread_rwlock_wrlock( &journalHandles );
+		for( i = 0; i < count; i++ )
+			dirtyPages[pageList[i] / 64] |= 1ULL << ( pageList[i] % 64 );
+		journalSequence = sequence;
+		for( i = 0; i < numCommitFrees; i++ )
+			blockRelease( commitFrees[i].start, commitFrees[i].length );
+		free( commitFrees );
+		commitFrees = NULL;
+		numCommitFrees = 0;
+		pthread_rwlock_unlock( &journalHandles );
+		return -1;
+	}
+	journalHead += total;
+	journalStats.commits++;
+	journalStats.pages += count;
+
+	// Durable now, so the freed blocks can be used again
+	for( i = 0; i < numCommitFrees; i++ )
+		bitmapFree( &arrayStatus, commitFrees[i].start, commitFrees[i].length );
+	free( commitFrees );
+	commitFrees = NULL;
+	numCommitFrees = 0;
+
+	if( checkpoint )
+	{
+		if( journalCheckpoint() == -1 )
+			printf( "journal error: checkpoint failed\n" );
+		pthread_rwlock_unlock( &journalHandles );
+	}
+	return sequence;
+}
+
+
+/*
+ * Function: journalWait / journalFlush
+ * Parameters: sequence - A transaction that has to be durable
+ *             checkpoint - 1 to also write everything home
+ * Returns: journalFlush returns 0 on success, -1 if the commit failed
+ * Description: Group commit.  If no commit is running the caller writes one,
+ *              which takes in every operation that has finished so far.  If one
+ *              is running the caller waits for it, and the first waiter to find
+ *              its transaction still not durable writes the next.  A waiter
+ *              whose own commit fails gives up rather than retrying forever.
+ *              journalFlush commits whatever is outstanding
+ */
+
+void journalWait( long long sequence )
+{
+	long long committed;
+
+	pthread_mutex_lock( &journalLock );
+	while( journalCommitted < sequence )
+	{
+		if( journalCommitting )
+		{
+			pthread_cond_wait( &journalCond, &journalLock );
+			continue;
+		}
+
+		journalCommitting = 1;
+		pthread_mutex_unlock( &journalLock );
+		committed = journalCommit( 0 );
+		pthread_mutex_lock( &journalLock );
+		journalCommitting = 0;
+		if( committed != -1 )
+			journalCommitted = committed;
+		pthread_cond_broadcast( &journalCond );
+		if( committed == -1 )
+			break;
+	}
+	pthread_mutex_unlock( &journalLock );
+	return;
+}
+
+int journalFlush( int checkpoint )
+{
+	long long committed;
+
+	pthread_mutex_lock( &journalLock );
+	while( journalCommitting )
+		pthread_cond_wait( &journalCond, &journalLock );
+	journalCommitting = 1;
+	pthread_mutex_unlock( &journalLock );
+
+	committed = journalCommit( checkpoint );
+
+	pthread_mutex_lock( &journalLock );
+	journalCommitting = 0;
+	if( committed != -1 )
+		journalCommitted = committed;
+	pthread_cond_broadcast( &journalCond );
+	pthread_mutex_unlock( &journalLock );
+	return committed == -1 ? -1 : 0;
+}
+
+
+/*
+ * Function: journalBegin / journalEnd / journalLeave
+ * Parameter: sequence - What journalBegin returned
+ * Returns: journalBegin returns the transaction the operation belongs to
+ * Description: Bracket an operation that changes metadata.  journalEnd returns
+ *              once the operation is durable.  Without a journal they do nothing,
+ *              unless journalbench has asked for a full sync after every operation.
+ *              journalLeave ends an operation that turned out to change nothing,
+ *              without waiting for a commit
+ */
+
+long long journalBegin( void )
+{
+	if( !journalActive )
+		return 0;
+	pthread_rwlock_rdlock( &journalHandles );
+	return journalSequence;
+}
+
+void journalEnd( long long sequence )
+{
+	if( !journalActive )
+	{
+		if( syncEveryOp )
+			flushImage();
+		return;
+	}
+	pthread_rwlock_unlock( &journalHandles );
+	__atomic_add_fetch( &journalStats.transactions, 1, __ATOMIC_RELAXED );
+	journalWait( sequence );
+	return;
+}
+
+void journalLeave( void )
+{
+	if( journalActive )
+		pthread_rwlock_unlock( &journalHandles );
+	return;
+}
+
+
+/*
+ * Function: journalReplay
+ * Parameter: none
+ * Returns: none
+ * Description: Called at mount, before anything else reads the metadata.  Applies
+ *              every complete transaction in the journal, in order, to the image
+ *              and then empties the journal.  The first transaction that is
+ *              missing, out of sequence or fails its checksum ends the replay
+ */
+
+void journalReplay( void )
+{
+	journalHeader header;
+	journalHeader *commit;
+	unsigned char *buffer;
+	int *pageList;
+	int pos = 1;
+	int replayed = 0;
+	int i, count, descPages, total;
+
+	if( imageFd == -1 || sb->journalOffset == 0 )
+		return;
+	if( pread( imageFd, &header, sizeof( header ), sb->journalOffset ) != sizeof( header ) ||
+	    header.magic != JOURNAL_MAGIC || header.type != JOURNAL_SUPER )
+		return;
+
+	journalSequence = header.sequence;
+	metaPages = sb->journalOffset / JOURNAL_PAGE;
+	buffer = malloc( (size_t)sb->journalPages * JOURNAL_PAGE );
+	if( buffer == NULL )
+	{
+		printf( "journal error: no memory to replay the journal\n" );
+		return;
+	}
+
+	while( pos < sb->journalPages )
+	{
+		if( pread( imageFd, &header, sizeof( header ), sb->journalOffset + (off_t)pos * JOURNAL_PAGE ) != sizeof( header ) ||
+		    header.magic != JOURNAL_MAGIC || header.type != JOURNAL_DESCRIPTOR ||
+		    header.sequence != journalSequence || header.count < 0 || header.count > metaPages )
+			break;
+
+		count = header.count;
+		descPages = ( sizeof( journalHeader ) + count * sizeof( int ) + JOURNAL_PAGE - 1 ) / JOURNAL_PAGE;
+		total = descPages + count + 1;
+		if( pos + total > sb->journalPages ||
+		    pread( imageFd, buffer, (size_t)total * JOURNAL_PAGE, sb->journalOffset + (off_t)pos * JOURNAL_PAGE ) != (ssize_t)total * JOURNAL_PAGE )
+			break;
+
+		commit = (journalHeader *)( buffer + (size_t)( total - 1 ) * JOURNAL_PAGE );
+		if( commit->magic != JOURNAL_MAGIC || commit->type != JOURNAL_COMMIT || commit->sequence != journalSequence ||
+		    commit->checksum != journalChecksum( 0xcbf29ce484222325ULL, buffer, (size_t)( total - 1 ) * JOURNAL_PAGE ) )
+			break;
+
+		pageList = (int *)( buffer + sizeof( journalHeader ) );
+		for( i = 0; i < count; i++ )
+		{
+			if( pageList[i] >= 0 && pageList[i] < metaPages )
+				memcpy( image + (size_t)pageList[i] * JOURNAL_PAGE, buffer + (size_t)( descPages + i ) * JOURNAL_PAGE, JOURNAL_PAGE );
+		}
+		journalSequence++;
+		pos += total;
+		replayed++;
+	}
+	free( buffer );
+
+	if( replayed > 0 )
+	{
+		printf( "Replayed %d journal transaction%s\n", replayed, replayed == 1 ? "" : "s" );
+		if( msync( image, sb->journalOffset, MS_SYNC ) == -1 )
+			perror( "msync" );
+		journalReset();
+	}
+	return;
+}
+
+
+/*
+ * Function: journalStart / journalStop
+ * Parameter: none
+ * Returns: 0 on success, -1 if journaling couldn't be changed
+ * Description: Turn journaling on or off for the mounted image.  Starting it
+ *              brings the image file up to date and then maps the metadata over
+ *              again privately, so changes only reach the file through the
+ *              journal.  Stopping it commits and checkpoints everything and maps
+ *              the metadata shared again
+ */
+
+int journalStart( void )
+{
+	pthread_rwlockattr_t attr;
+
+	if( imageFd == -1 || sb->journalOffset == 0 )
+	{
+		printf( "journal error: needs an image file formatted with a journal\n" );
+		return -1;
+	}
+
+	metaPages = sb->journalOffset / JOURNAL_PAGE;
+	journalMaxTransaction = journalTransactionPages( metaPages );
+	dirtyPages = calloc( ( metaPages + 63 ) / 64, sizeof( uint64_t ) );
+	checkpointPages = calloc( ( metaPages + 63 ) / 64, sizeof( uint64_t ) );
+	journalBuffer = malloc( (size_t)journalMaxTransaction * JOURNAL_PAGE );
+	if( dirtyPages == NULL || checkpointPages == NULL || journalBuffer == NULL )
+	{
+		printf( "journal error: out of memory\n" );
+		free( dirtyPages );
+		free( checkpointPages );
+		free( journalBuffer );
+		return -1;
+	}
+
+	// Prefer the committer, so a stream of operations can't hold a commit off
+	pthread_rwlockattr_init( &attr );
+	pthread_rwlockattr_setkind_np( &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP );
+	pthread_rwlock_init( &journalHandles, &attr );
+	pthread_rwlockattr_destroy( &attr );
+
+	// Bring the image file up to date, after which the journal starts empty
+	sb->journal = 1;
+	flushImage();
+	if( fsync( imageFd ) == -1 )
+		perror( "fsync" );
+	if( journalSequence == 0 )
+		journalSequence = 1;
+	journalCommitted = journalSequence - 1;
+	if( journalReset() == -1 )
+		return -1;
+
+	if( mmap( image, sb->journalOffset, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, imageFd, 0 ) == MAP_FAILED )
+	{
+		perror( "mmap" );
+		return -1;
+	}
+	journalActive = 1;
+	return 0;
+}
+
+int journalStop( void )
+{
+	// Keep journaling if the last commit couldn't be written
+	sb->journal = 0;
+	if( journalFlush( 1 ) == -1 )
+	{
+		sb->journal = 1;
+		return -1;
+	}
+	journalActive = 0;
+
+	if( mmap( image, sb->journalOffset, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, imageFd, 0 ) == MAP_FAILED )
+	{
+		perror( "mmap" );
+		return -1;
+	}
+
+	free( dirtyPages );
+	free( checkpointPages );
+	free( journalBuffer );
+	pthread_rwlock_destroy( &journalHandles );
+	return 0;
+}
+
+
+/*
+ * Function: removeFile
+ * Parameter: fileNum - A directory entry the caller holds exclusively
+ * Returns: none
+ * Description: Frees the file's blocks and releases the directory entry.  The
+ *              caller still has to unlock the entry
+ */
+
+void removeFile( int fileNum )
+{
+	// Set all of the file's blocks to "not in use"
+	freeExtents( fileNum );
+
+	// Drop the entry from the index, then blank the directory information and
+	// put the entry back on the free list
+	journalDirty( &fileInfo[fileNum], sizeof( fileInfoStruct ) );
+	pthread_mutex_lock( &dirLock );
+	sb->logicalBlocks -= ( fileInfo[fileNum].size + blockSize - 1 ) / blockSize;
+	if( fileInfo[fileNum].flags & FILE_COMPRESSED )
+	{
+		sb->compressedBytes -= fileInfo[fileNum].size;
+		sb->storedBytes -= fileInfo[fileNum].storedSize;
+	}
+	dirRemove( fileNum );
+	fileInfo[fileNum].name[0] = '\0';
+	fileInfo[fileNum].valid = 0;
+	fileInfo[fileNum].generation++;
+	journalDirty( &freeSlots[sb->numFreeSlots], sizeof( int ) );
+	freeSlots[sb->numFreeSlots++] = fileNum;
+	pthread_mutex_unlock( &dirLock );
+	return;
+}
+
+
+/*
+ * Function: storeFile
+ * Parameter: filename - A char string that is the file name to load
+ *                      into the filesystem
+ * Returns: none
+ * Description: Determines whether a file is valid to load, determines where to
+ *              put it in the filesystem, and loads it.  The new entry is indexed
+ *              straight away but stays locked until the data is in, so anyone
+ *              getting it waits for the put to finish
+ */
+
+void storeFile( const char *filename )
+{
+	struct stat buf;
+	int status, blockIndex, numBlocks, start, got;
+	long long freeSpace;
+	long long allocStart;
+	int fileNum = 0;
+
+	// A name that doesn't fit in a directory entry is turned away like putBatch does
+	if( filename != NULL && strlen( filename ) >= NAME_LENGTH )
+	{
+		printf( "Unable to open file: %s\n", filename );
+		return;
+	}
+	status = stat( filename, &buf );
+
+	// Check free space but don't output the result
+	freeSpace = displayFree( 0 );
+
+	// If the file information loaded correctly, execute this block
+	if( status != -1 )
+	{
+
+		// Check to see if the file system has enough space to store the requested file.
+		// With dedup or compression on we can't tell until we've seen the contents
+		if( buf.st_size > freeSpace && !sb->dedup && !sb->compress )
+		{
+			printf( "Error: Insufficient free space to store this file.\n" );
+			return;
+		}
+
+		// Make sure we can read the file before we take any space for it
+		int ifd = open( filename, O_RDONLY );
+		if( ifd == -1 )
+		{
+			printf( "Unable to open file: %s\n", filename );
+			return;
+		}
+
+		// Check the directory index to see if this file is already loaded, and if not
+		// take a free directory entry for it before anyone else can
+		pthread_mutex_lock( &dirLock );
+		if( dirLookup( filename ) != -1 )
+		{
+			pthread_mutex_unlock( &dirLock );
+			printf( "file already exists, select another file\n" );
+			close( ifd );
+			return;
+		}
+
+		// If every entry is in use there's nowhere to put the file
+		fileNum = dirAllocSlot();
+		if( fileNum == -1 )
+		{
+			pthread_mutex_unlock( &dirLock );
+			printf( "insufficient file directory space\n" );
+			close( ifd );
+			return;
+		}
+
+		// Set the directory information and index it
+		pthread_rwlock_wrlock( &fileLocks[fileNum] );
+		fileInfo[fileNum].valid = 1;
+		strcpy( fileInfo[fileNum].name, filename );
+		time ( &fileInfo[fileNum].timeStamp );
+		fileInfo[fileNum].size = buf.st_size;
+		fileInfo[fileNum].numExtents = 0;
+		fileInfo[fileNum].indirect = -1;
+		fileInfo[fileNum].lastIndirect = -1;
+		fileInfo[fileNum].flags = 0;
+		fileInfo[fileNum].generation++;
+		fileInfo[fileNum].storedSize = buf.st_size;
+		dirInsert( fileNum );
+		journalDirty( &fileInfo[fileNum], sizeof( fileInfoStruct ) );
+		numBlocks = ( buf.st_size + blockSize - 1 ) / blockSize;
+		sb->logicalBlocks += numBlocks;
+		pthread_mutex_unlock( &dirLock );
+
+		// Compressed files are allocated a chunk at a time as they are compressed.
+		// If free space is too broken up for that the file is stored as it is
+		status = sb->compress ? compressPut( ifd, fileNum, buf.st_size ) : 1;
+		if( status != 1 )
+		{
+			close( ifd );
+			pthread_mutex_lock( &dirLock );
+			sb->compressedBytes += buf.st_size;
+			sb->storedBytes += fileInfo[fileNum].storedSize;
+			pthread_mutex_unlock( &dirLock );
+			if( status == -1 )
+			{
+				printf( "Error: insufficient filesystem space to store this file.\n" );
+				removeFile( fileNum );
+			}
+			pthread_rwlock_unlock( &fileLocks[fileNum] );
+			return;
+		}
+
+		// In dedup mode blocks are allocated as the file is read, since whether a
+		// block needs one depends on what's in it
+		if( sb->dedup )
+		{
+			status = dedupPut( ifd, fileNum, buf.st_size );
+			close( ifd );
+			if( status == -1 )
+			{
+				printf( "Error: insufficient filesystem space to store this file.\n" );
+				removeFile( fileNum );
+			}
+			pthread_rwlock_unlock( &fileLocks[fileNum] );
+			return;
+		}
+
+		// Allocate every block the file needs up front, asking the bitmap for
+		// contiguous runs so the file ends up in as few extents as possible
+		blockIndex = 0;
+		allocStart = allocTiming ? nowNsec() : 0;
+		while( blockIndex < numBlocks )
+		{
+			start = bitmapAllocRun( &arrayStatus, numBlocks - blockIndex, &got );
+			if( start == -1 )
+				break;
+			if( addExtent( fileNum, start, got ) == -1 )
+			{
+				bitmapFree( &arrayStatus, start, got );
+				break;
+			}
+			blockIndex += got;
+		}
+		if( allocTiming )
+			allocCharge( allocStart );
+
+		// This shouldn't be necessary, if displayFree returns the correct data, but
+		// the indirect blocks for a badly fragmented file, or other puts running at
+		// the same time, can still run us out
+		if( blockIndex < numBlocks )
+		{
+			printf( "Error: insufficient filesystem space to store this file.\n" );
+			close( ifd );
+			removeFile( fileNum );
+			pthread_rwlock_unlock( &fileLocks[fileNum] );
+			return;
+		}
+
+		// Now we have the file directory entry set, this section actually copies the
+		// file straight into its extents
+		if( transferFile( ifd, fileNum, buf.st_size, 1 ) == -1 )
+		{
+			printf( "An error occured reading from the input file.\n" );
+			close( ifd );
+			removeFile( fileNum );
+			pthread_rwlock_unlock( &fileLocks[fileNum] );
+			return;
+		}
+
+		// After we're done copying, close the input file handle
+		close( ifd );
+		pthread_rwlock_unlock( &fileLocks[fileNum] );
+	}
+
+	// If opening the file failed (status == -1)
+	else
+	{
+		printf( "Unable to open file: %s\n", filename );
+		perror( "Opening the input file returned: " );
+		return;
+	}
+	return;
+}
+
+
+/*
+ * Function: putFile
+ * Parameter: filename - The file to load into the filesystem
+ * Returns: none
+ * Description: Runs storeFile as one journaled operation, returning once the
+ *              file is durable if the image has a journal
+ */
+
+void putFile( const char *filename )
+{
+	long long sequence = journalBegin();
+
+	storeFile( filename );
+	journalEnd( sequence );
+	return;
+}
+
+
+/*
+ * Function: batchWorker / putBatch
+ * Parameters: names - The files to put, already expanded
+ *             count - How many there are
+ *             arg - The batchJob shared by the workers
+ * Returns: putBatch returns how many of the files were stored
+ * Description: Puts many files as a pipeline instead of one storeFile after
+ *              another.  Every file is stat'ed and the whole batch checked
+ *              against the free space first.  Then all the directory entries
+ *              are taken under one hold of dirLock, and the blocks for the
+ *              whole batch are allocated as a few long runs that are carved up
+ *              between the files in order, so small files end up packed
+ *              together.  Only then does the pool open and read the host
+ *              files, each straight into its own extents.  Entries stay locked
+ *              until the batch is in, and the batch is a single journal
+ *              transaction so it costs one fsync
+ */
+
+typedef struct
+{
+	char *name;
+	long long size;
+	int fileNum;
+	int stored;
+} batchFile;
+
+typedef struct
+{
+	batchFile *files;
+	int numFiles;
+	int next;
+} batchJob;
+
+void batchWorker( void *arg )
+{
+	batchJob *job = arg;
+	batchFile *file;
+	int i, ifd;
+
+	while( ( i = __atomic_fetch_add( &job->next, 1, __ATOMIC_RELAXED ) ) < job->numFiles )
+	{
+		file = &job->files[i];
+		if( file->fileNum == -1 )
+			continue;
+
+		ifd = open( file->name, O_RDONLY );
+		if( ifd == -1 || transferFile( ifd, file->fileNum, file->size, 1 ) == -1 )
+		{
+			printf( "An error occured reading from the input file %s.\n", file->name );
+			removeFile( file->fileNum );
+		}
+		else
+			file->stored = 1;
+		if( ifd != -1 )
+			close( ifd );
+	}
+	return;
+}
+
+int putBatch( char **names, int count )
+{
+	batchJob job;
+	batchFile *file;
+	struct stat buf;
+	long long blocks, allocStart, sequence;
+	int i, numBlocks, start, left, take;
+	int stored = 0;
+
+	job.files = malloc( ( count + 1 ) * sizeof( batchFile ) );
+	if( job.files == NULL )
+	{
+		printf( "put error: out of memory\n" );
+		return 0;
+	}
+
+	// Stat everything first, so the space can be checked for the whole batch
+	blocks = 0;
+	job.numFiles = 0;
+	for( i = 0; i < count; i++ )
+	{
+		if( stat( names[i], &buf ) == -1 || !S_ISREG( buf.st_mode ) || strlen( names[i] ) >= NAME_LENGTH )
+		{
+			printf( "Unable to open file: %s\n", names[i] );
+			continue;
+		}
+		job.files[job.numFiles].name = names[i];
+		job.files[job.numFiles].size = buf.st_size;
+		job.files[job.numFiles].fileNum = -1;
+		job.files[job.numFiles].stored = 0;
+		job.numFiles++;
+		blocks += ( buf.st_size + blockSize - 1 ) / blockSize;
+	}
+	if( blocks * blockSize > displayFree( 0 ) )
+	{
+		printf( "Error: Insufficient free space to store these files.\n" );
+		free( job.files );
+		return 0;
+	}
+
+	sequence = journalBegin();
+
+	// Take every directory entry in one go
+	pthread_mutex_lock( &dirLock );
+	for( i = 0; i < job.numFiles; i++ )
+	{
+		file = &job.files[i];
+		if( dirLookup( file->name ) != -1 )
+		{
+			printf( "file already exists, select another file\n" );
+			continue;
+		}
+		file->fileNum = dirAllocSlot();
+		if( file->fileNum == -1 )
+		{
+			printf( "insufficient file directory space\n" );
+			break;
+		}
+
+		pthread_rwlock_wrlock( &fileLocks[file->fileNum] );
+		fileInfo[file->fileNum].valid = 1;
+		strcpy( fileInfo[file->fileNum].name, file->name );
+		time( &fileInfo[file->fileNum].timeStamp );
+		fileInfo[file->fileNum].size = file->size;
+		fileInfo[file->fileNum].numExtents = 0;
+		fileInfo[file->fileNum].indirect = -1;
+		fileInfo[file->fileNum].lastIndirect = -1;
+		fileInfo[file->fileNum].flags = 0;
+		fileInfo[file->fileNum].generation++;
+		fileInfo[file->fileNum].storedSize = file->size;
+		dirInsert( file->fileNum );
+		sb->logicalBlocks += ( file->size + blockSize - 1 ) / blockSize;
+	}
+	pthread_mutex_unlock( &dirLock );
+
+	// Then the blocks, asking for everything that's left each time so the
+	// batch lands in as few runs as possible
+	blocks = 0;
+	for( i = 0; i < job.numFiles; i++ )
+	{
+		if( job.files[i].fileNum != -1 )
+			blocks += ( job.files[i].size + blockSize - 1 ) / blockSize;
+	}
+	allocStart = allocTiming ? nowNsec() : 0;
+	start = 0;
+	left = 0;
+	for( i = 0; i < job.numFiles; i++ )
+	{
+		file = &job.files[i];
+		if( file->fileNum == -1 )
+			continue;
+		numBlocks = ( file->size + blockSize - 1 ) / blockSize;
+		blocks -= numBlocks;
+		while( numBlocks > 0 )
+		{
+			if( left == 0 )
+			{
+				start = bitmapAllocRun( &arrayStatus, numBlocks + blocks, &left );
+				if( start == -1 )
+					break;
+			}
+			take = numBlocks < left ? numBlocks : left;
+			if( addExtent( file->fileNum, start, take ) == -1 )
+				break;
+			start += take;
+			left -= take;
+			numBlocks -= take;
+		}
+		journalDirty( &fileInfo[file->fileNum], sizeof( fileInfoStruct ) );
+
+		// Other puts running at the same time, or indirect blocks, can still
+		// run us out
+		if( numBlocks > 0 )
+		{
+			printf( "Error: insufficient filesystem space to store %s.\n", file->name );
+			removeFile( file->fileNum );
+			pthread_rwlock_unlock( &fileLocks[file->fileNum] );
+			file->fileNum = -1;
+		}
+	}
+	if( left > 0 )
+		bitmapFree( &arrayStatus, start, left );
+	if( allocTiming )
+		allocCharge( allocStart );
+
+	// Now read the host files into their extents in parallel.  The entries are
+	// unlocked here afterwards, a rwlock has to be released by its owner
+	job.next = 0;
+	poolRun( batchWorker, &job );
+
+	for( i = 0; i < job.numFiles; i++ )
+	{
+		if( job.files[i].fileNum != -1 )
+			pthread_rwlock_unlock( &fileLocks[job.files[i].fileNum] );
+		stored += job.files[i].stored;
+	}
+
+	journalEnd( sequence );
+	free( job.files );
+	return stored;
+}
+
+
+/*
+ * Function: putWorker / putFiles
+ * Parameters: names - The NULL terminated list of files to put, which may
+ *                     include wildcards
+ *             arg - The putJob shared by the workers
+ * Returns: none
+ * Description: Puts several files at once.  Wildcards are expanded here, and
+ *              the files go through putBatch.  With dedup or compression on the
+ *              space a file needs depends on its contents, so instead each pool
+ *              thread puts whole files with putFile.  A single plain name is
+ *              just handed to putFile
+ */
+
+typedef struct
+{
+	char **names;
+	int next;
+	pthread_mutex_t lock;
+} putJob;
+
+void putWorker( void *arg )
+{
+	putJob *job = arg;
+	char *name;
+
+	while( 1 )
+	{
+		pthread_mutex_lock( &job->lock );
+		name = job->names[job->next];
+		if( name != NULL )
+			job->next++;
+		pthread_mutex_unlock( &job->lock );
+		if( name == NULL )
+			break;
+		putFile( name );
+	}
+	return;
+}
+
+void putFiles( char **names )
+{
+	putJob job;
+	glob_t found;
+	int i, status;
+
+	if( names[0] == NULL || ( names[1] == NULL && strpbrk( names[0], "*?[" ) == NULL ) )
+	{
+		putFile( names[0] );
+		return;
+	}
+
+	// Patterns that match nothing are kept as they are, so they get reported.  If
+	// the expansion itself fails nothing is put, rather than a partial list
+	for( i = 0; names[i] != NULL; i++ )
+	{
+		status = glob( names[i], GLOB_NOCHECK | ( i > 0 ? GLOB_APPEND : 0 ), NULL, &found );
+		if( status != 0 )
+		{
+			printf( "put error: %s: %s\n", names[i],
+			        status == GLOB_NOSPACE ? "out of memory" : "read error while expanding" );
+			globfree( &found );
+			return;
+		}
+	}
+
+	if( sb->dedup || sb->compress )
+	{
+		job.names = found.gl_pathv;
+		job.next = 0;
+		pthread_mutex_init( &job.lock, NULL );
+		poolRun( putWorker, &job );
+		pthread_mutex_destroy( &job.lock );
+	}
+	else
+		putBatch( found.gl_pathv, found.gl_pathc );
+	globfree( &found );
+	return;
+}
+
+
+/*
+ * Function: getFile
+ * Parameters: Two char arrays, one for the file to retrieve from the file system
+ *              and the other for an optional new name for the output file
+ * Returns: none
+ * Description: Copies a file from our file system back onto disk.  The output
+ *              name is the same as the original file name by default, but is
+ *              customizable using a second parameter
+ */
+
+void getFile( const char *filename, const char *newFilename )
+{
+	int fileNum;
+	int ofd;
+	int status;
+
+	// Check to see if there is a new filename, if not then reuse the original name
+	if( newFilename == NULL )
+		newFilename = filename;
+
+	// Find the directory entry for the file specified, and hold it so it can't be
+	// deleted while we read it
+	fileNum = fileLock( filename, 0 );
+
+	// If the file isn't in the directory, return an error
+	if( fileNum == -1 )
+	{
+		printf( "get error: File not found\n" );
+		return;
+	}
+
+	// Open the output file to prepare for copying back to disk
+	ofd = open( newFilename, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if( ofd == -1 )
+	{
+		printf( "Could not open output file: %s\n", newFilename );
+		pthread_rwlock_unlock( &fileLocks[fileNum] );
+		return;
+	}
+
+	// After the output file opens successfully, tell the user how much we are copying
+	if( verbose )
+		printf( "Writing %lld bytes to %s\n", fileInfo[fileNum].size, newFilename );
+
+	// Write all of the file's extents back out, decompressing them if need be
+	if( fileInfo[fileNum].flags & FILE_COMPRESSED )
+		status = decompressGet( ofd, fileNum );
+	else
+		status = transferFile( ofd, fileNum, fileInfo[fileNum].size, 0 );
+	if( status == -1 )
+		perror( "get error" );
+
+	// After the file is done copying, close the file handle
+	close( ofd );
+	pthread_rwlock_unlock( &fileLocks[fileNum] );
+	return;
+}
+
+
+/*
+ * Function: delFile
+ * Parameter: A char string that is the filename of the file to delete
+ * Returns: none
+ * Description: Removes a file from the filesystem.
+ */
+
+void delFile( const char *filename )
+{
+	int fileNum;
+	long long sequence = journalBegin();
+
+	// Find the file directory entry of the file to delete, waiting for anyone
+	// still reading it
+	fileNum = fileLock( filename, 1 );
+
+	// If the file does not have a directory entry, return an error
+	if( fileNum == -1 )
+	{
+		journalEnd( sequence );
+		printf( "del error: File not found\n" );
+		return;
+	}
+
+	removeFile( fileNum );
+	pthread_rwlock_unlock( &fileLocks[fileNum] );
+	journalEnd( sequence );
+	return;
+}
+
+
+/*
+ * Function: listFiles
+ * Parameter: none
+ * Returns: none
+ * Description: Lists the files currently in the file directory
+ */
+
+void listFiles( void )
+{
+	int i;
+	char buffer [20];
+	struct tm when;
+
+	// Loop through each directory entry
+	for( i = 0; i < sb->nextSlot; i++ )
+	{
+		if( fileInfo[i].valid == 0 )
+			continue;
+
+		// If this entry is in use, display the file information.  A file that's
+		// still being put is shown once it is finished
+		pthread_rwlock_rdlock( &fileLocks[i] );
+		if( fileInfo[i].valid == 1 )
+		{
+			strftime( buffer, 20, "%h %d %H:%M", localtime_r( &fileInfo[i].timeStamp, &when ) );
+			if( fileInfo[i].flags & FILE_COMPRESSED )
+				printf( "%lld\t%s %s (%lld compressed)\n", fileInfo[i].size, buffer,
+				        fileInfo[i].name, fileInfo[i].storedSize );
+			else
+				printf( "%lld\t%s %s\n", fileInfo[i].size, buffer, fileInfo[i].name );
+		}
+		pthread_rwlock_unlock( &fileLocks[i] );
+	}
+	return;
+}
+
+
+/*
+ * Function: grepWorker / grepFiles
+ * Parameters: args - The term to look for, then optionally how many threads to use
+ *             arg - The grepJob shared by the workers
+ * Returns: none
+ * Description: Counts every occurrence of a term in the stored files, reading the
+ *              blocks in place rather than getting the files back out.  Files
+ *              are cut into segments, each a run of contiguous blocks or one
+ *              compressed chunk, and the segments are spread over the thread
+ *              pool.  A worker counts the matches inside its segment and keeps
+ *              the segment's first and last few bytes, so the matches that
+ *              straddle two segments are found afterwards by joining those up.
+ *              Dedup files read like any other.  Every file searched is held
+ *              shared, so it can't change underneath the search
+ */
+
+#define GREP_SEGMENT ( 1 << 20 )
+
+typedef struct
+{
+	int file;
+	int start;
+	int blocks;
+	int length;
+	int compressed;
+} grepSegment;
+
+typedef struct
+{
+	const char *term;
+	int termLength;
+	int *files;
+	long long *hits;
+	int *errors;
+	grepSegment *segments;
+	int numSegments;
+	unsigned char *edges;
+	int bufferBytes;
+	int workers;
+	int joined;
+	int next;
+} grepJob;
+
+void grepWorker( void *arg )
+{
+	grepJob *job = arg;
+	grepSegment *seg;
+	unsigned char *in, *out, *data, *src, *found;
+	unsigned char *head, *tail;
+	uint32_t header;
+	long long hits;
+	int i, b, edge;
+
+	if( __atomic_fetch_add( &job->joined, 1, __ATOMIC_RELAXED ) >= job->workers )
+		return;
+
+	in = malloc( job->bufferBytes );
+	out = malloc( job->bufferBytes );
+	edge = job->termLength - 1;
+
+	while( in != NULL && out != NULL )
+	{
+		i = __atomic_fetch_add( &job->next, 1, __ATOMIC_RELAXED );
+		if( i >= job->numSegments )
+			break;
+		seg = &job->segments[i];
+
+		// A mapped image has the segment in one piece, through the cache it is
+		// gathered a block at a time
+		if( cacheSize == 0 )
+			data = BLOCK( seg->start );
+		else
+		{
+			for( b = 0; b < seg->blocks; b++ )
+			{
+				src = blockGet( seg->start + b, BLOCK_READ );
+				if( src == NULL )
+					break;
+				memcpy( in + (size_t)b * blockSize, src, blockSize );
+				blockPut( seg->start + b, 0 );
+			}
+			data = b == seg->blocks ? in : NULL;
+		}
+
+		// Compressed chunks that didn't fit in fewer blocks were stored as they are
+		if( data != NULL && seg->compressed && seg->blocks < ( seg->length + blockSize - 1 ) / blockSize )
+		{
+			memcpy( &header, data, sizeof( header ) );
+			if( header + sizeof( header ) > (size_t)seg->blocks * blockSize ||
+			    lzDecompress( data + sizeof( header ), header, out, seg->length ) != seg->length )
+				data = NULL;
+			else
+				data = out;
+		}
+
+		head = job->edges + (size_t)i * 2 * edge;
+		tail = head + edge;
+		if( data == NULL )
+		{
+			__atomic_add_fetch( &job->errors[seg->file], 1, __ATOMIC_RELAXED );
+			memset( head, 0, 2 * edge );
+			continue;
+		}
+
+		// Overlapping matches count, so a count never depends on where the
+		// segments happen to fall
+		hits = 0;
+		for( found = data; ( found = memmem( found, data + seg->length - found, job->term, job->termLength ) ) != NULL; found++ )
+			hits++;
+		if( hits > 0 )
+			__atomic_add_fetch( &job->hits[seg->file], hits, __ATOMIC_RELAXED );
+
+		// Only the last segment of a file can be shorter than the edges, and
+		// nothing follows it
+		memcpy( head, data, edge );
+		if( seg->length >= edge )
+			memcpy( tail, data + seg->length - edge, edge );
+	}
+
+	free( in );
+	free( out );
+	return;
+}
+
+void grepFiles( char **args )
+{
+	grepJob job;
+	grepSegment *grown;
+	extentCursor cursor;
+	extent *ext;
+	struct timeval start;
+	unsigned char *join, *found;
+	long long bytes, total, usec, offset;
+	int maxSegments, numFiles, length, blocks, chunkBytes, headBytes;
+	int i, f, edge;
+	int failed = 0;
+
+	if( args[0] == NULL )
+	{
+		printf( "grep error: grep term [workers]\n" );
+		return;
+	}
+	memset( &job, 0, sizeof( job ) );
+	job.term = args[0];
+	job.termLength = strlen( args[0] );
+	job.workers = args[1] != NULL ? atoi( args[1] ) : POOL_MAX_THREADS;
+	if( job.termLength > blockSize || job.workers < 1 )
+	{
+		printf( "grep error: the term can be at most one block long, and workers at least 1\n" );
+		return;
+	}
+	edge = job.termLength - 1;
+	chunkBytes = COMPRESS_CHUNK > blockSize ? COMPRESS_CHUNK / blockSize * blockSize : blockSize;
+
+	// Segments are at least a block long, so a match can only straddle two
+	job.bufferBytes = COMPRESS_CHUNK > GREP_SEGMENT ? COMPRESS_CHUNK : GREP_SEGMENT;
+	job.bufferBytes = ( job.bufferBytes + blockSize - 1 ) / blockSize * blockSize;
+	maxSegments = 1024;
+	job.files = malloc( sb->nextSlot * sizeof( int ) + 1 );
+	job.hits = calloc( sb->nextSlot + 1, sizeof( long long ) );
+	job.errors = calloc( sb->nextSlot + 1, sizeof( int ) );
+	job.segments = malloc( maxSegments * sizeof( grepSegment ) );
+	if( job.files == NULL || job.hits == NULL || job.errors == NULL || job.segments == NULL )
+	{
+		printf( "grep error: out of memory\n" );
+		free( job.files );
+		free( job.hits );
+		free( job.errors );
+		free( job.segments );
+		return;
+	}
+
+	// Hold every file and cut it into segments
+	numFiles = 0;
+	bytes = 0;
+	for( i = 0; i < sb->nextSlot; i++ )
+	{
+		if( fileInfo[i].valid == 0 )
+			continue;
+		pthread_rwlock_rdlock( &fileLocks[i] );
+		if( fileInfo[i].valid != 1 || fileInfo[i].size < job.termLength )
+		{
+			pthread_rwlock_unlock( &fileLocks[i] );
+			continue;
+		}
+		f = numFiles++;
+		job.files[f] = i;
+
+		offset = 0;
+		extentOpen( &cursor, i );
+		while( ( ext = extentNext( &cursor ) ) != NULL && offset < fileInfo[i].size )
+		{
+			for( blocks = 0; blocks < ext->length && offset < fileInfo[i].size; blocks += length )
+			{
+				if( job.numSegments == maxSegments )
+				{
+					grown = realloc( job.segments, 2 * maxSegments * sizeof( grepSegment ) );
+					if( grown == NULL )
+					{
+						failed = 1;
+						break;
+					}
+					job.segments = grown;
+					maxSegments *= 2;
+				}
+
+				// A compressed chunk is one segment however long it is
+				if( fileInfo[i].flags & FILE_COMPRESSED )
+					length = ext->length;
+				else
+					length = job.bufferBytes / blockSize < ext->length - blocks ? job.bufferBytes / blockSize : ext->length - blocks;
+				job.segments[job.numSegments].file = f;
+				job.segments[job.numSegments].start = ext->start + blocks;
+				job.segments[job.numSegments].blocks = length;
+				job.segments[job.numSegments].compressed = ( fileInfo[i].flags & FILE_COMPRESSED ) != 0;
+				if( job.segments[job.numSegments].compressed )
+					job.segments[job.numSegments].length = fileInfo[i].size - offset < chunkBytes ? fileInfo[i].size - offset : chunkBytes;
+				else
+					job.segments[job.numSegments].length = fileInfo[i].size - offset < (long long)length * blockSize ? fileInfo[i].size - offset : (long long)length * blockSize;
+				offset += job.segments[job.numSegments].length;
+				job.numSegments++;
+			}
+			if( failed )
+				break;
+		}
+		extentClose( &cursor );
+		bytes += fileInfo[i].size;
+		if( failed )
+			break;
+	}
+
+	job.edges = failed ? NULL : malloc( (size_t)job.numSegments * 2 * edge + 1 );
+	join = malloc( 2 * edge + 1 );
+	if( job.edges == NULL || join == NULL )
+		printf( "grep error: out of memory\n" );
+	else
+	{
+		gettimeofday( &start, NULL );
+		poolRun( grepWorker, &job );
+
+		// Join up the end of each segment with the start of the next one in the
+		// same file.  Matches that lie wholly in either were counted already
+		for( i = 0; edge > 0 && i + 1 < job.numSegments; i++ )
+		{
+			if( job.segments[i].file != job.segments[i + 1].file )
+				continue;
+			memcpy( join, job.edges + (size_t)i * 2 * edge + edge, edge );
+			headBytes = job.segments[i + 1].length < edge ? job.segments[i + 1].length : edge;
+			memcpy( join + edge, job.edges + (size_t)( i + 1 ) * 2 * edge, headBytes );
+			for( found = join; ( found = memmem( found, join + edge + headBytes - found, job.term, job.termLength ) ) != NULL; found++ )
+				job.hits[job.segments[i].file]++;
+		}
+		usec = elapsedUsec( &start );
+
+		total = 0;
+		for( f = 0; f < numFiles; f++ )
+		{
+			if( job.errors[f] )
+				printf( "grep error: %s has %d unreadable segments\n", fileInfo[job.files[f]].name, job.errors[f] );
+			if( job.hits[f] > 0 )
+				printf( "%s: %lld\n", fileInfo[job.files[f]].name, job.hits[f] );
+			total += job.hits[f];
+		}
+		printf( "%lld matches in %d files, %.1f MB in %lld us with %d workers, %.1f MB/s\n",
+		        total, numFiles, bytes / 1e6, usec,
+		        job.joined < job.workers ? job.joined : job.workers,
+		        bytes / ( usec > 0 ? (double)usec : 1.0 ) );
+	}
+
+	for( f = 0; f < numFiles; f++ )
+		pthread_rwlock_unlock( &fileLocks[job.files[f]] );
+	free( join );
+	free( job.edges );
+	free( job.files );
+	free( job.hits );
+	free( job.errors );
+	free( job.segments );
+	return;
+}
+
+
+/*
+ * Function: fragmentation
+ * Parameter: report - Filled in with the file and free space layout
+ * Returns: The fragmentation score, 0 when every file is one contiguous run and
+ *          100 when no two consecutive blocks of any file are next to each other
+ * Description: Walks every file's extents counting the places where the next
+ *              block of a file isn't the next block on disk, and scans the
+ *              bitmap for the number of free runs and the longest one.  Files
+ *              busy being written are skipped
+ */
+
+typedef struct
+{
+	int files;
+	long long blocks;
+	long long breaks;
+	long long freeRuns;
+	long long largestFree;
+	double score;
+} fragReport;
+
+double fragmentation( fragReport *report )
+{
+	extentCursor cursor;
+	extent *ext;
+	long long pairs = 0;
+	long long run = 0;
+	long long end;
+	uint64_t word;
+	int i, bit;
+
+	memset( report, 0, sizeof( *report ) );
+
+	for( i = 0; i < sb->nextSlot; i++ )
+	{
+		if( !fileInfo[i].valid || pthread_rwlock_tryrdlock( &fileLocks[i] ) != 0 )
+			continue;
+		if( fileInfo[i].valid && fileInfo[i].numExtents > 0 )
+		{
+			report->files++;
+			end = -1;
+			extentOpen( &cursor, i );
+			while( ( ext = extentNext( &cursor ) ) != NULL )
+			{
+				if( end != -1 && ext->start != end )
+					report->breaks++;
+				report->blocks += ext->length;
+				pairs += ext->length;
+				end = ext->start + ext->length;
+			}
+			extentClose( &cursor );
+			pairs--;
+		}
+		pthread_rwlock_unlock( &fileLocks[i] );
+	}
+
+	// Free runs, a word at a time where the word is all free or all used
+	for( i = 0; i < arrayStatus.numWords; i++ )
+	{
+		word = arrayStatus.words[i];
+		for( bit = 0; bit < 64; bit++ )
+		{
+			if( word == 0 )
+			{
+				run += 64 - bit;
+				break;
+			}
+			if( word == ~0ULL || ( word >> bit ) & 1 )
+			{
+				if( run > 0 )
+				{
+					report->freeRuns++;
+					if( run > report->largestFree )
+						report->largestFree = run;
+				}
+				run = 0;
+				if( word == ~0ULL )
+					break;
+			}
+			else
+				run++;
+		}
+	}
+	if( run > 0 )
+	{
+		report->freeRuns++;
+		if( run > report->largestFree )
+			report->largestFree = run;
+	}
+
+	report->score = pairs > 0 ? 100.0 * report->breaks / pairs : 0.0;
+	return report->score;
+}
+
+
+/*
+ * Function: defragFile
+ * Parameters: fileNum - The directory entry to move
+ *             blocks - Has the number of blocks moved added to it
+ * Returns: 1 if the file was moved, 0 if it was left where it was, -1 if it is
+ *          in pieces but there is no free run big enough to put it together
+ * Description: Copies a file into the lowest free run that holds all of it, if
+ *              that puts it back together or moves it further forward, then
+ *              points the entry at the copy and releases the old blocks.  The
+ *              copy is made holding the entry shared and outside any journal
+ *              operation, so reads of the file carry on and commits aren't held
+ *              up; until the switch the new run is only reserved.  The switch
+ *              is one journal operation holding the entry exclusively, and is
+ *              skipped if the file changed in between.  With a journal the old
+ *              blocks aren't reused until it commits.  Dedup files are left
+ *              alone, their blocks may be shared
+ */
+
+int defragFile( int fileNum, long long *blocks )
+{
+	fileInfoStruct saved;
+	extentCursor cursor;
+	extent *ext, *old;
+	unsigned char *from, *to;
+	long long sequence = journalBegin();
+	int total, breaks, target, block, next, end, unchanged;
+	int i, j, n;
+
+	pthread_rwlock_rdlock( &fileLocks[fileNum] );
+	if( fileInfo[fileNum].valid != 1 || fileInfo[fileNum].numExtents == 0 ||
+	    ( fileInfo[fileNum].flags & FILE_DEDUP ) )
+	{
+		pthread_rwlock_unlock( &fileLocks[fileNum] );
+		journalLeave();
+		return 0;
+	}
+
+	// Take a copy of the entry and its extents, the entry is rebuilt from them below
+	saved = fileInfo[fileNum];
+	n = fileInfo[fileNum].numExtents;
+	old = malloc( n * sizeof( extent ) );
+	if( old == NULL )
+	{
+		pthread_rwlock_unlock( &fileLocks[fileNum] );
+		journalLeave();
+		return -1;
+	}
+	total = 0;
+	breaks = 0;
+	end = -1;
+	i = 0;
+	extentOpen( &cursor, fileNum );
+	while( ( ext = extentNext( &cursor ) ) != NULL && i < n )
+	{
+		if( end != -1 && ext->start != end )
+			breaks++;
+		end = ext->start + ext->length;
+		total += ext->length;
+		old[i++] = *ext;
+	}
+	extentClose( &cursor );
+
+	// A file in one piece only moves to close up free space in front of it
+	target = i < n ? -1 : bitmapAllocLow( &arrayStatus, total, breaks > 0 ? arrayStatus.numBlocks : old[0].start );
+	if( target != -1 && blockReserve( target, total ) == -1 )
+	{
+		bitmapFree( &arrayStatus, target, total );
+		target = -1;
+	}
+	journalLeave();
+	if( target == -1 )
+	{
+		pthread_rwlock_unlock( &fileLocks[fileNum] );
+		free( old );
+		return breaks > 0 ? -1 : 0;
+	}
+
+	// Copy the data across
+	block = target;
+	for( i = 0; i < n; i++ )
+	{
+		if( cacheSize > 0 )
+			cacheReadahead( old[i].start, old[i].length );
+		for( j = 0; j < old[i].length; j++, block++ )
+		{
+			from = blockGet( old[i].start + j, BLOCK_READ );
+			to = from == NULL ? NULL : blockGet( block, BLOCK_OVERWRITE );
+			if( to == NULL )
+			{
+				if( from != NULL )
+					blockPut( old[i].start + j, 0 );
+				break;
+			}
+			memcpy( to, from, blockSize );
+			blockPut( block, 1 );
+			blockPut( old[i].start + j, 0 );
+		}
+		if( j < old[i].length )
+			break;
+	}
+	pthread_rwlock_unlock( &fileLocks[fileNum] );
+
+	// Switch the entry over to the copy, unless the copy failed or a put or del
+	// got at the file while we weren't holding it
+	sequence = journalBegin();
+	blockClaim( target );
+	pthread_rwlock_wrlock( &fileLocks[fileNum] );
+	unchanged = i == n && fileInfo[fileNum].valid == 1 && fileInfo[fileNum].generation == saved.generation &&
+	            fileInfo[fileNum].numExtents == n;
+	i = 0;
+	extentOpen( &cursor, fileNum );
+	while( unchanged && ( ext = extentNext( &cursor ) ) != NULL )
+	{
+		unchanged = ext->start == old[i].start && ext->length == old[i].length;
+		i++;
+	}
+	extentClose( &cursor );
+	if( !unchanged )
+	{
+		bitmapFree( &arrayStatus, target, total );
+		pthread_rwlock_unlock( &fileLocks[fileNum] );
+		journalLeave();
+		free( old );
+		return 0;
+	}
+
+	saved = fileInfo[fileNum];
+	fileInfo[fileNum].numExtents = 0;
+	fileInfo[fileNum].indirect = -1;
+	fileInfo[fileNum].lastIndirect = -1;
+	block = target;
+	for( i = 0; i < n; i++ )
+	{
+		// Compressed chunks keep an extent each, everything else merges into one
+		if( addExtent( fileNum, block, old[i].length ) == -1 )
+		{
+			// Out of blocks for indirect blocks, put everything back
+			for( block = fileInfo[fileNum].indirect; block != -1; block = next )
+			{
+				to = blockGet( block, BLOCK_READ );
+				next = to == NULL ? -1 : ( (indirectBlock *)to )->next;
+				if( to != NULL )
+					blockPut( block, 0 );
+				bitmapFree( &arrayStatus, block, 1 );
+			}
+			bitmapFree( &arrayStatus, target, total );
+			fileInfo[fileNum] = saved;
+			pthread_rwlock_unlock( &fileLocks[fileNum] );
+			journalLeave();
+			free( old );
+			return -1;
+		}
+		block += old[i].length;
+	}
+	journalDirty( &fileInfo[fileNum], sizeof( fileInfoStruct ) );
+
+	for( i = 0; i < n; i++ )
+		blockRelease( old[i].start, old[i].length );
+	freeIndirect( saved.indirect, saved.numExtents );
+
+	pthread_rwlock_unlock( &fileLocks[fileNum] );
+	journalEnd( sequence );
+	free( old );
+	*blocks += total;
+	return 1;
+}
+
+
+/*
+ * Function: defragPass
+ * Parameters: background - 1 when run by the background thread, which stops
+ *                          part way if it is turned off
+ *             blocks - Set to the number of blocks moved
+ *             stuck - Set to the number of files that couldn't be put together
+ * Returns: The number of files moved
+ * Description: Runs defragFile over every file in the order they sit on disk,
+ *              so each one can slide forward into the space the ones before
+ *              it have left
+ */
+
+typedef struct
+{
+	int start;
+	int fileNum;
+} defragOrder;
+
+int defragCompare( const void *a, const void *b )
+{
+	const defragOrder *x = a;
+	const defragOrder *y = b;
+
+	return ( x->start > y->start ) - ( x->start < y->start );
+}
+
+int defragPass( int background, long long *blocks, int *stuck )
+{
+	defragOrder *order;
+	int i, n, result;
+	int moved = 0;
+
+	*blocks = 0;
+	*stuck = 0;
+	order = malloc( ( sb->nextSlot + 1 ) * sizeof( defragOrder ) );
+	if( order == NULL )
+		return 0;
+
+	// Only a rough order is needed, so the entries are read without locking
+	n = 0;
+	for( i = 0; i < sb->nextSlot; i++ )
+	{
+		if( fileInfo[i].valid == 1 && fileInfo[i].numExtents > 0 )
+		{
+			order[n].start = fileInfo[i].extents[0].start;
+			order[n++].fileNum = i;
+		}
+	}
+	qsort( order, n, sizeof( defragOrder ), defragCompare );
+
+	for( i = 0; i < n; i++ )
+	{
+		if( background )
+		{
+			pthread_mutex_lock( &defragLock );
+			if( !defragRunning )
+			{
+				pthread_mutex_unlock( &defragLock );
+				break;
+			}
+		}
+		result = defragFile( order[i].fileNum, blocks );
+		if( background )
+			pthread_mutex_unlock( &defragLock );
+
+		if( result == 1 )
+			moved++;
+		else if( result == -1 )
+			( *stuck )++;
+	}
+	free( order );
+
+	__atomic_add_fetch( &defragStats.passes, 1, __ATOMIC_RELAXED );
+	__atomic_add_fetch( &defragStats.moved, moved, __ATOMIC_RELAXED );
+	__atomic_add_fetch( &defragStats.blocks, *blocks, __ATOMIC_RELAXED );
+	return moved;
+}
+
+
+/*
+ * Function: defragWorker / defragStop / defrag
+ * Parameters: mode - NULL to defragment now, "auto" to start the background
+ *                    thread, "off" to stop it
+ *             seconds - How often the background thread looks, default 10
+ * Returns: none
+ * Description: Puts fragmented files back in one piece and packs files towards
+ *              the front of the image so the free space ends up in one run.
+ *              A foreground run reports the fragmentation score and free space
+ *              layout before and after.  The background thread wakes every
+ *              interval and runs a pass when any file is in pieces
+ */
+
+void *defragWorker( void *unused )
+{
+	struct timespec until;
+	fragReport report;
+	long long blocks;
+	int stuck;
+
+	pthread_mutex_lock( &defragLock );
+	while( defragRunning )
+	{
+		clock_gettime( CLOCK_REALTIME, &until );
+		until.tv_sec += defragInterval;
+		pthread_cond_timedwait( &defragCond, &defragLock, &until );
+		if( !defragRunning )
+			break;
+		pthread_mutex_unlock( &defragLock );
+
+		if( fragmentation( &report ) > 0 )
+			defragPass( 1, &blocks, &stuck );
+		pthread_mutex_lock( &defragLock );
+	}
+	pthread_mutex_unlock( &defragLock );
+	return NULL;
+}
+
+void defragStop( void )
+{
+	pthread_mutex_lock( &defragLock );
+	if( !defragRunning )
+	{
+		pthread_mutex_unlock( &defragLock );
+		return;
+	}
+	defragRunning = 0;
+	pthread_cond_signal( &defragCond );
+	pthread_mutex_unlock( &defragLock );
+	pthread_join( defragThread, NULL );
+	return;
+}
+
+void defrag( char *mode, char *seconds )
+{
+	fragReport before, after;
+	struct timeval start;
+	long long blocks, usec;
+	int moved, stuck;
+
+	if( mode != NULL && strcmp( mode, "auto" ) == 0 )
+	{
+		defragStop();
+		defragInterval = seconds != NULL ? atoi( seconds ) : 10;
+		if( defragInterval < 1 )
+			defragInterval = 1;
+		defragRunning = 1;
+		if( pthread_create( &defragThread, NULL, defragWorker, NULL ) != 0 )
+		{
+			defragRunning = 0;
+			perror( "defrag error" );
+			return;
+		}
+		printf( "defrag: background, every %d s\n", defragInterval );
+		return;
+	}
+	if( mode != NULL && strcmp( mode, "off" ) == 0 )
+	{
+		defragStop();
+		printf( "defrag: background off, %lld passes moved %lld files (%lld blocks) so far\n",
+		        defragStats.passes, defragStats.moved, defragStats.blocks );
+		return;
+	}
+	if( mode != NULL )
+	{
+		printf( "defrag error: use defrag, defrag auto [seconds] or defrag off\n" );
+		return;
+	}
+
+	fragmentation( &before );
+	gettimeofday( &start, NULL );
+	moved = defragPass( 0, &blocks, &stuck );
+	usec = elapsedUsec( &start );
+	fragmentation( &after );
+
+	printf( "before: score %.2f, %lld breaks in %d files, %lld free runs, largest %lld blocks\n",
+	        before.score, before.breaks, before.files, before.freeRuns, before.largestFree );
+	printf( "after:  score %.2f, %lld breaks in %d files, %lld free runs, largest %lld blocks\n",
+	        after.score, after.breaks, after.files, after.freeRuns, after.largestFree );
+	printf( "moved %d files (%lld blocks) in %lld us", moved, blocks, usec );
+	if( stuck > 0 )
+		printf( ", %d files left in pieces for want of a free run", stuck );
+	printf( "\n" );
+	return;
+}
+
+
+/*
+ * Function: allocBench
+ * Parameter: blocksString - Optional number of blocks to test with (default 1M)
+ * Returns: none
+ * Description: Exercises the bitmap allocator on a scratch bitmap much larger than
+ *              the file system: single block allocation until full, free space
+ *              queries, fragmenting frees, and contiguous run allocation.  The real
+ *              file system bitmap is not touched
+ */
+
+void allocBench( char *blocksString )
+{
+	blockBitmap bm;
+	uint64_t *words;
+	struct timeval start;
+	long long usec;
+	long long total = 0;
+	int numBlocks = 1 << 20;
+	int i, got, runs;
+
+	if( blocksString != NULL )
+		numBlocks = atoi( blocksString );
+	if( numBlocks < 64 )
+	{
+		printf( "allocbench error: use at least 64 blocks\n" );
+		return;
+	}
+
+	words = malloc( ( ( numBlocks + 63 ) / 64 ) * sizeof( uint64_t ) );
+	if( words == NULL )
+	{
+		printf( "allocbench error: out of memory\n" );
+		return;
+	}
+	bitmapInit( &bm, words, numBlocks );
+
+	// Fill the bitmap one block at a time
+	gettimeofday( &start, NULL );
+	for( i = 0; i < numBlocks; i++ )
+		bitmapAlloc( &bm );
+	usec = elapsedUsec( &start );
+	printf( "alloc  %d blocks: %lld us (%.1f ns/block)\n", numBlocks, usec, usec * 1000.0 / numBlocks );
+
+	// Free space is a counter read, no matter how big the bitmap is
+	gettimeofday( &start, NULL );
+	for( i = 0; i < 1000000; i++ )
+		total += *(volatile int *)&bm.freeBlocks;
+	usec = elapsedUsec( &start );
+	printf( "df     1000000 queries: %lld us (%.1f ns/query)\n", usec, usec * 1000.0 / 1000000 );
+
+	// Free every other block, which leaves nothing but one block holes
+	gettimeofday( &start, NULL );
+	for( i = 0; i < numBlocks; i += 2 )
+		bitmapFree( &bm, i, 1 );
+	usec = elapsedUsec( &start );
+	printf( "free   %d blocks: %lld us, %d blocks free\n", ( numBlocks + 1 ) / 2, usec, bm.freeBlocks );
+
+	// Refill the holes, each search has to skip past full words
+	gettimeofday( &start, NULL );
+	for( i = 0; i < numBlocks; i += 2 )
+		bitmapAlloc( &bm );
+	usec = elapsedUsec( &start );
+	printf( "refill %d holes: %lld us (%.1f ns/block)\n", ( numBlocks + 1 ) / 2, usec, usec * 2000.0 / numBlocks );
+
+	// Empty it and carve it back up into 32 block runs
+	bitmapFree( &bm, 0, numBlocks );
+	runs = 0;
+	gettimeofday( &start, NULL );
+	while( bitmapAllocRun( &bm, 32, &got ) != -1 )
+		runs++;
+	usec = elapsedUsec( &start );
+	printf( "runs   %d x 32 blocks: %lld us (%.1f ns/run)\n", runs, usec, usec * 1000.0 / runs );
+
+	free( words );
+	return;
+}
+
+
+/*
+ * Function: setDedup
+ * Parameter: mode - "on" or "off", or NULL to show the current setting
+ * Returns: none
+ * Description: Turns deduplication on or off for files put from now on.  The
+ *              setting is kept in the superblock so it sticks with the image
+ */
+
+void setDedup( char *mode )
+{
+	if( mode != NULL && strcmp( mode, "on" ) == 0 )
+		sb->dedup = 1;
+	else if( mode != NULL && strcmp( mode, "off" ) == 0 )
+		sb->dedup = 0;
+	else if( mode != NULL )
+		printf( "dedup error: use on or off\n" );
+
+	printf( "dedup: %s\n", sb->dedup ? "on" : "off" );
+	return;
+}
+
+
+/*
+ * Function: setCompress
+ * Parameter: mode - "on" or "off", or NULL to show the current setting
+ * Returns: none
+ * Description: Turns compression on or off for files put from now on.  Files keep
+ *              whichever form they were put in.  Compression takes precedence
+ *              over dedup when both are on
+ */
+
+void setCompress( char *mode )
+{
+	if( mode != NULL && strcmp( mode, "on" ) == 0 )
+		sb->compress = 1;
+	else if( mode != NULL && strcmp( mode, "off" ) == 0 )
+		sb->compress = 0;
+	else if( mode != NULL )
+		printf( "compress error: use on or off\n" );
+
+	printf( "compress: %s\n", sb->compress ? "on" : "off" );
+	return;
+}
+
+
+/*
+ * Function: setJournal
+ * Parameter: mode - "on" or "off", or NULL to show the current setting
+ * Returns: none
+ * Description: Turns the metadata journal on or off.  The setting is kept in the
+ *              superblock so it sticks with the image.  Also shows how many
+ *              operations each commit has been covering
+ */
+
+void setJournal( char *mode )
+{
+	pthread_mutex_lock( &defragLock );
+	if( mode != NULL && strcmp( mode, "on" ) == 0 && !journalActive )
+		journalStart();
+	else if( mode != NULL && strcmp( mode, "off" ) == 0 && journalActive )
+		journalStop();
+	pthread_mutex_unlock( &defragLock );
+
+	if( mode != NULL && strcmp( mode, "on" ) != 0 && strcmp( mode, "off" ) != 0 )
+		printf( "journal error: use on or off\n" );
+
+	printf( "journal: %s\n", journalActive ? "on" : "off" );
+	if( journalStats.commits > 0 )
+		printf( "%lld operations in %lld commits (%.1f per fsync), %lld pages logged, %lld checkpoints\n",
+		        journalStats.transactions, journalStats.commits,
+		        (double)journalStats.transactions / journalStats.commits, journalStats.pages, journalStats.checkpoints );
+	return;
+}
+
+
+/*
+ * Function: setIOMode
+ * Parameter: mode - "vector" or "copy", or NULL to show the current mode
+ * Returns: none
+ * Description: Picks how put and get move data, see ioMode
+ */
+
+void setIOMode( char *mode )
+{
+	if( mode != NULL && strcmp( mode, "vector" ) == 0 )
+		ioMode = IO_VECTOR;
+	else if( mode != NULL && strcmp( mode, "copy" ) == 0 && imageFd != -1 && cacheSize == 0 )
+		ioMode = IO_COPY_RANGE;
+	else if( mode != NULL )
+		printf( "iomode error: use vector, or copy with an uncached image file\n" );
+
+	printf( "iomode: %s\n", ioMode == IO_COPY_RANGE ? "copy" : "vector" );
+	return;
+}
+
+
+/*
+ * Function: ioBench
+ * Parameter: maxString - Optional largest file size to test, in MiB (default 1024)
+ * Returns: none
+ * Description: Puts and gets files from 4 KiB up to the largest size that fits,
+ *              growing by 4x each step, and reports MB/s for each direction.  On
+ *              an image file both the copy_file_range and preadv/pwritev paths are
+ *              measured.  Uses iobench.tmp and iobench.out in the current directory
+ */
+
+void ioBench( char *maxString )
+{
+	static char chunk[1 << 20];
+	struct timeval start;
+	long long maxSize = 1LL << 30;
+	long long size, done, putUsec, getUsec;
+	int savedMode = ioMode;
+	int numModes = ( imageFd != -1 && cacheSize == 0 ) ? 2 : 1;
+	int fd, mode, i;
+
+	if( maxString != NULL )
+		maxSize = atoll( maxString ) << 20;
+
+	// Something other than zeroes so sparse tricks can't help either side
+	for( i = 0; i < (int)sizeof( chunk ); i++ )
+		chunk[i] = 'a' + i % 26;
+
+	verbose = 0;
+	printf( "%12s %-16s %12s %12s\n", "bytes", "path", "put MB/s", "get MB/s" );
+	for( size = 4096; size <= maxSize; size *= 4 )
+	{
+		// Leave room for the indirect blocks of a fragmented file
+		if( size > displayFree( 0 ) - 16LL * blockSize )
+		{
+			printf( "%12lld stopping, not enough free space in the file system\n", size );
+			break;
+		}
+
+		// Build the host file to load
+		fd = open( "iobench.tmp", O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+		for( done = 0; done < size; done += sizeof( chunk ) )
+			write( fd, chunk, size - done < (long long)sizeof( chunk ) ? size - done : sizeof( chunk ) );
+		close( fd );
+
+		for( mode = numModes - 1; mode >= 0; mode-- )
+		{
+			ioMode = mode;
+
+			gettimeofday( &start, NULL );
+			putFile( "iobench.tmp" );
+			putUsec = elapsedUsec( &start );
+
+			gettimeofday( &start, NULL );
+			getFile( "iobench.tmp", "iobench.out" );
+			getUsec = elapsedUsec( &start );
+
+			delFile( "iobench.tmp" );
+
+			// Avoid dividing by zero on the smallest sizes
+			if( putUsec == 0 )
+				putUsec = 1;
+			if( getUsec == 0 )
+				getUsec = 1;
+			printf( "%12lld %-16s %12.1f %12.1f\n", size,
+			        ioMode == IO_COPY_RANGE ? "copy_file_range" : ( mode == IO_COPY_RANGE ? "vector (fallback)" : "preadv/pwritev" ),
+			        (double)size / putUsec, (double)size / getUsec );
+		}
+	}
+
+	unlink( "iobench.tmp" );
+	unlink( "iobench.out" );
+	ioMode = savedMode;
+	verbose = 1;
+	return;
+}
+
+
+/*
+ * Function: stressThread / stressTest
+ * Parameters: threadsString - Optional largest number of threads (default one per CPU)
+ *             opsString - Optional put/get/del rounds per thread (default 200)
+ *             arg - The thread's number
+ * Returns: none
+ * Description: Runs 1, 2, 4, ... threads at once, each putting, getting and
+ *              deleting its own 256 KiB file, and reports operations per second
+ *              for each thread count so scaling can be seen.  Uses stress.N.tmp
+ *              and stress.N.out in the current directory
+ */
+
+int stressOps;
+
+void *stressThread( void *arg )
+{
+	char name[32], out[32];
+	int id = (int)(intptr_t)arg;
+	int i;
+
+	snprintf( name, sizeof( name ), "stress.%d.tmp", id );
+	snprintf( out, sizeof( out ), "stress.%d.out", id );
+	for( i = 0; i < stressOps; i++ )
+	{
+		putFile( name );
+		getFile( name, out );
+		delFile( name );
+	}
+	return NULL;
+}
+
+void stressTest( char *threadsString, char *opsString )
+{
+	static char chunk[1 << 18];
+	pthread_t threads[256];
+	char name[32];
+	struct timeval start;
+	long long usec;
+	int maxThreads = sysconf( _SC_NPROCESSORS_ONLN );
+	int i, n, fd;
+
+	stressOps = 200;
+	if( threadsString != NULL )
+		maxThreads = atoi( threadsString );
+	if( opsString != NULL )
+		stressOps = atoi( opsString );
+	if( maxThreads < 1 || maxThreads > 256 || stressOps < 1 )
+	{
+		printf( "stress error: use 1 to 256 threads and at least 1 round\n" );
+		return;
+	}
+
+	// One host file per thread
+	for( i = 0; i < (int)sizeof( chunk ); i++ )
+		chunk[i] = rand();
+	for( i = 0; i < maxThreads; i++ )
+	{
+		snprintf( name, sizeof( name ), "stress.%d.tmp", i );
+		fd = open( name, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+		if( fd == -1 || write( fd, chunk, sizeof( chunk ) ) != sizeof( chunk ) )
+		{
+			perror( "stress error" );
+			if( fd != -1 )
+				close( fd );
+			return;
+		}
+		close( fd );
+	}
+
+	verbose = 0;
+	for( n = 1; n <= maxThreads; n = n * 2 <= maxThreads || n == maxThreads ? n * 2 : maxThreads )
+	{
+		gettimeofday( &start, NULL );
+		for( i = 0; i < n; i++ )
+			pthread_create( &threads[i], NULL, stressThread, (void *)(intptr_t)i );
+		for( i = 0; i < n; i++ )
+			pthread_join( threads[i], NULL );
+		usec = elapsedUsec( &start );
+
+		printf( "%3d threads: %d ops in %lld us, %.0f ops/s\n", n, 3 * n * stressOps, usec,
+		        3.0 * n * stressOps * 1000000.0 / ( usec > 0 ? usec : 1 ) );
+	}
+	verbose = 1;
+
+	for( i = 0; i < maxThreads; i++ )
+	{
+		snprintf( name, sizeof( name ), "stress.%d.tmp", i );
+		unlink( name );
+		snprintf( name, sizeof( name ), "stress.%d.out", i );
+		unlink( name );
+	}
+	return;
+}
+
+
+/*
+ * Function: journalBenchThread / journalBench
+ * Parameters: threadsString - Optional number of threads (default 8)
+ *             opsString - Optional put/del rounds per thread (default 50)
+ *             arg - The thread's number
+ * Returns: none
+ * Description: Measures durable metadata updates.  Each thread puts and deletes
+ *              its own 4 KiB file, first without the journal and a full sync of
+ *              the image after every operation, then with the journal and group
+ *              commit, and reports operations per second and fsyncs for both.
+ *              Uses jbench.N.tmp in the current directory
+ */
+
+int journalBenchOps;
+
+void *journalBenchThread( void *arg )
+{
+	char name[32];
+	int i;
+
+	snprintf( name, sizeof( name ), "jbench.%d.tmp", (int)(intptr_t)arg );
+	for( i = 0; i < journalBenchOps; i++ )
+	{
+		putFile( name );
+		delFile( name );
+	}
+	return NULL;
+}
+
+void journalBench( char *threadsString, char *opsString )
+{
+	static char chunk[4096];
+	pthread_t threads[256];
+	char name[32];
+	struct timeval start;
+	long long usec, commits;
+	int numThreads = 8;
+	int wasActive = journalActive;
+	int i, mode, fd;
+
+	if( imageFd == -1 || sb->journalOffset == 0 )
+	{
+		printf( "journalbench error: needs an image file formatted with a journal\n" );
+		return;
+	}
+
+	journalBenchOps = 50;
+	if( threadsString != NULL )
+		numThreads = atoi( threadsString );
+	if( opsString != NULL )
+		journalBenchOps = atoi( opsString );
+	if( numThreads < 1 || numThreads > 256 || journalBenchOps < 1 )
+	{
+		printf( "journalbench error: use 1 to 256 threads and at least 1 round\n" );
+		return;
+	}
+
+	memset( chunk, 'j', sizeof( chunk ) );
+	for( i = 0; i < numThreads; i++ )
+	{
+		snprintf( name, sizeof( name ), "jbench.%d.tmp", i );
+		fd = open( name, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+		if( fd == -1 || write( fd, chunk, sizeof( chunk ) ) != sizeof( chunk ) )
+		{
+			perror( "journalbench error" );
+			if( fd != -1 )
+				close( fd );
+			return;
+		}
+		close( fd );
+	}
+
+	for( mode = 0; mode < 2; mode++ )
+	{
+		pthread_mutex_lock( &defragLock );
+		if( mode == 0 && journalActive )
+			journalStop();
+		if( mode == 1 && !journalActive && journalStart() == -1 )
+		{
+			pthread_mutex_unlock( &defragLock );
+			break;
+		}
+		pthread_mutex_unlock( &defragLock );
+		syncEveryOp = !mode;
+		commits = journalStats.commits;
+
+		gettimeofday( &start, NULL );
+		for( i = 0; i < numThreads; i++ )
+			pthread_create( &threads[i], NULL, journalBenchThread, (void *)(intptr_t)i );
+		for( i = 0; i < numThreads; i++ )
+			pthread_join( threads[i], NULL );
+		usec = elapsedUsec( &start );
+
+		printf( "journal %-3s %d threads: %d ops in %lld us, %.0f ops/s, %lld fsyncs\n",
+		        mode ? "on" : "off", numThreads, 2 * numThreads * journalBenchOps, usec,
+		        2.0 * numThreads * journalBenchOps * 1000000.0 / ( usec > 0 ? usec : 1 ),
+		        mode ? journalStats.commits - commits : 2LL * numThreads * journalBenchOps );
+	}
+	syncEveryOp = 0;
+
+	pthread_mutex_lock( &defragLock );
+	if( journalActive && !wasActive )
+		journalStop();
+	else if( !journalActive && wasActive )
+		journalStart();
+	pthread_mutex_unlock( &defragLock );
+
+	for( i = 0; i < numThreads; i++ )
+	{
+		snprintf( name, sizeof( name ), "jbench.%d.tmp", i );
+		unlink( name );
+	}
+	return;
+}
+
+
+/*
+ * Function: histRecord / histPercentile
+ * Parameters: hist - A latency histogram
+ *             nsec - A latency to add
+ *             fraction - Which percentile to read, 0.5 for the median
+ * Returns: histPercentile returns the latency at that percentile, in nanoseconds
+ * Description: Log-linear latency histogram: values below HIST_SUB are counted
+ *              exactly, above that each power of two is split into HIST_SUB
+ *              buckets, so every reading is within about 3% of the true value
+ */
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB ( 1 << HIST_SUB_BITS )
+#define HIST_BUCKETS ( 64 * HIST_SUB )
+
+typedef struct
+{
+	long long counts[HIST_BUCKETS];
+	long long count;
+	long long total;
+	long long max;
+} latencyHist;
+
+void histRecord( latencyHist *hist, long long nsec )
+{
+	int bucket, shift;
+
+	if( nsec < HIST_SUB )
+		bucket = nsec < 0 ? 0 : nsec;
+	else
+	{
+		shift = 63 - __builtin_clzll( nsec ) - HIST_SUB_BITS;
+		bucket = ( shift + 1 ) * HIST_SUB + ( ( nsec >> shift ) & ( HIST_SUB - 1 ) );
+	}
+	hist->counts[bucket]++;
+	hist->count++;
+	hist->total += nsec;
+	if( nsec > hist->max )
+		hist->max = nsec;
+	return;
+}
+
+long long histPercentile( latencyHist *hist, double fraction )
+{
+	long long target = (long long)( fraction * hist->count + 0.5 );
+	long long seen = 0;
+	int bucket;
+
+	if( target < 1 )
+		target = 1;
+	for( bucket = 0; bucket < HIST_BUCKETS; bucket++ )
+	{
+		seen += hist->counts[bucket];
+		if( seen >= target )
+		{
+			if( bucket < HIST_SUB )
+				return bucket;
+			return (long long)( HIST_SUB + bucket % HIST_SUB ) << ( bucket / HIST_SUB - 1 );
+		}
+	}
+	return hist->max;
+}
+
+
+/*
+ * Function: workloadSize
+ * Parameters: spec - fixed:N, uniform:MIN:MAX or exp:MEAN, sizes may end in k or m
+ *             seed - A thread's random state
+ * Returns: A file size drawn from the distribution, or -1 if spec is bad
+ * Description: Picks the size of the next file a workload puts
+ */
+
+long long parseSize( const char *text )
+{
+	char *end;
+	long long size = strtoll( text, &end, 10 );
+
+	if( *end == 'k' || *end == 'K' )
+		size <<= 10;
+	else if( *end == 'm' || *end == 'M' )
+		size <<= 20;
+	return size;
+}
+
+long long workloadSize( const char *spec, unsigned int *seed )
+{
+	const char *colon = strchr( spec, ':' );
+	long long low, high, mean;
+	double u, x, e, term;
+	int i;
+
+	if( colon == NULL )
+		return -1;
+
+	if( strncmp( spec, "fixed:", 6 ) == 0 )
+		return parseSize( colon + 1 );
+
+	if( strncmp( spec, "uniform:", 8 ) == 0 && strchr( colon + 1, ':' ) != NULL )
+	{
+		low = parseSize( colon + 1 );
+		high = parseSize( strchr( colon + 1, ':' ) + 1 );
+		if( high < low )
+			return -1;
+		return low + (long long)( ( (double)rand_r( seed ) / ( (double)RAND_MAX + 1 ) ) * ( high - low + 1 ) );
+	}
+
+	if( strncmp( spec, "exp:", 4 ) == 0 )
+	{
+		mean = parseSize( colon + 1 );
+		u = ( rand_r( seed ) + 1.0 ) / ( (double)RAND_MAX + 2.0 );
+
+		// -ln(u) by halving u into [0.5, 1) and summing the series for the rest,
+		// which keeps the program free of libm
+		for( e = 0; u < 0.5; e += 0.69314718055994531 )
+			u *= 2;
+		for( x = 1 - u, term = x, i = 1; i < 40; i++, term *= x )
+			e += term / i;
+		return (long long)( e * mean );
+	}
+	return -1;
+}
+
+
+/*
+ * Function: workloadThread / workload
+ * Parameters: args - key=value settings from the command line:
+ *                        ops=N         operations in total (default 2000)
+ *                        threads=N     threads issuing them (default 1)
+ *                        files=N       files in the working set (default 64)
+ *                        mix=P:G:D:L   weights of put, get, del and list (default 40:40:15:5)
+ *                        size=SPEC     file sizes, see workloadSize (default uniform:1k:64k)
+ *                        seed=N        random seed (default 1)
+ *                        sample=N      operations between fragmentation samples (default ops / 20)
+ *                        csv=FILE      results file (default workload.csv)
+ *             arg - The workloadState for one thread
+ * Returns: none
+ * Description: Drives put, get, del and list with a random mix of operations on
+ *              a working set of files, each thread on its own share of them.
+ *              Every operation is timed into a per-operation histogram.  The
+ *              run reports throughput, p50/p99/p999 latencies, time spent in
+ *              the allocator and how fragmentation changed over the run, on
+ *              screen and as CSV.  Uses wl.N.tmp and wl.N.out in the current
+ *              directory
  */
 
-int displayFree( int display )
+#define WL_PUT 0
+#define WL_GET 1
+#define WL_DEL 2
+#define WL_LIST 3
+#define WL_OPS 4
+
+const char *workloadNames[WL_OPS] = { "put", "get", "del", "list" };
+
+typedef struct
 {
-	int i;
-	int freeSpace = 0;
+	int id;
+	int threads;
+	int files;
+	int ops;
+	int weights[WL_OPS];
+	const char *sizeSpec;
+	unsigned int seed;
+	int sample;
+	char *present;
+	latencyHist hist[WL_OPS];
+	long long failures;
+	FILE *csv;
+	long long startNsec;
+	int *done;
+	pthread_mutex_t *sampleLock;
+} workloadState;
 
-	// Search through the arrayStatus array and check to see if the block is in use
-	for( i = 0; i < NUM_BLOCKS; i++ )
+// What workload files are made of, filled in by workload before its threads start
+char workloadChunk[1 << 16];
+
+int workloadFile( int slot, long long size )
+{
+	char name[32];
+	long long written = 0;
+	int fd, n;
+
+	snprintf( name, sizeof( name ), "wl.%d.tmp", slot );
+	fd = open( name, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if( fd == -1 )
+		return -1;
+
+	while( written < size )
 	{
-		// If the block is in use, bump the free space up one block's worth
-		if( arrayStatus[i] == 0 )
-			freeSpace += BLOCK_SIZE;
+		n = size - written < (long long)sizeof( workloadChunk ) ? size - written : (long long)sizeof( workloadChunk );
+		if( write( fd, workloadChunk, n ) != n )
+		{
+			close( fd );
+			return -1;
+		}
+		written += n;
 	}
+	close( fd );
+	return 0;
+}
 
-	// If the call requested a display, output the free space
-	if( display == 1 )
-		printf( "%d bytes free.\n", freeSpace );
+void workloadSample( workloadState *state, int opsDone )
+{
+	fragReport report;
 
-	// Return the amount free whether a display was requested or not
-	return freeSpace;
+	fragmentation( &report );
+	pthread_mutex_lock( state->sampleLock );
+	fprintf( state->csv, "sample,,%d,%.6f,,,,,,,%lld,%.2f,%lld,%lld,%lld\n", opsDone,
+	         ( nowNsec() - state->startNsec ) / 1e9, allocStats.nsec / 1000,
+	         report.score, report.freeRuns, report.largestFree, (long long)arrayStatus.freeBlocks );
+	pthread_mutex_unlock( state->sampleLock );
+	return;
 }
 
-/*
- * Function: putFile
- * Parameter: filename - A char string that is the file name to load
- *                      into the filesystem
- * Returns: none
- * Description: Determines whether a file is valid to load, determines where to
- *              put it in the filesystem, and loads it
- */
-
-void putFile( char **filename )
+void *workloadThread( void *arg )
 {
-	struct stat buf;
-	int status, copySize, offset, blockIndex, bytes, freeSpace;
-	int i = 0;
-	int fileNum = 0;
-	int sentinel = 0;
-	status = stat( filename, &buf );
-	time_t rawTime;
-
-	// Check free space but don't output the result
-	freeSpace = displayFree( 0 );
+	workloadState *state = arg;
+	char name[32], out[32];
+	long long start, size;
+	int i, op, pick, slot, tries, done;
+	int total = state->weights[0] + state->weights[1] + state->weights[2] + state->weights[3];
 
-	// If the file information loaded correctly, execute this block
-	if( status != -1 )
+	snprintf( out, sizeof( out ), "wl.%d.out", state->id );
+	for( i = 0; i < state->ops; i++ )
 	{
+		// Pick an operation, then a file of ours it makes sense for
+		pick = rand_r( &state->seed ) % total;
+		for( op = 0; pick >= state->weights[op]; op++ )
+			pick -= state->weights[op];
 
-		// Check to see if the file system has enough space to store the requested file
-		if( buf.st_size > freeSpace )
+		slot = -1;
+		for( tries = 0; op != WL_LIST && tries < state->files; tries++ )
 		{
-			printf( "Error: Insufficient free space to store this file.\n" );
-			return;
+			slot = state->id + state->threads * ( rand_r( &state->seed ) % ( ( state->files - state->id + state->threads - 1 ) / state->threads ) );
+			if( state->present[slot] == ( op != WL_PUT ) )
+				break;
+			slot = -1;
 		}
 
-		// Loop through the file directory array and see if this file is already loaded
-		for( i = 0; i < NUM_FILES; i++ )
+		// Nothing to get or delete yet means put, and nowhere to put means get
+		if( slot == -1 && op != WL_LIST )
 		{
-			if( strcmp( fileInfo[i].name, filename ) == 0 )
+			op = op == WL_PUT ? WL_GET : WL_PUT;
+			for( tries = 0; tries < state->files; tries++ )
 			{
-				printf( "file already exists, select another file\n" );
-				return;
+				slot = state->id + state->threads * ( rand_r( &state->seed ) % ( ( state->files - state->id + state->threads - 1 ) / state->threads ) );
+				if( state->present[slot] == ( op != WL_PUT ) )
+					break;
+				slot = -1;
 			}
+			if( slot == -1 )
+				continue;
 		}
+		snprintf( name, sizeof( name ), "wl.%d.tmp", slot );
 
-		// Find a directory entry to use for this file
-		for( i = 0; i < NUM_FILES && sentinel == 0; i++ )
+		start = nowNsec();
+		if( op == WL_PUT )
+			putFile( name );
+		else if( op == WL_GET )
+			getFile( name, out );
+		else if( op == WL_DEL )
+			delFile( name );
+		else
+			listFiles();
+		histRecord( &state->hist[op], nowNsec() - start );
+
+		if( op == WL_PUT )
 		{
-			if( fileInfo[i].valid == 0 )
-			{
-				// This entry is free, set the directory information and
-				// break the sentinel to stop looking for free entries
-				sentinel = 1;
-				fileNum = i;
-				fileInfo[fileNum].valid = 1;
-				strcpy( fileInfo[fileNum].name, filename );
-				time ( &rawTime );
-				fileInfo[fileNum].timeStamp = localtime ( &rawTime );
-				fileInfo[fileNum].size = buf.st_size;
-			}
+			state->present[slot] = dirLookup( name ) != -1;
+			state->failures += !state->present[slot];
+		}
+		else if( op == WL_DEL )
+		{
+			// Give the next put of this file a fresh size, outside the timing
+			state->present[slot] = 0;
+			size = workloadSize( state->sizeSpec, &state->seed );
+			workloadFile( slot, size );
 		}
 
-		// If it looped through the whole directory and couldn't find an available
-		// entry to use
-		if( sentinel == 0 )
+		done = __atomic_add_fetch( state->done, 1, __ATOMIC_RELAXED );
+		if( done % state->sample == 0 )
+			workloadSample( state, done );
+	}
+	return NULL;
+}
+
+void workload( char **args )
+{
+	workloadState *states;
+	latencyHist *all;
+	pthread_t threads[64];
+	pthread_mutex_t sampleLock = PTHREAD_MUTEX_INITIALIZER;
+	char *present;
+	char *csvName = "workload.csv";
+	char name[32];
+	unsigned int seed = 1;
+	long long elapsed, count, size;
+	double seconds;
+	int ops = 2000;
+	int numThreads = 1;
+	int files = 64;
+	int sample = 0;
+	int weights[WL_OPS] = { 40, 40, 15, 5 };
+	const char *sizeSpec = "uniform:1k:64k";
+	int done = 0;
+	int stdoutCopy, devNull;
+	int i, op, b;
+
+	for( i = 0; args[i] != NULL; i++ )
+	{
+		if( strncmp( args[i], "ops=", 4 ) == 0 )
+			ops = atoi( args[i] + 4 );
+		else if( strncmp( args[i], "threads=", 8 ) == 0 )
+			numThreads = atoi( args[i] + 8 );
+		else if( strncmp( args[i], "files=", 6 ) == 0 )
+			files = atoi( args[i] + 6 );
+		else if( strncmp( args[i], "seed=", 5 ) == 0 )
+			seed = atoi( args[i] + 5 );
+		else if( strncmp( args[i], "sample=", 7 ) == 0 )
+			sample = atoi( args[i] + 7 );
+		else if( strncmp( args[i], "size=", 5 ) == 0 )
+			sizeSpec = args[i] + 5;
+		else if( strncmp( args[i], "csv=", 4 ) == 0 )
+			csvName = args[i] + 4;
+		else if( strncmp( args[i], "mix=", 4 ) == 0 &&
+		         sscanf( args[i] + 4, "%d:%d:%d:%d", &weights[0], &weights[1], &weights[2], &weights[3] ) == 4 )
+			continue;
+		else
 		{
-			printf( "insufficient file directory space\n" );
+			printf( "workload error: unknown setting %s\n", args[i] );
 			return;
 		}
+	}
+	if( ops < 1 || numThreads < 1 || numThreads > 64 || files < numThreads || files > sb->numFiles ||
+	    weights[0] < 0 || weights[1] < 0 || weights[2] < 0 || weights[3] < 0 ||
+	    weights[0] + weights[1] + weights[2] + weights[3] == 0 || workloadSize( sizeSpec, &seed ) < 0 )
+	{
+		printf( "workload error: need ops > 0, 1-64 threads, threads <= files <= %d, a non-zero mix and a valid size\n", sb->numFiles );
+		return;
+	}
+	if( sample <= 0 )
+		sample = ops / 20 > 0 ? ops / 20 : 1;
 
-		// Now we have the file directory entry set, this section actually copies the file
-		FILE *ifp = fopen ( filename, "r" );
-		copySize = buf.st_size;
-		offset = 0;
-		blockIndex = 0;
+	states = calloc( numThreads, sizeof( workloadState ) );
+	all = calloc( WL_OPS, sizeof( latencyHist ) );
+	present = calloc( files, 1 );
+	if( states == NULL || all == NULL || present == NULL )
+	{
+		printf( "workload error: out of memory\n" );
+		free( states );
+		free( all );
+		free( present );
+		return;
+	}
+
+	// Text-like contents, so compression and dedup have something to work with
+	for( i = 0; i < (int)sizeof( workloadChunk ); i++ )
+		workloadChunk[i] = "abcdefgh ijklmnop\n"[rand_r( &seed ) % 18];
 
-		// While there is still data left to copy
-		while( copySize > 0 && blockIndex < NUM_BLOCKS )
+	// The working set starts out on the host only
+	for( i = 0; i < files; i++ )
+	{
+		size = workloadSize( sizeSpec, &seed );
+		snprintf( name, sizeof( name ), "wl.%d.tmp", i );
+		if( dirLookup( name ) != -1 || workloadFile( i, size ) == -1 )
 		{
-			// Seek the correct distance into the input file
-			fseek( ifp, offset, SEEK_SET );
+			printf( "workload error: can't set up %s, or it is already stored\n", name );
+			free( states );
+			free( all );
+			free( present );
+			return;
+		}
+	}
 
-			// If the next file index is undefined
-			if( fileInfo[fileNum].index[blockIndex] == -1 )
-			{
-				i = 0;
-				// Search for the next free block in our file system
-				while( fileInfo[fileNum].index[blockIndex] == -1 && i < NUM_BLOCKS )
-				{
-					if( arrayStatus[i] == 0 )
-						fileInfo[fileNum].index[blockIndex] = i;
-					i++;
-				}
-			}
+	states[0].csv = fopen( csvName, "w" );
+	if( states[0].csv == NULL )
+	{
+		perror( csvName );
+		free( states );
+		free( all );
+		free( present );
+		return;
+	}
+	fprintf( states[0].csv, "kind,name,ops,seconds,ops_per_sec,mean_us,p50_us,p99_us,p999_us,max_us,alloc_us,frag_score,free_runs,largest_free_run,free_blocks\n" );
 
-			// Copy BLOCK_SIZE amount of data into the correct block
-			bytes = fread( fileData[fileInfo[fileNum].index[blockIndex]], BLOCK_SIZE, 1, ifp );
+	// Keep the operations' own output out of the way while they run
+	fflush( stdout );
+	stdoutCopy = dup( STDOUT_FILENO );
+	devNull = open( "/dev/null", O_WRONLY );
+	dup2( devNull, STDOUT_FILENO );
+	verbose = 0;
+	allocStats.calls = 0;
+	allocStats.nsec = 0;
+	allocTiming = 1;
 
-			// Set the block status to "in use"
-			arrayStatus[fileInfo[fileNum].index[blockIndex]] = 1;
+	for( i = 0; i < numThreads; i++ )
+	{
+		states[i].id = i;
+		states[i].threads = numThreads;
+		states[i].files = files;
+		states[i].ops = ops / numThreads + ( i < ops % numThreads );
+		memcpy( states[i].weights, weights, sizeof( weights ) );
+		states[i].sizeSpec = sizeSpec;
+		states[i].seed = seed + i * 7919;
+		states[i].sample = sample;
+		states[i].present = present;
+		states[i].csv = states[0].csv;
+		states[i].done = &done;
+		states[i].sampleLock = &sampleLock;
+	}
+	states[0].startNsec = nowNsec();
+	for( i = 0; i < numThreads; i++ )
+		states[i].startNsec = states[0].startNsec;
+	workloadSample( &states[0], 0 );
 
-			// Check for file read errors
-			if( bytes == 0 && !feof( ifp ) )
-			{
-				printf( "An error occured reading from the input file.\n" );
-				return -1;
-			}
+	for( i = 0; i < numThreads; i++ )
+		pthread_create( &threads[i], NULL, workloadThread, &states[i] );
+	for( i = 0; i < numThreads; i++ )
+		pthread_join( threads[i], NULL );
+	elapsed = nowNsec() - states[0].startNsec;
+	if( done % sample != 0 )
+		workloadSample( &states[0], done );
 
-			// Then iterate our variables and do the same thing for the next block
-			clearerr( ifp );
-			copySize -= BLOCK_SIZE;
-			offset += BLOCK_SIZE;
-			blockIndex ++;
-		}
+	allocTiming = 0;
+	verbose = 1;
+	fflush( stdout );
+	dup2( stdoutCopy, STDOUT_FILENO );
+	close( stdoutCopy );
+	close( devNull );
 
-		// This shouldn't be necessary, if displayFree returns the correct data, but
-		// I left it in as a failsafe.  This is leftover code from a previous version
-		if( copySize > 0 )
+	// Merge the threads' histograms and report
+	seconds = elapsed / 1e9;
+	count = 0;
+	for( i = 0; i < numThreads; i++ )
+	{
+		for( op = 0; op < WL_OPS; op++ )
 		{
-			printf( "Error: insufficient filesystem space to store this file.\n" );
-			delFile( filename );
+			for( b = 0; b < HIST_BUCKETS; b++ )
+				all[op].counts[b] += states[i].hist[op].counts[b];
+			all[op].count += states[i].hist[op].count;
+			all[op].total += states[i].hist[op].total;
+			if( states[i].hist[op].max > all[op].max )
+				all[op].max = states[i].hist[op].max;
 		}
-		// After we're done copying, close the input file handle
-		fclose( ifp );
+		count += states[i].failures;
 	}
 
-	// If opening the file failed (status == -1)
-	else
+	printf( "%d ops, %d threads, %.3f s, %.0f ops/s, %lld failed puts\n", done, numThreads, seconds,
+	        done / ( seconds > 0 ? seconds : 1 ), count );
+	printf( "op       count      ops/s    mean us     p50 us     p99 us    p999 us     max us\n" );
+	for( op = 0; op < WL_OPS; op++ )
 	{
-		printf( "Unable to open file: %s\n", filename );
-		perror( "Opening the input file returned: " );
-		return -1;
+		if( all[op].count == 0 )
+			continue;
+		printf( "%-6s %7lld %10.0f %10.1f %10.1f %10.1f %10.1f %10.1f\n", workloadNames[op], all[op].count,
+		        all[op].count / ( seconds > 0 ? seconds : 1 ), all[op].total / 1000.0 / all[op].count,
+		        histPercentile( &all[op], 0.5 ) / 1000.0, histPercentile( &all[op], 0.99 ) / 1000.0,
+		        histPercentile( &all[op], 0.999 ) / 1000.0, all[op].max / 1000.0 );
+		fprintf( states[0].csv, "op,%s,%lld,%.6f,%.1f,%.3f,%.3f,%.3f,%.3f,%.3f,,,,,\n", workloadNames[op], all[op].count,
+		         seconds, all[op].count / ( seconds > 0 ? seconds : 1 ), all[op].total / 1000.0 / all[op].count,
+		         histPercentile( &all[op], 0.5 ) / 1000.0, histPercentile( &all[op], 0.99 ) / 1000.0,
+		         histPercentile( &all[op], 0.999 ) / 1000.0, all[op].max / 1000.0 );
+	}
+	printf( "allocator: %lld calls, %.1f ms, %.0f ns/call\n", allocStats.calls, allocStats.nsec / 1e6,
+	        allocStats.calls > 0 ? (double)allocStats.nsec / allocStats.calls : 0.0 );
+	fprintf( states[0].csv, "alloc,allocator,%lld,%.6f,,,,,,,%.3f,,,,\n", allocStats.calls, seconds, allocStats.nsec / 1000.0 );
+	fclose( states[0].csv );
+	printf( "results in %s\n", csvName );
+
+	// Leave the file system as we found it
+	for( i = 0; i < files; i++ )
+	{
+		snprintf( name, sizeof( name ), "wl.%d.tmp", i );
+		if( present[i] )
+			delFile( name );
+		unlink( name );
+	}
+	for( i = 0; i < numThreads; i++ )
+	{
+		snprintf( name, sizeof( name ), "wl.%d.out", i );
+		unlink( name );
 	}
+	free( states );
+	free( all );
+	free( present );
 	return;
 }
 
 
 /*
- * Function: getFile
- * Parameters: Two char arrays, one for the file to retrieve from the file system
- *              and the other for an optional new name for the output file
+ * Function: putBench
+ * Parameters: filesString - Optional number of files to put (default 10000)
+ *             sizeString - Optional size of each file, may end in k or m (default 4k)
  * Returns: none
- * Description: Copies a file from our file system back onto disk.  The output
- *              name is the same as the original file name by default, but is
- *              customizable using a second parameter
+ * Description: Ingest benchmark for lots of small files.  Puts the same files
+ *              with a putFile loop and then with putBatch, deleting them in
+ *              between, and reports files/s and MB/s for each.  The image needs
+ *              enough free directory entries; the files are made in putbench.d
+ *              in the current directory and removed afterwards
  */
 
-void getFile( char **filename, char **newFilename )
+void putBench( char *filesString, char *sizeString )
 {
-	struct stat buf;
-	int status, offset, numBytes;
-	int blockIndex = 0;
-	int valid = 0;
-	int i = 0;
-	int fileNum = 0;
-
-	// Check to see if there is a new filename, if not then reuse the original name
-	if( newFilename == NULL )
-		newFilename = filename;
+	struct timeval start;
+	char **names;
+	char *chunk;
+	long long size, usec[2];
+	int numFiles, mode, fd, i, stored;
+	int wasVerbose = verbose;
 
-	// Find the directory entry for the file specified
-	for( i = 0; i < NUM_FILES; i++ )
+	numFiles = filesString != NULL ? atoi( filesString ) : 10000;
+	size = sizeString != NULL ? parseSize( sizeString ) : 4096;
+	if( numFiles < 1 || size < 0 || numFiles > sb->numFiles - sb->nextSlot + sb->numFreeSlots )
 	{
-		if( strcmp( fileInfo[i].name, filename ) == 0 )
-		{
-			fileNum = i;
-			valid = 1;
-		}
+		printf( "putbench error: need 1 to %d files, format the image with more entries for more\n",
+		        sb->numFiles - sb->nextSlot + sb->numFreeSlots );
+		return;
 	}
-
-	// If the file isn't in the directory, return an error
-	if( valid == 0 )
+	if( ( ( size + blockSize - 1 ) / blockSize ) * blockSize * numFiles > displayFree( 0 ) )
 	{
-		printf( "get error: File not found\n" );
+		printf( "putbench error: not enough free space for %d files of %lld bytes\n", numFiles, size );
 		return;
 	}
 
-	// Set our variables to prepare for coyping back to disk
-	int copySize = fileInfo[fileNum].size;
-	FILE *ofp;
-	ofp = fopen( newFilename, "w" );
-	if( ofp == NULL )
+	names = calloc( numFiles + 1, sizeof( char * ) );
+	chunk = malloc( size + 1 );
+	if( names == NULL || chunk == NULL || ( mkdir( "putbench.d", 0755 ) == -1 && errno != EEXIST ) )
 	{
-		printf( "Could not open output file: %s\n", newFilename );
+		perror( "putbench error" );
+		free( names );
+		free( chunk );
 		return;
 	}
+	for( i = 0; i < size; i++ )
+		chunk[i] = 'a' + i % 26;
+	for( i = 0; i < numFiles; i++ )
+	{
+		names[i] = malloc( 32 );
+		snprintf( names[i], 32, "putbench.d/%d", i );
+		fd = open( names[i], O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+		if( fd == -1 || write( fd, chunk, size ) != size )
+			perror( names[i] );
+		if( fd != -1 )
+			close( fd );
+	}
 
-	// After the output file opens successfully, tell the user how much we are copying
-	printf( "Writing %d bytes to %s\n", fileInfo[fileNum].size, newFilename );
-
-	// While data is left to copy, do this loop
-	while( copySize > 0 )
+	verbose = 0;
+	for( mode = 0; mode < 2; mode++ )
 	{
-		// Check to see if we're copying a full block or just part of one
-		if( copySize < BLOCK_SIZE )
-			numBytes = copySize;
+		gettimeofday( &start, NULL );
+		if( mode == 0 )
+		{
+			for( i = 0; i < numFiles; i++ )
+				putFile( names[i] );
+			stored = numFiles;
+		}
 		else
-			numBytes = BLOCK_SIZE;
+			stored = putBatch( names, numFiles );
+		usec[mode] = elapsedUsec( &start );
+		if( usec[mode] < 1 )
+			usec[mode] = 1;
 
-		// Write the block to our output file
-		fwrite( fileData[fileInfo[fileNum].index[blockIndex]], numBytes, 1, ofp );
+		printf( "%-6s %d files in %lld us, %.0f files/s, %.1f MB/s\n", mode ? "batch" : "loop",
+		        stored, usec[mode], numFiles * 1e6 / usec[mode], (double)size * numFiles / usec[mode] );
 
-		// Iterate our variables
-		copySize -= BLOCK_SIZE;
-		offset += BLOCK_SIZE;
-		blockIndex ++;
+		for( i = 0; i < numFiles; i++ )
+			delFile( names[i] );
+	}
+	verbose = wasVerbose;
+	printf( "batch is %.2fx the loop\n", (double)usec[0] / usec[1] );
 
-		// Update our file offset and repeat
-		fseek( ofp, offset, SEEK_SET );
+	for( i = 0; i < numFiles; i++ )
+	{
+		unlink( names[i] );
+		free( names[i] );
 	}
+	rmdir( "putbench.d" );
+	free( names );
+	free( chunk );
+	return;
+}
 
-	// After the file is done copying, close the file handle
-	fclose( ofp );
+
+/*
+ * Function: layoutImage
+ * Parameters: super - The superblock to fill in
+ *             blocks, size, files - The format parameters
+ * Returns: none
+ * Description: Records the format parameters and works out where each region of
+ *              the image goes and how big the image is
+ */
+
+void layoutImage( superBlock *super, int blocks, int size, int files )
+{
+	long long offset;
+	int align = size > SUPER_SIZE ? size : SUPER_SIZE;
+
+	super->magic = MFS_MAGIC;
+	super->blockSize = size;
+	super->numBlocks = blocks;
+	super->numFiles = files;
+
+	// Hash index is the next power of two at least twice the number of files
+	for( super->hashSize = 2; super->hashSize < 2 * files; super->hashSize *= 2 );
+
+	// Superblock, bitmap, directory, hash index, free entry stack, dedup metadata,
+	// the journal, then the data region aligned to a block so the blocks never
+	// straddle pages
+	offset = SUPER_SIZE;
+	super->bitmapOffset = offset;
+	offset += ( ( blocks + 63 ) / 64 ) * sizeof( uint64_t );
+	super->dirOffset = offset;
+	offset += (long long)files * sizeof( fileInfoStruct );
+	offset = ( offset + 7 ) & ~7LL;
+	super->hashOffset = offset;
+	offset += (long long)super->hashSize * sizeof( int );
+	super->freeSlotsOffset = offset;
+	offset += (long long)files * sizeof( int );
+
+	// Dedup metadata: a count and fingerprint per block and the fingerprint index
+	for( super->fpIndexSize = 2; super->fpIndexSize < 2 * blocks; super->fpIndexSize *= 2 );
+	offset = ( offset + 7 ) & ~7LL;
+	super->fingerprintOffset = offset;
+	offset += (long long)blocks * sizeof( uint64_t );
+	super->refOffset = offset;
+	offset += (long long)blocks * sizeof( unsigned int );
+	super->fpIndexOffset = offset;
+	offset += (long long)super->fpIndexSize * sizeof( int );
+
+	// Journal, page aligned, with room for two transactions that touch every
+	// page of the metadata in front of it
+	offset = ( offset + JOURNAL_PAGE - 1 ) / JOURNAL_PAGE * JOURNAL_PAGE;
+	super->journalOffset = offset;
+	super->journalPages = 1 + 2 * journalTransactionPages( offset / JOURNAL_PAGE );
+	if( super->journalPages < JOURNAL_MIN_PAGES )
+		super->journalPages = JOURNAL_MIN_PAGES;
+	offset += (long long)super->journalPages * JOURNAL_PAGE;
+
+	super->dataOffset = ( offset + align - 1 ) / align * align;
+	super->imageSize = super->dataOffset + (long long)blocks * size;
 	return;
 }
 
 
 /*
- * Function: delFile
- * Parameter: A char string that is the filename of the file to delete
+ * Function: formatImage
+ * Parameters: base - Zero filled memory to lay the file system out in
+ *             blocks, size, files - The format parameters
  * Returns: none
- * Description: Removes a file from the filesystem.
+ * Description: Writes the superblock and the empty bitmap.  Everything else is
+ *              already correct as zeroes
  */
 
-void delFile( char **filename )
+void formatImage( unsigned char *base, int blocks, int size, int files )
 {
-	int fileNum = -1;
-	int valid = 0;
-	int i;
+	superBlock *super = (superBlock *)base;
+	blockBitmap bm;
+
+	layoutImage( super, blocks, size, files );
+	bitmapInit( &bm, (uint64_t *)( base + super->bitmapOffset ), blocks );
+	super->freeBlocks = bm.freeBlocks;
+	super->hint = 0;
+	super->numFreeSlots = 0;
+	super->nextSlot = 0;
+	super->clean = 1;
+	return;
+}
+
+
+/*
+ * Function: mountImage
+ * Parameter: none
+ * Returns: 0 on success, -1 if the mapped image isn't a usable file system
+ * Description: Points the globals at the regions of the mapped image.  This is
+ *              constant time unless the image wasn't unmounted cleanly, in which
+ *              case the free block count and free entry stack are rebuilt
+ */
+
+int mountImage( void )
+{
+	int i, words;
+	long long used = 0;
+
+	sb = (superBlock *)image;
+	if( imageSize < SUPER_SIZE || sb->magic != MFS_MAGIC || sb->imageSize > imageSize )
+	{
+		printf( "mount error: not an mfs image\n" );
+		return -1;
+	}
+
+	// Bring back anything committed to the journal but not yet written home
+	journalReplay();
+
+	blockSize = sb->blockSize;
+	fileData = mapSize > sb->dataOffset ? image + sb->dataOffset : NULL;
+	fileInfo = (fileInfoStruct *)( image + sb->dirOffset );
+	dirHash = (int *)( image + sb->hashOffset );
+	hashMask = sb->hashSize - 1;
+	freeSlots = (int *)( image + sb->freeSlotsOffset );
+	refCount = (unsigned int *)( image + sb->refOffset );
+	fingerprints = (uint64_t *)( image + sb->fingerprintOffset );
+	fpIndex = (int *)( image + sb->fpIndexOffset );
+	fpMask = sb->fpIndexSize - 1;
 
-	// Find the file directory entry of the file to delete
-	for( i = 0; i < NUM_FILES; i++ )
+	// The entry locks only live in memory
+	fileLocks = malloc( sb->numFiles * sizeof( pthread_rwlock_t ) );
+	if( fileLocks == NULL )
 	{
-		if( strcmp( fileInfo[i].name, filename ) == 0 && fileInfo[i].valid == 1 )
+		printf( "mount error: out of memory\n" );
+		return -1;
+	}
+	for( i = 0; i < sb->numFiles; i++ )
+		pthread_rwlock_init( &fileLocks[i], NULL );
+
+	words = ( sb->numBlocks + 63 ) / 64;
+	arrayStatus.words = (uint64_t *)( image + sb->bitmapOffset );
+	arrayStatus.numBlocks = sb->numBlocks;
+	arrayStatus.numWords = words;
+	arrayStatus.freeBlocks = sb->freeBlocks;
+	arrayStatus.hint = sb->hint;
+	bitmapShards( &arrayStatus );
+
+	// The counters were only written back if the last session quit properly
+	if( sb->clean == 0 )
+	{
+		printf( "Image was not unmounted cleanly, recounting free space\n" );
+		for( i = 0; i < words; i++ )
+			used += __builtin_popcountll( arrayStatus.words[i] );
+		arrayStatus.freeBlocks = words * 64 - used;
+
+		sb->sharedBlocks = 0;
+		for( i = 0; i < sb->numBlocks; i++ )
+		{
+			if( refCount[i] > 1 )
+				sb->sharedBlocks += refCount[i] - 1;
+		}
+
+		sb->numFreeSlots = 0;
+		sb->logicalBlocks = 0;
+		sb->compressedBytes = 0;
+		sb->storedBytes = 0;
+		for( i = 0; i < sb->nextSlot; i++ )
 		{
-			fileNum = i;
-			valid = 1;
+			if( fileInfo[i].valid == 0 )
+				freeSlots[sb->numFreeSlots++] = i;
+			else
+				sb->logicalBlocks += ( fileInfo[i].size + blockSize - 1 ) / blockSize;
+			if( fileInfo[i].valid && ( fileInfo[i].flags & FILE_COMPRESSED ) )
+			{
+				sb->compressedBytes += fileInfo[i].size;
+				sb->storedBytes += fileInfo[i].storedSize;
+			}
 		}
 	}
 
-	// If the file does not have a directory entry, return an error
-	if( valid == 0 )
+	sb->clean = 0;
+	return 0;
+}
+
+
+/*
+ * Function: openImage
+ * Parameters: path - The image file, or NULL for a file system that lives in memory
+ *             format - 1 to create a new image with the given parameters, 0 to
+ *                      mount an existing one
+ *             blocks, size, files - Format parameters
+ *             cacheBlocks - Size of the buffer cache, or 0 to map the whole image
+ * Returns: 0 on success, -1 on error
+ * Description: Maps the image shared so changes go straight back to the file, and
+ *              mounts it.  With a buffer cache only the metadata is mapped and
+ *              data blocks are read and written through the cache
+ */
+
+int openImage( char *path, int format, int blocks, int size, int files, int cacheBlocks )
+{
+	struct stat buf;
+	superBlock layout;
+
+	if( cacheBlocks > 0 && path == NULL )
 	{
-		printf( "del error: File not found\n" );
-		return;
+		printf( "cache error: the buffer cache needs an image file\n" );
+		return -1;
+	}
+
+	if( format )
+	{
+		if( blocks < 1 || files < 1 || size < 512 || ( size & ( size - 1 ) ) != 0 )
+		{
+			printf( "format error: need blocks > 0, files > 0 and a power of two block size >= 512\n" );
+			return -1;
+		}
+		layoutImage( &layout, blocks, size, files );
+		imageSize = layout.imageSize;
 	}
 
-	// Loop through the indices in the directory entry
-	for( i = 0; fileInfo[fileNum].index[i] != -1 && i < 32; i++ )
+	if( path == NULL )
+	{
+		mapSize = imageSize;
+		image = mmap( NULL, imageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+	}
+	else
 	{
+		imageFd = open( path, format ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644 );
+		if( imageFd == -1 )
+		{
+			perror( path );
+			return -1;
+		}
 
-		// Set the block to "not in use"
-		arrayStatus[fileInfo[fileNum].index[i]] = 0;
+		// A new image is sized up front, the untouched parts stay sparse zeroes
+		if( format && ftruncate( imageFd, imageSize ) == -1 )
+		{
+			perror( "ftruncate" );
+			return -1;
+		}
+		fstat( imageFd, &buf );
+		imageSize = buf.st_size;
 
-		// Reset the directory index to "none"
-		fileInfo[fileNum].index[i] = -1;
+		// Find out where the data region starts so we can leave it unmapped
+		mapSize = imageSize;
+		if( cacheBlocks > 0 && !format )
+		{
+			if( pread( imageFd, &layout, sizeof( layout ), 0 ) != sizeof( layout ) || layout.magic != MFS_MAGIC )
+			{
+				printf( "mount error: not an mfs image\n" );
+				return -1;
+			}
+		}
+		if( cacheBlocks > 0 )
+			mapSize = layout.dataOffset;
+		image = mmap( NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, imageFd, 0 );
 	}
 
-	// Blank the directory information
-	fileInfo[fileNum].name[0] = '\0';
-	fileInfo[fileNum].valid = 0;
+	if( image == MAP_FAILED )
+	{
+		perror( "mmap" );
+		return -1;
+	}
 
-	return;
+	if( format )
+		formatImage( image, blocks, size, files );
+	if( mountImage() == -1 )
+		return -1;
+	if( cacheBlocks > 0 && cacheInit( cacheBlocks ) == -1 )
+		return -1;
+	if( sb->journal && journalStart() == -1 )
+		return -1;
+	return 0;
 }
 
 
 /*
- * Function: listFiles
+ * Function: syncImage
  * Parameter: none
  * Returns: none
- * Description: Lists the files currently in the file directory
+ * Description: Flushes the image with flushImage, or with a journal commits and
+ *              checkpoints
  */
 
-void listFiles( void )
+void syncImage( void )
 {
-	int i;
-	char buffer [20];
+	// With a journal, commit and write everything home
+	if( journalActive )
+		journalFlush( 1 );
+	else
+		flushImage();
+	return;
+}
 
-	// Loop through each directory entry
-	for( i = 0; i < NUM_FILES; i++ )
-	{
 
-		// If this entry is in use, display the file information
-		if( fileInfo[i].valid == 1 )
-		{
-			strftime( buffer, 20, "%h %d %H:%M", fileInfo[i].timeStamp );
-			printf( "%d\t%s %s\n", fileInfo[i].size, buffer, fileInfo[i].name );
-		}
-	}
+/*
+ * Function: closeImage
+ * Parameter: none
+ * Returns: none
+ * Description: Stops background defrag, marks the image clean, flushes it and
+ *              unmaps it
+ */
+
+void closeImage( void )
+{
+	defragStop();
+	cacheShutdown();
+	sb->clean = 1;
+	syncImage();
+	munmap( image, mapSize );
+	if( imageFd != -1 )
+		close( imageFd );
 	return;
 }
 
 
 /*
  * Function: main
- * Parameter: none
+ * Parameters: The command line, which picks the backing store:
+ *                 mfs                                 - in-memory file system
+ *                 mfs image.img                       - mount an existing image
+ *                 mfs -f image.img [blocks] [blocksize] [files] - format and mount
+ *             Either image form can be preceded by -c blocks to go through a
+ *             buffer cache of that many blocks instead of mapping the data
  * Returns: An int; 0 for success, 1 if there was an error
  * Description: The main program loop
  */
 
-int main( void )
+int main( int argc, char **argv )
 {
 	int quit = 0;
-	int i, j;
+	int status;
+	int cacheBlocks = 0;
 	char *rawInput;
 	char **parsedInput;
 
-	// Initialize our block status array to unused (0)
-	for ( i = 0; i < NUM_BLOCKS; i++ )
+	// Take the cache size off the front of the arguments
+	if( argc > 2 && strcmp( argv[1], "-c" ) == 0 )
 	{
-		arrayStatus[i] = 0;
+		cacheBlocks = atoi( argv[2] );
+		argc -= 2;
+		argv += 2;
 	}
 
-	// Initialize our file directory to null/unused
-	for ( i = 0; i < NUM_FILES; i++ )
+	// Mount or format the image the user asked for, or make one in memory
+	if( argc == 1 )
+		status = openImage( NULL, 1, DEFAULT_BLOCKS, DEFAULT_BLOCK_SIZE, DEFAULT_FILES, cacheBlocks );
+	else if( strcmp( argv[1], "-f" ) == 0 && argc > 2 )
+		status = openImage( argv[2], 1,
+		                    argc > 3 ? atoi( argv[3] ) : DEFAULT_BLOCKS,
+		                    argc > 4 ? atoi( argv[4] ) : DEFAULT_BLOCK_SIZE,
+		                    argc > 5 ? atoi( argv[5] ) : DEFAULT_FILES, cacheBlocks );
+	else if( argv[1][0] != '-' )
+		status = openImage( argv[1], 0, 0, 0, 0, cacheBlocks );
+	else
 	{
-		fileInfo[i].valid = 0;
-		fileInfo[i].name[0] = '\0';
-		for ( j = 0; j < 32; j++ )
-		{
-			fileInfo[i].index[j] = -1;
-		}
+		printf( "usage: mfs [-c cacheblocks] [image] | mfs [-c cacheblocks] -f image [blocks] [blocksize] [files]\n" );
+		return 1;
 	}
+	if( status == -1 )
+		return 1;
 
 	// Main program loop
 	while( quit == 0 )
@@ -448,18 +6272,27 @@ int main( void )
 		// Print a prompt
 		printf( "mfs> ");
 
-		// Get input from user
+		// Get input from user, treating end of input like quit so the image is
+		// still flushed and marked clean
 		rawInput = readline();
+		if( rawInput == NULL )
+		{
+			quit = 1;
+			continue;
+		}
 
 		// Parse the input into a useable array
 		parsedInput = parse_command( rawInput );
 
 		// Find out what to do with the input array
-		if ( parsedInput[0] == NULL )
-			printf( "");
+		if ( parsedInput == NULL )
+			printf( "Out of memory, please try again\n" );
+
+		else if ( parsedInput[0] == NULL )
+			;
 
 		else if ( strcmp( parsedInput[0], "put" ) == 0 )
-			putFile( parsedInput[1] );
+			putFiles( parsedInput + 1 );
 
 		else if ( strcmp( parsedInput[0], "get" ) == 0 )
 			getFile( parsedInput[1], parsedInput[2] );
@@ -473,11 +6306,58 @@ int main( void )
 		else if ( strcmp( parsedInput[0], "df" ) == 0 )
 			displayFree( 1 );
 
+		else if ( strcmp( parsedInput[0], "fsync" ) == 0 )
+			syncImage();
+
+		else if ( strcmp( parsedInput[0], "cachestat" ) == 0 )
+			cacheStat();
+
+		else if ( strcmp( parsedInput[0], "dedup" ) == 0 )
+			setDedup( parsedInput[1] );
+
+		else if ( strcmp( parsedInput[0], "compress" ) == 0 )
+			setCompress( parsedInput[1] );
+
+		else if ( strcmp( parsedInput[0], "allocbench" ) == 0 )
+			allocBench( parsedInput[1] );
+
+		else if ( strcmp( parsedInput[0], "iobench" ) == 0 )
+			ioBench( parsedInput[1] );
+
+		else if ( strcmp( parsedInput[0], "stress" ) == 0 )
+			stressTest( parsedInput[1], parsedInput[2] );
+
+		else if ( strcmp( parsedInput[0], "journal" ) == 0 )
+			setJournal( parsedInput[1] );
+
+		else if ( strcmp( parsedInput[0], "journalbench" ) == 0 )
+			journalBench( parsedInput[1], parsedInput[2] );
+
+		else if ( strcmp( parsedInput[0], "workload" ) == 0 )
+			workload( parsedInput + 1 );
+
+		else if ( strcmp( parsedInput[0], "defrag" ) == 0 )
+			defrag( parsedInput[1], parsedInput[2] );
+
+		else if ( strcmp( parsedInput[0], "grep" ) == 0 )
+			grepFiles( parsedInput + 1 );
+
+		else if ( strcmp( parsedInput[0], "putbench" ) == 0 )
+			putBench( parsedInput[1], parsedInput[2] );
+
+		else if ( strcmp( parsedInput[0], "iomode" ) == 0 )
+			setIOMode( parsedInput[1] );
+
 		else if ( strcmp( parsedInput[0], "quit" ) == 0 )
 			quit = 1;
 		else
 			printf( "Unrecognized input, please try again\n" );
+
+		free( parsedInput );
+		free( rawInput );
 	}
 
+	// Flush everything back to the image before we go
+	closeImage();
 	return 0 ;
-}
\ No newline at end of file
+}